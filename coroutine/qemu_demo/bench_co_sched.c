@@ -0,0 +1,133 @@
+/*
+ * M:N coroutine scheduler benchmark
+ *
+ * Spawns pairs of coroutines that play ping-pong: each waits on the pair's
+ * condition variable for its turn, hands the turn over and signals the
+ * other, so every hand-off parks one coroutine and wakes the other.  The
+ * pairs start spread over the workers and are free to move between them.
+ * Reports hand-offs per second for 1, 2, 4... up to the given number of
+ * workers, how that scales from one worker, and how many coroutines were
+ * stolen by idle workers.
+ *
+ * Usage: bench_co_sched [pairs] [round trips per pair] [max workers]
+ */
+#include <time.h>
+#include <unistd.h>
+#include "co_sched.h"
+
+typedef struct Pair {
+    CoSchedMutex lock;
+    CoSchedCond cond;
+    int turn;
+    unsigned long done;
+} Pair;
+
+typedef struct Player {
+    Pair *pair;
+    int side;
+} Player;
+
+static unsigned long rounds;
+
+static int64_t get_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void coroutine_fn play(void *opaque)
+{
+    Player *player = opaque;
+    Pair *pair = player->pair;
+    unsigned long i;
+
+    for (i = 0; i < rounds; i++) {
+        co_sched_mutex_lock(&pair->lock);
+        while (pair->turn != player->side) {
+            co_sched_cond_wait(&pair->cond, &pair->lock);
+        }
+        pair->turn = !player->side;
+        pair->done++;
+        co_sched_cond_signal(&pair->cond);
+        co_sched_mutex_unlock(&pair->lock);
+    }
+}
+
+static double run(int nr_workers, unsigned long nr_pairs)
+{
+    Pair *pairs = g_new(Pair, nr_pairs);
+    Player *players = g_new(Player, nr_pairs * 2);
+    CoScheduler *sched;
+    CoSchedStats stats;
+    int64_t start, end;
+    unsigned long i;
+    double rate;
+
+    for (i = 0; i < nr_pairs; i++) {
+        co_sched_mutex_init(&pairs[i].lock);
+        co_sched_cond_init(&pairs[i].cond);
+        pairs[i].turn = 0;
+        pairs[i].done = 0;
+        players[i * 2] = (Player) { &pairs[i], 0 };
+        players[i * 2 + 1] = (Player) { &pairs[i], 1 };
+    }
+
+    sched = co_sched_new(nr_workers);
+    start = get_clock();
+    for (i = 0; i < nr_pairs * 2; i++) {
+        co_sched_spawn(sched, play, &players[i]);
+    }
+    co_sched_wait(sched);
+    end = get_clock();
+    co_sched_get_stats(sched, &stats);
+    co_sched_free(sched);
+
+    for (i = 0; i < nr_pairs; i++) {
+        if (pairs[i].done != rounds * 2) {
+            fprintf(stderr, "pair %lu: %lu hand-offs instead of %lu\n",
+                    i, pairs[i].done, rounds * 2);
+            abort();
+        }
+    }
+
+    rate = nr_pairs * rounds * 2 / ((end - start) / 1e9);
+    printf("%2d workers %10.2f M hand-offs/s  %8.0f ns/hand-off  "
+           "%10lu entered %8lu stolen %6lu wakeups",
+           nr_workers, rate / 1e6, (end - start) / (nr_pairs * rounds * 2.0),
+           stats.entered, stats.steals, stats.wakeups);
+
+    g_free(players);
+    g_free(pairs);
+    return rate;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long nr_pairs = argc > 1 ? atol(argv[1]) : 10000;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_workers;
+    double base = 0, rate;
+    int n;
+
+    rounds = argc > 2 ? atol(argv[2]) : 100;
+    max_workers = argc > 3 ? atoi(argv[3]) : ncpus;
+
+    printf("%lu pairs, %lu round trips each, %ld CPUs\n",
+           nr_pairs, rounds, ncpus);
+    for (n = 1; n <= max_workers; n = n * 2 > max_workers && n < max_workers ?
+                                        max_workers : n * 2) {
+        rate = run(n, nr_pairs);
+        if (n == 1) {
+            base = rate;
+            printf("\n");
+        } else {
+            printf("  %5.2fx\n", rate / base);
+        }
+        qemu_coroutine_pool_trim();
+        qemu_coroutine_pool_trim();
+        qemu_coroutine_pool_trim();
+    }
+    return 0;
+}
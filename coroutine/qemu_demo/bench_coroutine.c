@@ -0,0 +1,156 @@
+/*
+ * Coroutine create/enter/terminate benchmark
+ *
+ * Measures the cost of a coroutine's whole life in three shapes:
+ *  - oneshot: create, enter, and the entry point returns right away;
+ *  - yield: create, enter, the coroutine yields once and is entered again
+ *    to terminate;
+ *  - burst: BURST_SIZE coroutines are created and parked at a yield before
+ *    any of them terminates, more than the pool keeps around.
+ * Each runs on one thread and then on several at once.  Build it as
+ * bench_coroutine_nopool to see the cost without the coroutine pool.
+ *
+ * Usage: bench_coroutine [iterations] [threads]
+ */
+#include <pthread.h>
+#include <time.h>
+#include "coroutine.h"
+
+#define BURST_SIZE 512
+
+typedef enum {
+    BENCH_ONESHOT,
+    BENCH_YIELD,
+    BENCH_BURST,
+} BenchType;
+
+static const char *bench_names[] = {
+    [BENCH_ONESHOT] = "oneshot",
+    [BENCH_YIELD] = "yield",
+    [BENCH_BURST] = "burst",
+};
+
+typedef struct Worker {
+    pthread_t thread;
+    BenchType type;
+    unsigned long iterations;
+} Worker;
+
+static int64_t get_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void coroutine_fn nop_entry(void *opaque)
+{
+    unsigned long *done = opaque;
+
+    (*done)++;
+}
+
+static void coroutine_fn yield_entry(void *opaque)
+{
+    unsigned long *done = opaque;
+
+    qemu_coroutine_yield();
+    (*done)++;
+}
+
+static void *worker_thread(void *opaque)
+{
+    Worker *w = opaque;
+    Coroutine *burst[BURST_SIZE];
+    unsigned long i, done = 0;
+    int j;
+
+    switch (w->type) {
+    case BENCH_ONESHOT:
+        for (i = 0; i < w->iterations; i++) {
+            qemu_coroutine_enter(qemu_coroutine_create(nop_entry, &done));
+        }
+        break;
+    case BENCH_YIELD:
+        for (i = 0; i < w->iterations; i++) {
+            Coroutine *co = qemu_coroutine_create(yield_entry, &done);
+
+            qemu_coroutine_enter(co);
+            qemu_coroutine_enter(co);
+        }
+        break;
+    case BENCH_BURST:
+        for (i = 0; i < w->iterations; i += BURST_SIZE) {
+            for (j = 0; j < BURST_SIZE; j++) {
+                burst[j] = qemu_coroutine_create(yield_entry, &done);
+                qemu_coroutine_enter(burst[j]);
+            }
+            for (j = 0; j < BURST_SIZE; j++) {
+                qemu_coroutine_enter(burst[j]);
+            }
+        }
+        break;
+    }
+
+    if (done < w->iterations) {
+        fprintf(stderr, "%s: coroutines did not terminate\n",
+                bench_names[w->type]);
+        abort();
+    }
+    w->iterations = done;
+    return NULL;
+}
+
+static void run(BenchType type, unsigned long iterations, int nr_threads)
+{
+    Worker *workers = g_new0(Worker, nr_threads);
+    unsigned long total = 0;
+    int64_t start, end;
+    int i;
+
+    start = get_clock();
+    for (i = 0; i < nr_threads; i++) {
+        workers[i].type = type;
+        workers[i].iterations = iterations;
+        pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+    }
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].iterations;
+    }
+    end = get_clock();
+
+    printf("%-8s %2d thread%s: %8.1f ns/coroutine, %6.2f M coroutines/s\n",
+           bench_names[type], nr_threads, nr_threads > 1 ? "s" : " ",
+           (double)(end - start) / total,
+           total * 1e3 / (end - start));
+    g_free(workers);
+
+    /* Start every round from an empty global pool: the first trim sees
+     * the pool in use, the next two find it idle and free it.
+     */
+    for (i = 0; i < 3; i++) {
+        qemu_coroutine_pool_trim();
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = argc > 1 ? atol(argv[1]) : 200000;
+    int nr_threads = argc > 2 ? atoi(argv[2]) : 4;
+    BenchType type;
+
+#ifdef CONFIG_NO_COROUTINE_POOL
+    printf("coroutine pool disabled, %lu coroutines per thread\n", iterations);
+#else
+    printf("coroutine pool enabled, %lu coroutines per thread\n", iterations);
+#endif
+    for (type = BENCH_ONESHOT; type <= BENCH_BURST; type++) {
+        run(type, iterations, 1);
+        if (nr_threads > 1) {
+            run(type, iterations, nr_threads);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,366 @@
+/*
+ * Echo server benchmark: coroutines against callbacks
+ *
+ * Runs an echo server in an IOThread, written in two ways:
+ *  - callback: like connection_cb() in the jsonrpc server of
+ *    event_monitor, each connection has a read handler that echoes what it
+ *    reads, and switches to a write handler while the socket is full;
+ *  - coroutine: one coroutine per connection loops over co_read() and
+ *    co_write(), and another accepts the connections with co_accept().
+ * The main thread opens many connections to it over loopback TCP and keeps
+ * one message in flight on each, driving them with epoll.  Reports the
+ * round trips per second and the memory taken by an idle connection, from
+ * the growth of the RSS once all are accepted.
+ *
+ * Both ends of a connection take an fd, so the number of connections is
+ * capped by RLIMIT_NOFILE.
+ *
+ * Usage: bench_echo [connections] [round trips per connection] [message size]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "iothread.h"
+#include "co_io.h"
+
+typedef struct EchoServer {
+    AioContext *ctx;
+    int listen_fd;
+    int nr_conns;
+    int accepted;
+    int closed;
+} EchoServer;
+
+typedef struct EchoConn {
+    EchoServer *server;
+    int fd;
+    bool writing;
+    size_t len;         /* bytes read and not written back yet */
+    size_t offset;      /* ...of which written */
+    char buf[];
+} EchoConn;
+
+typedef struct Client {
+    int fd;
+    size_t received;
+    unsigned long rounds;
+} Client;
+
+static size_t msg_size;
+
+static long rss_kb(void)
+{
+    char line[256];
+    long kb = 0;
+    FILE *f = fopen("/proc/self/status", "r");
+
+    while (f && fgets(line, sizeof(line), f)) {
+        sscanf(line, "VmRSS: %ld kB", &kb);
+    }
+    if (f) {
+        fclose(f);
+    }
+    return kb;
+}
+
+static void cb_conn_read(void *opaque);
+static void cb_conn_write(void *opaque);
+
+static void cb_conn_close(EchoConn *conn)
+{
+    EchoServer *server = conn->server;
+
+    aio_set_fd_handler(server->ctx, conn->fd, NULL, NULL, NULL, NULL);
+    close(conn->fd);
+    g_free(conn);
+    atomic_inc(&server->closed);
+}
+
+/* Write back what was read, and go back to reading once it is all out */
+static void cb_conn_flush(EchoConn *conn)
+{
+    ssize_t ret;
+
+    while (conn->offset < conn->len) {
+        ret = write(conn->fd, conn->buf + conn->offset,
+                    conn->len - conn->offset);
+        if (ret < 0) {
+            if (errno == EAGAIN) {
+                if (!conn->writing) {
+                    conn->writing = true;
+                    aio_set_fd_handler(conn->server->ctx, conn->fd, NULL,
+                                       cb_conn_write, NULL, conn);
+                }
+                return;
+            }
+            cb_conn_close(conn);
+            return;
+        }
+        conn->offset += ret;
+    }
+
+    if (conn->writing) {
+        conn->writing = false;
+        aio_set_fd_handler(conn->server->ctx, conn->fd, cb_conn_read,
+                           NULL, NULL, conn);
+    }
+}
+
+static void cb_conn_read(void *opaque)
+{
+    EchoConn *conn = opaque;
+    ssize_t ret;
+
+    ret = read(conn->fd, conn->buf, msg_size);
+    if (ret < 0 && errno == EAGAIN) {
+        return;
+    }
+    if (ret <= 0) {
+        cb_conn_close(conn);
+        return;
+    }
+    conn->len = ret;
+    conn->offset = 0;
+    cb_conn_flush(conn);
+}
+
+static void cb_conn_write(void *opaque)
+{
+    cb_conn_flush(opaque);
+}
+
+static void cb_accept(void *opaque)
+{
+    EchoServer *server = opaque;
+    EchoConn *conn;
+    int fd;
+
+    while (server->accepted < server->nr_conns) {
+        fd = accept4(server->listen_fd, NULL, NULL,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        conn = g_malloc0(sizeof(*conn) + msg_size);
+        conn->server = server;
+        conn->fd = fd;
+        aio_set_fd_handler(server->ctx, fd, cb_conn_read, NULL, NULL, conn);
+        atomic_inc(&server->accepted);
+    }
+    aio_set_fd_handler(server->ctx, server->listen_fd, NULL, NULL, NULL,
+                       NULL);
+}
+
+static void cb_server_start(void *opaque)
+{
+    EchoServer *server = opaque;
+
+    aio_set_fd_handler(server->ctx, server->listen_fd, cb_accept, NULL, NULL,
+                       server);
+}
+
+static void coroutine_fn co_conn(void *opaque)
+{
+    EchoConn *conn = opaque;
+    ssize_t ret;
+
+    for (;;) {
+        ret = co_read(conn->fd, conn->buf, msg_size);
+        if (ret <= 0 || co_write(conn->fd, conn->buf, ret) != ret) {
+            break;
+        }
+    }
+    close(conn->fd);
+    atomic_inc(&conn->server->closed);
+    g_free(conn);
+}
+
+static void coroutine_fn co_acceptor(void *opaque)
+{
+    EchoServer *server = opaque;
+    EchoConn *conn;
+    int fd;
+
+    while (server->accepted < server->nr_conns) {
+        fd = co_accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            break;
+        }
+        conn = g_malloc0(sizeof(*conn) + msg_size);
+        conn->server = server;
+        conn->fd = fd;
+        /* Runs once the acceptor yields */
+        aio_co_enter(qemu_coroutine_create(co_conn, conn));
+        atomic_inc(&server->accepted);
+    }
+}
+
+static void co_server_start(void *opaque)
+{
+    qemu_coroutine_enter(qemu_coroutine_create(co_acceptor, opaque));
+}
+
+static void noop_bh(void *opaque)
+{
+}
+
+static int listen_on_loopback(int backlog)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, backlog) < 0) {
+        perror("listen");
+        exit(1);
+    }
+    return fd;
+}
+
+static int client_connect(int listen_fd)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int one = 1;
+    int fd;
+
+    getsockname(listen_fd, (struct sockaddr *)&addr, &len);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, len) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static void client_send(Client *c, const char *msg)
+{
+    if (write(c->fd, msg, msg_size) != msg_size) {
+        perror("client write");
+        exit(1);
+    }
+    c->received = 0;
+}
+
+static void run(const char *name, QEMUBHFunc *start, int nr_conns,
+                unsigned long rounds)
+{
+    IOThread *iothread = iothread_create(name, AIO_FDMON_EPOLL);
+    EchoServer server = {
+        .ctx = iothread_get_aio_context(iothread),
+        .listen_fd = listen_on_loopback(1024),
+        .nr_conns = nr_conns,
+    };
+    Client *clients = g_new0(Client, nr_conns);
+    char *msg = g_malloc(msg_size);
+    char *buf = g_malloc(msg_size);
+    struct epoll_event events[256];
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    int64_t t0, t1, t2, t3;
+    long rss_before, rss_after;
+    int i, n, left;
+
+    memset(msg, 'x', msg_size);
+    rss_before = rss_kb();
+    aio_wait_bh_oneshot(server.ctx, start, &server);
+
+    t0 = get_clock();
+    for (i = 0; i < nr_conns; i++) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &clients[i] };
+
+        /* Leave room in the backlog, a dropped SYN is retried after 1s */
+        while (i - atomic_read(&server.accepted) >= 512) {
+            sched_yield();
+        }
+        clients[i].fd = client_connect(server.listen_fd);
+        epoll_ctl(epfd, EPOLL_CTL_ADD, clients[i].fd, &ev);
+    }
+    while (atomic_read(&server.accepted) < nr_conns) {
+        sched_yield();
+    }
+    t1 = get_clock();
+    /* Let the server get to waiting on every connection */
+    aio_wait_bh_oneshot(server.ctx, noop_bh, NULL);
+    rss_after = rss_kb();
+
+    t2 = get_clock();
+    for (i = 0; i < nr_conns; i++) {
+        client_send(&clients[i], msg);
+    }
+    for (left = nr_conns; left; ) {
+        n = epoll_wait(epfd, events, G_N_ELEMENTS(events), -1);
+        for (i = 0; i < n; i++) {
+            Client *c = events[i].data.ptr;
+            ssize_t ret = read(c->fd, buf, msg_size - c->received);
+
+            if (ret <= 0) {
+                if (ret < 0 && errno == EAGAIN) {
+                    continue;
+                }
+                fprintf(stderr, "connection closed by the server\n");
+                exit(1);
+            }
+            c->received += ret;
+            if (c->received < msg_size) {
+                continue;
+            }
+            if (++c->rounds < rounds) {
+                client_send(c, msg);
+            } else {
+                close(c->fd);
+                left--;
+            }
+        }
+    }
+    t3 = get_clock();
+
+    while (atomic_read(&server.closed) < nr_conns) {
+        sched_yield();
+    }
+    printf("%-10s %8.0f round trips/s  %6.2f us/accept  %6.1f KiB/connection\n",
+           name, (double)nr_conns * rounds / ((t3 - t2) / 1e9),
+           (t1 - t0) / 1e3 / nr_conns,
+           (double)(rss_after - rss_before) / nr_conns);
+
+    iothread_destroy(iothread);
+    close(server.listen_fd);
+    close(epfd);
+    g_free(buf);
+    g_free(msg);
+    g_free(clients);
+}
+
+int main(int argc, char *argv[])
+{
+    int nr_conns = argc > 1 ? atoi(argv[1]) : 5000;
+    unsigned long rounds = argc > 2 ? atol(argv[2]) : 100;
+    struct rlimit rl;
+    int max_conns;
+
+    msg_size = argc > 3 ? atol(argv[3]) : 64;
+
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    max_conns = (rl.rlim_cur - 100) / 2;
+    if (nr_conns > max_conns) {
+        printf("capped to %d connections by RLIMIT_NOFILE\n", max_conns);
+        nr_conns = max_conns;
+    }
+
+    printf("%d connections, %lu round trips each, %zu byte messages\n",
+           nr_conns, rounds, msg_size);
+    run("callback", cb_server_start, nr_conns, rounds);
+    run("coroutine", co_server_start, nr_conns, rounds);
+    return 0;
+}
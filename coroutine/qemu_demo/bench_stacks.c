@@ -0,0 +1,137 @@
+/*
+ * Coroutine stack memory benchmark
+ *
+ * Parks many coroutines at a yield, each after touching some of its
+ * stack, and reports the process RSS and number of VMAs:
+ *  - once they are all parked;
+ *  - once they have all terminated, with the pool holding on to some;
+ *  - after the pool has been trimmed once while idle, which gives back
+ *    the stack pages of the pooled coroutines;
+ *  - after a second idle trim, which frees them.
+ * Built as bench_stacks_noarena, stacks are mapped one by one as before
+ * the stack arenas; as that takes two VMAs per stack, the number of
+ * coroutines is then capped to fit in vm.max_map_count.
+ *
+ * Usage: bench_stacks [coroutines] [bytes of stack touched]
+ */
+#include <alloca.h>
+#include <string.h>
+#include <time.h>
+#include "coroutine.h"
+
+static size_t touch;
+
+static int64_t get_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void report(const char *what)
+{
+    char line[256];
+    long rss_kb = 0;
+    unsigned long vmas = 0;
+    FILE *f;
+
+    f = fopen("/proc/self/status", "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        sscanf(line, "VmRSS: %ld kB", &rss_kb);
+    }
+    if (f) {
+        fclose(f);
+    }
+
+    f = fopen("/proc/self/maps", "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        if (strchr(line, '\n')) {
+            vmas++;
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+
+    printf("%-24s RSS %8.1f MiB, %7lu VMAs\n", what, rss_kb / 1024.0, vmas);
+}
+
+static void coroutine_fn touch_and_yield(void *opaque)
+{
+    char *buf = alloca(touch);
+
+    memset(buf, 0xaa, touch);
+    __asm__ volatile("" : : "r"(buf) : "memory");
+    qemu_coroutine_yield();
+}
+
+#ifdef CONFIG_NO_STACK_ARENA
+static unsigned long max_coroutines(void)
+{
+    unsigned long max_map_count = 65530;
+    FILE *f = fopen("/proc/sys/vm/max_map_count", "r");
+
+    if (f) {
+        if (fscanf(f, "%lu", &max_map_count) != 1) {
+            max_map_count = 65530;
+        }
+        fclose(f);
+    }
+    /* Two per stack, and some for everything else */
+    return (max_map_count - 1000) / 2;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    unsigned long n = argc > 1 ? atol(argv[1]) : 100000;
+    Coroutine **cos;
+    int64_t start, end;
+    unsigned long i;
+
+    touch = argc > 2 ? atol(argv[2]) : 4096;
+
+#ifdef CONFIG_NO_STACK_ARENA
+    if (n > max_coroutines()) {
+        printf("capped to %lu coroutines by vm.max_map_count\n",
+               max_coroutines());
+        n = max_coroutines();
+    }
+    printf("one mapping per stack, %lu coroutines, %zu bytes touched\n",
+           n, touch);
+#else
+    printf("stack arenas, %lu coroutines, %zu bytes touched\n", n, touch);
+#endif
+
+    cos = g_new(Coroutine *, n);
+    report("start");
+
+    start = get_clock();
+    for (i = 0; i < n; i++) {
+        cos[i] = qemu_coroutine_create(touch_and_yield, NULL);
+        qemu_coroutine_enter(cos[i]);
+    }
+    end = get_clock();
+    report("parked");
+    printf("%-24s %8.2f us/coroutine\n", "  created in",
+           (end - start) / 1e3 / n);
+
+    start = get_clock();
+    for (i = 0; i < n; i++) {
+        qemu_coroutine_enter(cos[i]);
+    }
+    end = get_clock();
+    report("terminated");
+    printf("%-24s %8.2f us/coroutine\n", "  terminated in",
+           (end - start) / 1e3 / n);
+
+    /* Nothing took from the pool since the start, so it is idle already */
+    qemu_coroutine_pool_trim();
+    report("pool idle once");
+    qemu_coroutine_pool_trim();
+    report("pool idle twice");
+
+    g_free(cos);
+    return 0;
+}
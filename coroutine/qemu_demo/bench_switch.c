@@ -0,0 +1,104 @@
+/*
+ * Coroutine backend benchmark
+ *
+ * Built once per backend as bench_switch_<backend>, measures:
+ *  - switch: a coroutine yields back to its caller, which enters it again,
+ *    two switches per round trip;
+ *  - new: qemu_coroutine_new() plus its first entry and termination, then
+ *    qemu_coroutine_delete(), bypassing the coroutine pool;
+ *  - stack: qemu_alloc_stack() plus qemu_free_stack() alone, the part of
+ *    "new" that does not depend on the backend, except for the fault on
+ *    the first touch of the stack.
+ *
+ * Usage: bench_switch [switches] [creations]
+ */
+#include <time.h>
+#include "coroutine.h"
+
+static int64_t get_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void coroutine_fn yield_loop(void *opaque)
+{
+    unsigned long *rounds = opaque;
+
+    while (*rounds) {
+        (*rounds)--;
+        qemu_coroutine_yield();
+    }
+}
+
+static void coroutine_fn nop_entry(void *opaque)
+{
+}
+
+static double bench_switch(unsigned long rounds)
+{
+    Coroutine *co = qemu_coroutine_create(yield_loop, &rounds);
+    unsigned long n = rounds;
+    int64_t start, end;
+
+    start = get_clock();
+    while (rounds) {
+        qemu_coroutine_enter(co);
+    }
+    end = get_clock();
+    /* Let it terminate */
+    qemu_coroutine_enter(co);
+
+    return (double)(end - start) / (n * 2);
+}
+
+static double bench_new(unsigned long n)
+{
+    unsigned long i;
+    int64_t start, end;
+
+    start = get_clock();
+    for (i = 0; i < n; i++) {
+        Coroutine *co = qemu_coroutine_new();
+
+        co->entry = nop_entry;
+        co->entry_arg = NULL;
+        co->caller = qemu_coroutine_self();
+        qemu_coroutine_switch(co->caller, co, COROUTINE_ENTER);
+        co->caller = NULL;
+        qemu_coroutine_delete(co);
+    }
+    end = get_clock();
+
+    return (double)(end - start) / n;
+}
+
+static double bench_stack(unsigned long n)
+{
+    unsigned long i;
+    int64_t start, end;
+
+    start = get_clock();
+    for (i = 0; i < n; i++) {
+        size_t size = COROUTINE_STACK_SIZE;
+        void *stack = qemu_alloc_stack(&size);
+
+        qemu_free_stack(stack, size);
+    }
+    end = get_clock();
+
+    return (double)(end - start) / n;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long switches = argc > 1 ? atol(argv[1]) : 2000000;
+    unsigned long creations = argc > 2 ? atol(argv[2]) : 50000;
+
+    printf("%-9s switch %6.1f ns, new %7.1f ns, stack %7.1f ns\n",
+           qemu_coroutine_backend, bench_switch(switches / 2),
+           bench_new(creations), bench_stack(creations));
+    return 0;
+}
@@ -0,0 +1,87 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <unistd.h>
+#include "co_io.h"
+
+static void co_io_wake(void *opaque)
+{
+    aio_co_enter(opaque);
+}
+
+void coroutine_fn co_wait_fd(int fd, bool is_write)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+
+    assert(ctx && qemu_in_coroutine());
+    aio_set_fd_handler(ctx, fd, is_write ? NULL : co_io_wake,
+                       is_write ? co_io_wake : NULL, NULL,
+                       qemu_coroutine_self());
+    qemu_coroutine_yield();
+    aio_set_fd_handler(ctx, fd, NULL, NULL, NULL, NULL);
+}
+
+ssize_t coroutine_fn co_read(int fd, void *buf, size_t count)
+{
+    ssize_t ret;
+
+    for (;;) {
+        ret = read(fd, buf, count);
+        if (ret >= 0) {
+            return ret;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            co_wait_fd(fd, false);
+        } else if (errno != EINTR) {
+            return -errno;
+        }
+    }
+}
+
+ssize_t coroutine_fn co_write(int fd, const void *buf, size_t count)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < count) {
+        ret = write(fd, (const char *)buf + done, count - done);
+        if (ret >= 0) {
+            done += ret;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            co_wait_fd(fd, true);
+        } else if (errno != EINTR) {
+            return done ? done : -errno;
+        }
+    }
+    return done;
+}
+
+int coroutine_fn co_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    int ret;
+
+    for (;;) {
+        ret = accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (ret >= 0) {
+            return ret;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            co_wait_fd(fd, false);
+        } else if (errno != EINTR && errno != ECONNABORTED) {
+            return -errno;
+        }
+    }
+}
+
+void coroutine_fn co_sleep_ns(int64_t ns)
+{
+    AioContext *ctx = qemu_get_current_aio_context();
+    QEMUTimer ts;
+
+    assert(ctx && qemu_in_coroutine());
+    aio_timer_init(ctx, &ts, SCALE_NS, co_io_wake, qemu_coroutine_self());
+    timer_mod(&ts, qemu_clock_get_ns() + ns);
+    qemu_coroutine_yield();
+
+    /* ts is on our stack: if something else entered us, it is still armed */
+    timer_del(&ts);
+}
@@ -0,0 +1,37 @@
+/*
+ * Coroutine I/O on an AioContext
+ *
+ * Straight-line versions of read(2), write(2) and accept(2) for coroutines
+ * that run in the thread of an AioContext (see qemu_bh).  They work on
+ * non-blocking fds: when the fd is not ready, they register a handler for
+ * it with qemu_get_current_aio_context() and yield until the handler
+ * enters them again.  Like qio_channel_yield() in QEMU, the handler only
+ * stays registered while the coroutine waits, so the fd must not have
+ * another handler in the context.
+ *
+ * Errors are returned as a negative errno.
+ */
+#ifndef CO_IO_H
+#define CO_IO_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "async.h"
+#include "coroutine.h"
+
+/* Yield until @fd is readable, or writable if @is_write */
+void coroutine_fn co_wait_fd(int fd, bool is_write);
+
+/* Returns the bytes read, 0 at end of file */
+ssize_t coroutine_fn co_read(int fd, void *buf, size_t count);
+
+/* Returns @count, unless an error happens after some bytes were written */
+ssize_t coroutine_fn co_write(int fd, const void *buf, size_t count);
+
+/* The new fd is non-blocking as well */
+int coroutine_fn co_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+/* Yield for @ns nanoseconds, on a timer of the AioContext */
+void coroutine_fn co_sleep_ns(int64_t ns);
+
+#endif /* CO_IO_H */
@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "co_sched.h"
+
+/* Most coroutines a thief takes at once */
+#define CO_SCHED_MAX_STEAL      32
+
+/* Spins on a taken CoSchedSpin before yielding the CPU to its holder */
+#define CO_SCHED_SPIN_LIMIT     100
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax()   __asm__ volatile("pause" ::: "memory")
+#elif defined(__aarch64__)
+#define cpu_relax()   __asm__ volatile("yield" ::: "memory")
+#else
+#define cpu_relax()   __asm__ volatile("" ::: "memory")
+#endif
+
+enum {
+    WORKER_RUNNING,
+    WORKER_PARKED,
+};
+
+typedef struct CoSchedWorker {
+    CoScheduler *sched;
+    pthread_t thread;
+    int index;
+
+    /* Ring of runnable coroutines, runq[head & (size - 1)] is the oldest.
+     * Pushed by wakers, popped by the owner, stolen by the other workers,
+     * all with lock taken; head and tail are also read without it to skip
+     * empty deques.
+     */
+    pthread_mutex_t lock;
+    Coroutine **runq;
+    unsigned head;
+    unsigned tail;
+    unsigned size;
+
+    /* Futex word, WORKER_PARKED while the worker sleeps */
+    int state;
+
+    /* Left by the coroutine that was entered last, see co_sched_park() */
+    void (*after_fn)(void *);
+    void *after_opaque;
+
+    unsigned long entered;
+    unsigned long steals;
+    unsigned long wakeups;
+} __attribute__((aligned(64))) CoSchedWorker;
+
+struct CoScheduler {
+    int nr_workers;
+    CoSchedWorker *workers;
+    int stopping;
+    int nr_parked;
+    unsigned next_worker;
+
+    /* Spawned coroutines that have not returned yet, futex word */
+    int nr_live;
+};
+
+typedef struct CoSchedTask {
+    CoScheduler *sched;
+    CoroutineEntry *entry;
+    void *opaque;
+} CoSchedTask;
+
+static __thread CoSchedWorker *current_worker;
+
+static void qemu_futex_wait(int *f, int val)
+{
+    syscall(SYS_futex, f, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void qemu_futex_wake(int *f, int n)
+{
+    syscall(SYS_futex, f, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/* Not inlined, so that a coroutine that moved to another thread does not
+ * use the address of the old thread's variable.
+ */
+static CoSchedWorker * __attribute__((noinline)) get_current_worker(void)
+{
+    return current_worker;
+}
+
+static void co_sched_spin_lock(CoSchedSpin *spin)
+{
+    unsigned spins = 0;
+
+    while (__atomic_exchange_n(&spin->value, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&spin->value, __ATOMIC_RELAXED)) {
+            /* The holder may be a preempted worker */
+            if (++spins < CO_SCHED_SPIN_LIMIT) {
+                cpu_relax();
+            } else {
+                sched_yield();
+            }
+        }
+    }
+}
+
+static void co_sched_spin_unlock(CoSchedSpin *spin)
+{
+    __atomic_store_n(&spin->value, 0, __ATOMIC_RELEASE);
+}
+
+static void co_sched_spin_unlock_cb(void *opaque)
+{
+    co_sched_spin_unlock(opaque);
+}
+
+static unsigned runq_len(CoSchedWorker *w)
+{
+    return __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+}
+
+/* Called with w->lock taken */
+static void runq_grow(CoSchedWorker *w)
+{
+    Coroutine **runq = g_new(Coroutine *, w->size * 2);
+    unsigned i;
+
+    for (i = w->head; i != w->tail; i++) {
+        runq[i & (w->size * 2 - 1)] = w->runq[i & (w->size - 1)];
+    }
+    g_free(w->runq);
+    w->runq = runq;
+    w->size *= 2;
+}
+
+static void runq_push(CoSchedWorker *w, Coroutine **cos, int n)
+{
+    int i;
+
+    pthread_mutex_lock(&w->lock);
+    while (w->tail - w->head + n > w->size) {
+        runq_grow(w);
+    }
+    for (i = 0; i < n; i++) {
+        w->runq[(w->tail + i) & (w->size - 1)] = cos[i];
+    }
+    __atomic_store_n(&w->tail, w->tail + n, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static Coroutine *runq_pop(CoSchedWorker *w)
+{
+    Coroutine *co = NULL;
+
+    if (!runq_len(w)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    if (w->head != w->tail) {
+        co = w->runq[w->head & (w->size - 1)];
+        __atomic_store_n(&w->head, w->head + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return co;
+}
+
+/* Take the newer half of the coroutines of the first other worker that has
+ * any.  Returns one of them and keeps the others in @w's own deque.
+ */
+static Coroutine *runq_steal(CoSchedWorker *w)
+{
+    CoScheduler *sched = w->sched;
+    Coroutine *cos[CO_SCHED_MAX_STEAL];
+    int i, j, n = 0;
+
+    for (i = 1; i < sched->nr_workers && !n; i++) {
+        CoSchedWorker *victim = &sched->workers[(w->index + i) %
+                                                sched->nr_workers];
+
+        if (!runq_len(victim)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&victim->lock);
+        n = MIN((victim->tail - victim->head + 1) / 2, CO_SCHED_MAX_STEAL);
+        for (j = 0; j < n; j++) {
+            unsigned k = victim->tail - n + j;
+
+            cos[j] = victim->runq[k & (victim->size - 1)];
+        }
+        __atomic_store_n(&victim->tail, victim->tail - n, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    if (!n) {
+        return NULL;
+    }
+    w->steals += n;
+    if (n > 1) {
+        runq_push(w, cos + 1, n - 1);
+    }
+    return cos[0];
+}
+
+static int co_sched_has_runnable(CoScheduler *sched)
+{
+    int i;
+
+    for (i = 0; i < sched->nr_workers; i++) {
+        if (runq_len(&sched->workers[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int worker_wake(CoSchedWorker *w)
+{
+    if (__atomic_exchange_n(&w->state, WORKER_RUNNING, __ATOMIC_SEQ_CST) ==
+        WORKER_PARKED) {
+        qemu_futex_wake(&w->state, 1);
+        return 1;
+    }
+    return 0;
+}
+
+/* Queue @co on @w.  If @w is busy with other coroutines, also wake a
+ * parked worker to steal it.
+ */
+static void co_sched_push(CoScheduler *sched, CoSchedWorker *w,
+                          CoSchedWorker *self, Coroutine *co)
+{
+    int i;
+
+    runq_push(w, &co, 1);
+
+    /* Write the deque before looking for parked workers.  Pairs with the
+     * barrier in co_sched_worker_thread(), so that either we see the worker
+     * parked or it sees the coroutine.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (w != self && worker_wake(w)) {
+        if (self) {
+            self->wakeups++;
+        }
+        return;
+    }
+    if (!__atomic_load_n(&sched->nr_parked, __ATOMIC_RELAXED) ||
+        runq_len(w) < 2) {
+        return;
+    }
+    for (i = 0; i < sched->nr_workers; i++) {
+        CoSchedWorker *other = &sched->workers[i];
+
+        if (other != w && worker_wake(other)) {
+            if (self) {
+                self->wakeups++;
+            }
+            return;
+        }
+    }
+}
+
+static void *co_sched_worker_thread(void *opaque)
+{
+    CoSchedWorker *w = opaque;
+    CoScheduler *sched = w->sched;
+    void (*after_fn)(void *);
+    Coroutine *co;
+
+    current_worker = w;
+    for (;;) {
+        co = runq_pop(w);
+        if (!co) {
+            co = runq_steal(w);
+        }
+        if (co) {
+            qemu_coroutine_enter(co);
+            w->entered++;
+
+            /* The coroutine has switched out, it may be published now */
+            after_fn = w->after_fn;
+            if (after_fn) {
+                w->after_fn = NULL;
+                after_fn(w->after_opaque);
+            }
+            continue;
+        }
+
+        if (__atomic_load_n(&sched->stopping, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        /* Write the state before looking at the deques again.  Pairs with
+         * the barrier in co_sched_push().
+         */
+        __atomic_store_n(&w->state, WORKER_PARKED, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sched->nr_parked, 1, __ATOMIC_SEQ_CST);
+        if (!co_sched_has_runnable(sched) &&
+            !__atomic_load_n(&sched->stopping, __ATOMIC_ACQUIRE)) {
+            qemu_futex_wait(&w->state, WORKER_PARKED);
+        }
+        __atomic_fetch_sub(&sched->nr_parked, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&w->state, WORKER_RUNNING, __ATOMIC_RELAXED);
+    }
+    current_worker = NULL;
+    return NULL;
+}
+
+CoScheduler *co_sched_new(int nr_workers)
+{
+    CoScheduler *sched = g_new0(CoScheduler, 1);
+    int i;
+
+    sched->nr_workers = nr_workers;
+    sched->workers = g_new0(CoSchedWorker, nr_workers);
+    for (i = 0; i < nr_workers; i++) {
+        CoSchedWorker *w = &sched->workers[i];
+
+        w->sched = sched;
+        w->index = i;
+        w->size = 64;
+        w->runq = g_new(Coroutine *, w->size);
+        pthread_mutex_init(&w->lock, NULL);
+    }
+    for (i = 0; i < nr_workers; i++) {
+        pthread_create(&sched->workers[i].thread, NULL,
+                       co_sched_worker_thread, &sched->workers[i]);
+    }
+    return sched;
+}
+
+void co_sched_free(CoScheduler *sched)
+{
+    int i;
+
+    co_sched_wait(sched);
+    __atomic_store_n(&sched->stopping, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < sched->nr_workers; i++) {
+        worker_wake(&sched->workers[i]);
+    }
+    for (i = 0; i < sched->nr_workers; i++) {
+        CoSchedWorker *w = &sched->workers[i];
+
+        pthread_join(w->thread, NULL);
+        pthread_mutex_destroy(&w->lock);
+        g_free(w->runq);
+    }
+    g_free(sched->workers);
+    g_free(sched);
+}
+
+void co_sched_get_stats(CoScheduler *sched, CoSchedStats *stats)
+{
+    int i;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < sched->nr_workers; i++) {
+        CoSchedWorker *w = &sched->workers[i];
+
+        stats->entered += __atomic_load_n(&w->entered, __ATOMIC_RELAXED);
+        stats->steals += __atomic_load_n(&w->steals, __ATOMIC_RELAXED);
+        stats->wakeups += __atomic_load_n(&w->wakeups, __ATOMIC_RELAXED);
+    }
+}
+
+static void coroutine_fn co_sched_task_entry(void *opaque)
+{
+    CoSchedTask *task = opaque;
+    CoScheduler *sched = task->sched;
+
+    task->entry(task->opaque);
+    g_free(task);
+
+    if (__atomic_sub_fetch(&sched->nr_live, 1, __ATOMIC_SEQ_CST) == 0) {
+        qemu_futex_wake(&sched->nr_live, INT_MAX);
+    }
+}
+
+void co_sched_spawn(CoScheduler *sched, CoroutineEntry *entry, void *opaque)
+{
+    CoSchedTask *task = g_new(CoSchedTask, 1);
+    CoSchedWorker *self = get_current_worker();
+    CoSchedWorker *w;
+    Coroutine *co;
+
+    *task = (CoSchedTask) {
+        .sched = sched,
+        .entry = entry,
+        .opaque = opaque,
+    };
+    __atomic_fetch_add(&sched->nr_live, 1, __ATOMIC_SEQ_CST);
+    co = qemu_coroutine_create(co_sched_task_entry, task);
+
+    if (self && self->sched == sched) {
+        w = self;
+    } else {
+        w = &sched->workers[__atomic_fetch_add(&sched->next_worker, 1,
+                                               __ATOMIC_RELAXED) %
+                            sched->nr_workers];
+    }
+    co_sched_push(sched, w, self, co);
+}
+
+void co_sched_wait(CoScheduler *sched)
+{
+    int live;
+
+    while ((live = __atomic_load_n(&sched->nr_live, __ATOMIC_SEQ_CST))) {
+        qemu_futex_wait(&sched->nr_live, live);
+    }
+}
+
+void co_sched_wake(Coroutine *co)
+{
+    CoSchedWorker *self = get_current_worker();
+
+    assert(self);
+    co_sched_push(self->sched, self, self, co);
+}
+
+void coroutine_fn co_sched_park(void (*after)(void *), void *opaque)
+{
+    CoSchedWorker *w = get_current_worker();
+
+    w->after_fn = after;
+    w->after_opaque = opaque;
+    qemu_coroutine_yield();
+}
+
+static void co_sched_requeue_cb(void *opaque)
+{
+    co_sched_wake(opaque);
+}
+
+void coroutine_fn co_sched_yield(void)
+{
+    co_sched_park(co_sched_requeue_cb, qemu_coroutine_self());
+}
+
+void co_sched_mutex_init(CoSchedMutex *mutex)
+{
+    mutex->lock.value = 0;
+    mutex->locked = 0;
+    QSIMPLEQ_INIT(&mutex->waiters);
+}
+
+void coroutine_fn co_sched_mutex_lock(CoSchedMutex *mutex)
+{
+    co_sched_spin_lock(&mutex->lock);
+    if (!mutex->locked) {
+        mutex->locked = 1;
+        co_sched_spin_unlock(&mutex->lock);
+        return;
+    }
+    QSIMPLEQ_INSERT_TAIL(&mutex->waiters, qemu_coroutine_self(),
+                         co_queue_next);
+    co_sched_park(co_sched_spin_unlock_cb, &mutex->lock);
+
+    /* co_sched_mutex_unlock() left the mutex locked for us */
+}
+
+void coroutine_fn co_sched_mutex_unlock(CoSchedMutex *mutex)
+{
+    Coroutine *next;
+
+    co_sched_spin_lock(&mutex->lock);
+    next = QSIMPLEQ_FIRST(&mutex->waiters);
+    if (next) {
+        QSIMPLEQ_REMOVE_HEAD(&mutex->waiters, co_queue_next);
+    } else {
+        mutex->locked = 0;
+    }
+    co_sched_spin_unlock(&mutex->lock);
+
+    if (next) {
+        co_sched_wake(next);
+    }
+}
+
+void co_sched_cond_init(CoSchedCond *cond)
+{
+    cond->lock.value = 0;
+    QSIMPLEQ_INIT(&cond->waiters);
+}
+
+void coroutine_fn co_sched_cond_wait(CoSchedCond *cond, CoSchedMutex *mutex)
+{
+    co_sched_spin_lock(&cond->lock);
+    QSIMPLEQ_INSERT_TAIL(&cond->waiters, qemu_coroutine_self(),
+                         co_queue_next);
+    /* Signals cannot find us before the switch, so none is lost between
+     * the unlock and the park.
+     */
+    co_sched_mutex_unlock(mutex);
+    co_sched_park(co_sched_spin_unlock_cb, &cond->lock);
+    co_sched_mutex_lock(mutex);
+}
+
+void co_sched_cond_signal(CoSchedCond *cond)
+{
+    Coroutine *co;
+
+    co_sched_spin_lock(&cond->lock);
+    co = QSIMPLEQ_FIRST(&cond->waiters);
+    if (co) {
+        QSIMPLEQ_REMOVE_HEAD(&cond->waiters, co_queue_next);
+    }
+    co_sched_spin_unlock(&cond->lock);
+
+    if (co) {
+        co_sched_wake(co);
+    }
+}
+
+void co_sched_cond_broadcast(CoSchedCond *cond)
+{
+    QSIMPLEQ_HEAD(, Coroutine) waiters = QSIMPLEQ_HEAD_INITIALIZER(waiters);
+    Coroutine *co;
+
+    co_sched_spin_lock(&cond->lock);
+    QSIMPLEQ_PREPEND(&waiters, &cond->waiters);
+    co_sched_spin_unlock(&cond->lock);
+
+    while ((co = QSIMPLEQ_FIRST(&waiters))) {
+        QSIMPLEQ_REMOVE_HEAD(&waiters, co_queue_next);
+        co_sched_wake(co);
+    }
+}
@@ -0,0 +1,82 @@
+/*
+ * M:N coroutine scheduler
+ *
+ * Runs coroutines on a set of worker threads.  Each worker owns a deque of
+ * runnable coroutines: it enters the oldest one of its own and, once that
+ * is empty, steals the newer half of another worker's before it parks.  A
+ * coroutine that blocks is queued again by whoever wakes it, on the
+ * waker's worker, so it may resume on another thread than it blocked on.
+ *
+ * A coroutine must have switched out before anybody enters it again, so
+ * co_sched_park() does not publish the parked coroutine itself: it leaves
+ * a function for the worker to call after the switch, typically releasing
+ * the lock that wakers take to find the coroutine.
+ *
+ * Code running in these coroutines must not keep the address of a
+ * thread-local variable across anything that can park.
+ */
+#ifndef CO_SCHED_H
+#define CO_SCHED_H
+
+#include "coroutine.h"
+
+typedef struct CoScheduler CoScheduler;
+
+/* Counters summed over the workers, see co_sched_get_stats() */
+typedef struct CoSchedStats {
+    unsigned long entered;      /* coroutines entered by a worker */
+    unsigned long steals;       /* coroutines taken from another worker */
+    unsigned long wakeups;      /* parked workers woken up by others */
+} CoSchedStats;
+
+CoScheduler *co_sched_new(int nr_workers);
+void co_sched_free(CoScheduler *sched);
+void co_sched_get_stats(CoScheduler *sched, CoSchedStats *stats);
+
+/* Start a coroutine on one of the workers, from any thread */
+void co_sched_spawn(CoScheduler *sched, CoroutineEntry *entry, void *opaque);
+
+/* Wait until every spawned coroutine has returned, outside the workers */
+void co_sched_wait(CoScheduler *sched);
+
+/* Let the other runnable coroutines of the worker run first */
+void coroutine_fn co_sched_yield(void);
+
+/* Switch out of the current coroutine until co_sched_wake().  @after is
+ * called with @opaque by the worker, once the switch has happened.
+ */
+void coroutine_fn co_sched_park(void (*after)(void *), void *opaque);
+
+/* Make a parked coroutine runnable; only from the scheduler's coroutines
+ * or workers.
+ */
+void co_sched_wake(Coroutine *co);
+
+/* Protects the wait queues of the primitives below */
+typedef struct CoSchedSpin {
+    int value;
+} CoSchedSpin;
+
+typedef struct CoSchedMutex {
+    CoSchedSpin lock;
+    int locked;
+    QSIMPLEQ_HEAD(, Coroutine) waiters;
+} CoSchedMutex;
+
+void co_sched_mutex_init(CoSchedMutex *mutex);
+
+/* Parks until the mutex is handed over by co_sched_mutex_unlock() */
+void coroutine_fn co_sched_mutex_lock(CoSchedMutex *mutex);
+void coroutine_fn co_sched_mutex_unlock(CoSchedMutex *mutex);
+
+typedef struct CoSchedCond {
+    CoSchedSpin lock;
+    QSIMPLEQ_HEAD(, Coroutine) waiters;
+} CoSchedCond;
+
+void co_sched_cond_init(CoSchedCond *cond);
+void coroutine_fn co_sched_cond_wait(CoSchedCond *cond, CoSchedMutex *mutex);
+void co_sched_cond_signal(CoSchedCond *cond);
+void co_sched_cond_broadcast(CoSchedCond *cond);
+
+#endif /* CO_SCHED_H */
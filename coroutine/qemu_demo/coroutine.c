@@ -1,65 +1,220 @@
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
 #include "coroutine.h"
 
-/**
- * Per-thread coroutine bookkeeping
+enum {
+    POOL_BATCH_SIZE = 64,
+};
+
+/** Free list to speed up creation
+ *
+ * Terminated coroutines go to the global release_pool, up to two batches,
+ * and then to the terminating thread's alloc_pool, up to one batch; past
+ * that they are freed.  A thread creates from its alloc_pool and, when it
+ * is empty, takes the whole release_pool once there is more than a batch
+ * in it, so the shared list is touched once per batch.
  */
-static __thread CoroutineUContext leader;
-static __thread Coroutine *current;
-
-/* This function is marked noinline to prevent GCC from inlining it
- * into coroutine_trampoline(). If we allow it to do that then it
- * hoists the code to get the address of the TLS variable "current"
- * out of the while() loop. This is an invalid transformation because
- * the sigsetjmp() call may be called when running thread A but
- * return in thread B, and so we might be in a different thread
- * context each time round the loop.
+static QSLIST_HEAD(, Coroutine) release_pool = QSLIST_HEAD_INITIALIZER(pool);
+static unsigned int release_pool_size;
+static unsigned int release_pool_takes;
+static unsigned int release_pool_trim_takes;
+static unsigned int release_pool_idle_trims;
+static __thread QSLIST_HEAD(, Coroutine) alloc_pool =
+    QSLIST_HEAD_INITIALIZER(pool);
+static __thread unsigned int alloc_pool_size;
+static __thread int alloc_pool_cleanup_registered;
+static pthread_key_t alloc_pool_cleanup_key;
+static pthread_once_t alloc_pool_cleanup_once = PTHREAD_ONCE_INIT;
+
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#endif
+
+#ifndef CONFIG_NO_STACK_ARENA
+enum {
+    STACK_ARENA_SLOTS = 256,
+};
+
+/** Stack arenas
+ *
+ * Coroutine stacks are carved from arenas of STACK_ARENA_SLOTS, each a
+ * single MAP_NORESERVE mapping, so that memory is only committed as the
+ * stacks fault it in.  Each slot starts with its guard page, which is
+ * what separates the stack from the top of the slot below.  Guard regions
+ * (MADV_GUARD_INSTALL, Linux 6.13) do not split the mapping, so an arena
+ * costs one VMA rather than two per stack; older kernels get mprotect()ed
+ * guard pages instead.
+ *
+ * A freed stack is given back with MADV_DONTNEED and its slot reused.  An
+ * arena whose slots are all free is unmapped, except for one kept as a
+ * spare so that a coroutine created and freed in a loop does not map and
+ * unmap a whole arena each time.
  */
-CoroutineAction __attribute__((noinline))
-qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
-                      CoroutineAction action)
+typedef struct StackArena {
+    char *base;
+    size_t slot_size;
+    unsigned int nr_free;
+    unsigned int free_slots[STACK_ARENA_SLOTS];
+} StackArena;
+
+static pthread_mutex_t stack_arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static StackArena **stack_arenas;   /* sorted by base */
+static unsigned int nr_stack_arenas;
+static unsigned int nr_empty_stack_arenas;
+static StackArena *stack_arena_hint;
+
+static StackArena *stack_arena_new(size_t slot_size, size_t pagesz)
 {
-    CoroutineUContext *from = DO_UPCAST(CoroutineUContext, base, from_);
-    CoroutineUContext *to = DO_UPCAST(CoroutineUContext, base, to_);
-    int ret;
+    StackArena *arena;
+    unsigned int i, pos;
+    char *base;
+
+    base = mmap(NULL, slot_size * STACK_ARENA_SLOTS, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("failed to allocate memory for stacks");
+        abort();
+    }
 
-    current = to_;
+    /* stack grows down */
+    for (i = 0; i < STACK_ARENA_SLOTS; i++) {
+        char *guardpage = base + i * slot_size;
+
+        if (madvise(guardpage, pagesz, MADV_GUARD_INSTALL) != 0 &&
+            mprotect(guardpage, pagesz, PROT_NONE) != 0) {
+            perror("failed to set up stack guard page");
+            abort();
+        }
+    }
 
-    ret = sigsetjmp(from->env, 0);
-    if (ret == 0) {
-        siglongjmp(to->env, action);
+    arena = g_new0(StackArena, 1);
+    arena->base = base;
+    arena->slot_size = slot_size;
+    /* Hand out the lowest slots first */
+    for (i = 0; i < STACK_ARENA_SLOTS; i++) {
+        arena->free_slots[arena->nr_free++] = STACK_ARENA_SLOTS - 1 - i;
     }
+    nr_empty_stack_arenas++;
 
-    return ret;
+    for (pos = nr_stack_arenas;
+         pos > 0 && stack_arenas[pos - 1]->base > base; pos--) {
+        /* find the insertion point */
+    }
+    stack_arenas = g_renew(StackArena *, stack_arenas, nr_stack_arenas + 1);
+    memmove(&stack_arenas[pos + 1], &stack_arenas[pos],
+            (nr_stack_arenas - pos) * sizeof(StackArena *));
+    stack_arenas[pos] = arena;
+    nr_stack_arenas++;
+    return arena;
 }
 
-static void coroutine_trampoline(int i0, int i1)
+static void stack_arena_free(StackArena *arena)
 {
-    union cc_arg arg;
-    CoroutineUContext *self;
-    Coroutine *co;
+    unsigned int pos;
 
-    arg.i[0] = i0;
-    arg.i[1] = i1;
-    self = arg.p;
-    co = &self->base;
+    for (pos = 0; stack_arenas[pos] != arena; pos++) {
+        /* find it */
+    }
+    memmove(&stack_arenas[pos], &stack_arenas[pos + 1],
+            (nr_stack_arenas - pos - 1) * sizeof(StackArena *));
+    nr_stack_arenas--;
+    if (stack_arena_hint == arena) {
+        stack_arena_hint = NULL;
+    }
+
+    munmap(arena->base, arena->slot_size * STACK_ARENA_SLOTS);
+    g_free(arena);
+}
 
-    /* Initialize longjmp environment and switch back the caller */
-    if (!sigsetjmp(self->env, 0)) {
-        siglongjmp(*(sigjmp_buf *)co->entry_arg, 1);
+static StackArena *stack_arena_find(void *stack)
+{
+    unsigned int lo = 0, hi = nr_stack_arenas;
+
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        StackArena *arena = stack_arenas[mid];
+
+        if ((char *)stack < arena->base) {
+            hi = mid;
+        } else if ((char *)stack >=
+                   arena->base + arena->slot_size * STACK_ARENA_SLOTS) {
+            lo = mid + 1;
+        } else {
+            return arena;
+        }
     }
+    return NULL;
+}
 
-    while (1) {
-        co->entry(co->entry_arg);
-        qemu_coroutine_switch(co, co->caller, COROUTINE_TERMINATE);
+static void *stack_arena_alloc(size_t slot_size, size_t pagesz)
+{
+    StackArena *arena;
+    unsigned int i, slot;
+
+    pthread_mutex_lock(&stack_arena_lock);
+    arena = stack_arena_hint;
+    if (!arena || !arena->nr_free) {
+        arena = NULL;
+        for (i = 0; i < nr_stack_arenas; i++) {
+            if (stack_arenas[i]->nr_free) {
+                arena = stack_arenas[i];
+                break;
+            }
+        }
+        if (!arena) {
+            arena = stack_arena_new(slot_size, pagesz);
+        }
+        stack_arena_hint = arena;
     }
+    if (arena->nr_free == STACK_ARENA_SLOTS) {
+        nr_empty_stack_arenas--;
+    }
+    slot = arena->free_slots[--arena->nr_free];
+    pthread_mutex_unlock(&stack_arena_lock);
+
+    return arena->base + slot * slot_size;
+}
+
+/* Returns false if @stack does not come from an arena */
+static int stack_arena_release(void *stack, size_t sz, size_t pagesz)
+{
+    StackArena *arena;
+
+    pthread_mutex_lock(&stack_arena_lock);
+    arena = stack_arena_find(stack);
+    if (!arena) {
+        pthread_mutex_unlock(&stack_arena_lock);
+        return 0;
+    }
+
+    arena->free_slots[arena->nr_free++] =
+        ((char *)stack - arena->base) / arena->slot_size;
+    if (arena->nr_free == STACK_ARENA_SLOTS && nr_empty_stack_arenas) {
+        stack_arena_free(arena);
+    } else {
+        if (arena->nr_free == STACK_ARENA_SLOTS) {
+            nr_empty_stack_arenas++;
+        }
+        /* Keep the guard page, give back the rest */
+        madvise((char *)stack + pagesz, sz - pagesz, MADV_DONTNEED);
+        stack_arena_hint = arena;
+    }
+    pthread_mutex_unlock(&stack_arena_lock);
+    return 1;
 }
+#endif
 
 void qemu_free_stack(void *stack, size_t sz)
 {
+#ifndef CONFIG_NO_STACK_ARENA
+    if (stack_arena_release(stack, sz, getpagesize())) {
+        return;
+    }
+#endif
     munmap(stack, sz);
 }
 
-
 void *qemu_alloc_stack(size_t *sz)
 {
     void *ptr, *guardpage;
@@ -71,6 +226,12 @@ void *qemu_alloc_stack(size_t *sz)
     /* allocate one extra page for the guard page */
     *sz += pagesz;
 
+#ifndef CONFIG_NO_STACK_ARENA
+    if (*sz == ROUND_UP(COROUTINE_STACK_SIZE, pagesz) + pagesz) {
+        return stack_arena_alloc(*sz, pagesz);
+    }
+#endif
+
     flags = MAP_PRIVATE | MAP_ANONYMOUS;
 
     ptr = mmap(NULL, *sz, PROT_READ | PROT_WRITE, flags, -1, 0);
@@ -90,53 +251,67 @@ void *qemu_alloc_stack(size_t *sz)
     return ptr;
 }
 
-Coroutine *qemu_coroutine_new(void)
+#ifndef CONFIG_NO_COROUTINE_POOL
+static void coroutine_pool_cleanup(void *opaque)
 {
-    CoroutineUContext *co;
-    ucontext_t old_uc, uc;
-    sigjmp_buf old_env;
-    union cc_arg arg = {0};
-
-    /* The ucontext functions preserve signal masks which incurs a
-     * system call overhead.  sigsetjmp(buf, 0)/siglongjmp() does not
-     * preserve signal masks but only works on the current stack.
-     * Since we need a way to create and switch to a new stack, use
-     * the ucontext functions for that but sigsetjmp()/siglongjmp() for
-     * everything else.
-     */
+    Coroutine *co;
+    Coroutine *tmp;
 
-    if (getcontext(&uc) == -1) {
-        abort();
+    QSLIST_FOREACH_SAFE(co, &alloc_pool, pool_next, tmp) {
+        QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
+        qemu_coroutine_delete(co);
     }
+    alloc_pool_size = 0;
+}
 
-    co = g_malloc0(sizeof(*co));
-    co->stack_size = COROUTINE_STACK_SIZE;
-    co->stack = qemu_alloc_stack(&co->stack_size);
-    co->base.entry_arg = &old_env; /* stash away our jmp_buf */
-
-    uc.uc_link = &old_uc;
-    uc.uc_stack.ss_sp = co->stack;
-    uc.uc_stack.ss_size = co->stack_size;
-    uc.uc_stack.ss_flags = 0;
-
-    arg.p = co;
-
-    makecontext(&uc, (void (*)(void))coroutine_trampoline,
-                2, arg.i[0], arg.i[1]);
+static void coroutine_pool_cleanup_init(void)
+{
+    pthread_key_create(&alloc_pool_cleanup_key, coroutine_pool_cleanup);
+}
 
-    /* swapcontext() in, siglongjmp() back out */
-    if (!sigsetjmp(old_env, 0)) {
-        swapcontext(&old_uc, &uc);
+/* Free the thread's alloc_pool when it exits */
+static void coroutine_pool_register_cleanup(void)
+{
+    if (!alloc_pool_cleanup_registered) {
+        pthread_once(&alloc_pool_cleanup_once, coroutine_pool_cleanup_init);
+        pthread_setspecific(alloc_pool_cleanup_key, &alloc_pool);
+        alloc_pool_cleanup_registered = 1;
     }
-
-    return &co->base;
 }
+#endif
 
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
 {
     Coroutine *co = NULL;
 
-    co = qemu_coroutine_new();
+#ifndef CONFIG_NO_COROUTINE_POOL
+    co = QSLIST_FIRST(&alloc_pool);
+    if (!co) {
+        if (__atomic_load_n(&release_pool_size, __ATOMIC_RELAXED) >
+            POOL_BATCH_SIZE) {
+            /* Slow path; a good place to register the destructor, too.  */
+            coroutine_pool_register_cleanup();
+
+            /* This is not exact; there could be a little skew between
+             * release_pool_size and the actual size of release_pool.  But
+             * it is just a heuristic, it does not need to be perfect.
+             */
+            alloc_pool_size = __atomic_exchange_n(&release_pool_size, 0,
+                                                  __ATOMIC_SEQ_CST);
+            QSLIST_MOVE_ATOMIC(&alloc_pool, &release_pool);
+            __atomic_fetch_add(&release_pool_takes, 1, __ATOMIC_RELAXED);
+            co = QSLIST_FIRST(&alloc_pool);
+        }
+    }
+    if (co) {
+        QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
+        alloc_pool_size--;
+    }
+#endif
+
+    if (!co) {
+        co = qemu_coroutine_new();
+    }
 
     co->entry = entry;
     co->entry_arg = opaque;
@@ -144,31 +319,94 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
     return co;
 }
 
-int qemu_in_coroutine(void)
+static void coroutine_delete(Coroutine *co)
 {
-    return current && current->caller;
-}
+    co->caller = NULL;
 
-Coroutine *qemu_coroutine_self(void)
-{
-    if (!current) {
-        current = &leader.base;
+#ifndef CONFIG_NO_COROUTINE_POOL
+    if (__atomic_load_n(&release_pool_size, __ATOMIC_RELAXED) <
+        POOL_BATCH_SIZE * 2) {
+        QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
+        __atomic_fetch_add(&release_pool_size, 1, __ATOMIC_SEQ_CST);
+        return;
     }
-    return current;
+    if (alloc_pool_size < POOL_BATCH_SIZE) {
+        coroutine_pool_register_cleanup();
+        QSLIST_INSERT_HEAD(&alloc_pool, co, pool_next);
+        alloc_pool_size++;
+        return;
+    }
+#endif
+
+    qemu_coroutine_delete(co);
 }
 
-static void qemu_coroutine_delete(Coroutine *co_)
+/* Give back the pages of a pooled coroutine's stack, except for the top
+ * one with the frames it switched out of when it terminated.
+ */
+static void coroutine_release_stack_pages(Coroutine *co)
 {
-    CoroutineUContext *co = DO_UPCAST(CoroutineUContext, base, co_);
+    size_t pagesz = getpagesize();
 
-    qemu_free_stack(co->stack, co->stack_size);
-    g_free(co);
+    if (co->stack_size > 2 * pagesz) {
+        madvise((char *)co->stack + pagesz, co->stack_size - 2 * pagesz,
+                MADV_DONTNEED);
+    }
 }
 
-static void coroutine_delete(Coroutine *co)
+void qemu_coroutine_pool_trim(void)
 {
-    co->caller = NULL;
-    qemu_coroutine_delete(co);
+    QSLIST_HEAD(, Coroutine) idle = QSLIST_HEAD_INITIALIZER(idle);
+    unsigned int takes = __atomic_load_n(&release_pool_takes,
+                                         __ATOMIC_RELAXED);
+    Coroutine *co;
+    Coroutine *tmp;
+    Coroutine *last = NULL;
+    Coroutine *first;
+    unsigned int n = 0;
+
+    /* Someone is still creating coroutines faster than it terminates
+     * them, keep the pool for it.
+     */
+    if (takes != release_pool_trim_takes) {
+        release_pool_trim_takes = takes;
+        release_pool_idle_trims = 0;
+        return;
+    }
+
+    if (release_pool_idle_trims++ == 0) {
+        /* Idle for one period: keep the coroutines, not their memory.  Take
+         * them out of the pool while at it, so that nobody can run them.
+         * The size goes with them, or qemu_coroutine_create could take it
+         * along with an empty list, and deleters could overfill the pool.
+         */
+        __atomic_store_n(&release_pool_size, 0, __ATOMIC_SEQ_CST);
+        QSLIST_MOVE_ATOMIC(&idle, &release_pool);
+        QSLIST_FOREACH_SAFE(co, &idle, pool_next, tmp) {
+            coroutine_release_stack_pages(co);
+            last = co;
+            n++;
+        }
+        if (last) {
+            first = __atomic_load_n(&release_pool.slh_first,
+                                    __ATOMIC_RELAXED);
+            do {
+                last->pool_next.sle_next = first;
+            } while (!__atomic_compare_exchange_n(&release_pool.slh_first,
+                                                  &first, idle.slh_first,
+                                                  0, __ATOMIC_SEQ_CST,
+                                                  __ATOMIC_SEQ_CST));
+            __atomic_fetch_add(&release_pool_size, n, __ATOMIC_SEQ_CST);
+        }
+        return;
+    }
+
+    /* Idle for two: free them */
+    __atomic_store_n(&release_pool_size, 0, __ATOMIC_SEQ_CST);
+    QSLIST_MOVE_ATOMIC(&idle, &release_pool);
+    QSLIST_FOREACH_SAFE(co, &idle, pool_next, tmp) {
+        qemu_coroutine_delete(co);
+    }
 }
 
 void qemu_aio_coroutine_enter(Coroutine *co)
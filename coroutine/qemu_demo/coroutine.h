@@ -54,6 +54,25 @@ void qemu_coroutine_enter(Coroutine *coroutine);
  */
 void coroutine_fn qemu_coroutine_yield(void);
 
+/**
+ * Get the currently executing coroutine
+ */
+Coroutine *qemu_coroutine_self(void);
+
+/**
+ * Return whether or not the coroutine has been entered and not yet yielded
+ * or terminated
+ */
+int qemu_coroutine_entered(Coroutine *co);
+
+/**
+ * Enter a coroutine, or queue it if called from one
+ *
+ * Called from another coroutine, @co only runs once that one yields or
+ * terminates.
+ */
+void aio_co_enter(Coroutine *co);
+
 /**
  * Return whether or not currently inside a coroutine
  *
@@ -63,6 +82,85 @@ void coroutine_fn qemu_coroutine_yield(void);
  */
 int qemu_in_coroutine(void);
 
+/**
+ * Give back the memory of idle coroutines in the global pool
+ *
+ * Terminated coroutines are kept, bootstrapped and with their stack, for
+ * qemu_coroutine_create() to reuse.  Call this periodically: once the pool
+ * has not been taken from for a whole period, the pages of its stacks are
+ * returned to the kernel, and after a second one the coroutines are freed.
+ */
+void qemu_coroutine_pool_trim(void);
+
+/*
+ * Coroutine locks, see coroutine_lock.c
+ *
+ * All the coroutines that use one of these must run in the same thread.
+ * Waiters are parked on the lock without any system call, and a coroutine
+ * that wakes them up puts them on its co_queue_wakeup, so they only run
+ * once it yields or terminates; called outside a coroutine, the wakeup
+ * enters them right away.
+ */
+typedef struct CoMutex CoMutex;
+
+/**
+ * A queue of coroutines waiting for something, like a condition variable
+ */
+typedef struct CoQueue {
+    QSIMPLEQ_HEAD(, Coroutine) entries;
+} CoQueue;
+
+void qemu_co_queue_init(CoQueue *queue);
+
+/**
+ * Park the current coroutine until woken up from @queue.  If @mutex is not
+ * NULL, it is unlocked while waiting and taken again before returning.
+ */
+void coroutine_fn qemu_co_queue_wait(CoQueue *queue, CoMutex *mutex);
+
+/**
+ * Wake up the first coroutine in @queue.  Returns 0 if it was empty.
+ */
+int qemu_co_queue_next(CoQueue *queue);
+
+/**
+ * Wake up all the coroutines in @queue at once: they are handed over as a
+ * batch, in the order they started waiting.
+ */
+void qemu_co_queue_restart_all(CoQueue *queue);
+
+int qemu_co_queue_empty(CoQueue *queue);
+
+/**
+ * A mutex that hands itself over to the waiters in the order they came
+ */
+struct CoMutex {
+    int locked;
+    Coroutine *holder;
+    CoQueue queue;
+};
+
+void qemu_co_mutex_init(CoMutex *mutex);
+void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex);
+void coroutine_fn qemu_co_mutex_unlock(CoMutex *mutex);
+
+/**
+ * A readers-writer lock.  Readers that come while a writer waits queue
+ * behind it, and a writer that unlocks lets all the waiting readers in
+ * before the next writer, so neither side starves.
+ */
+typedef struct CoRwlock {
+    int owners;                 /* readers holding the lock, -1 for a writer */
+    int readers_waiting;
+    CoQueue readers;
+    CoQueue writers;
+} CoRwlock;
+
+void qemu_co_rwlock_init(CoRwlock *lock);
+void coroutine_fn qemu_co_rwlock_rdlock(CoRwlock *lock);
+void coroutine_fn qemu_co_rwlock_wrlock(CoRwlock *lock);
+void coroutine_fn qemu_co_rwlock_unlock(CoRwlock *lock);
+
 /*
  * va_args to makecontext() must be type 'int', so passing
  * the pointer we need may require several int args. This
@@ -89,6 +187,12 @@ struct Coroutine {
      * scheduled the coroutine. */
     const char *scheduled;
 
+    /* From qemu_alloc_stack(), guard page included; NULL for the leader */
+    void *stack;
+    size_t stack_size;
+
+    QSLIST_ENTRY(Coroutine) pool_next;
+
     QSIMPLEQ_ENTRY(Coroutine) co_queue_next;
 
     /* Coroutines that should be woken up when we yield or terminate.
@@ -97,9 +201,21 @@ struct Coroutine {
     QSIMPLEQ_HEAD(, Coroutine) co_queue_wakeup;
 };
 
-typedef struct {
-    Coroutine base;
-    void *stack;
-    size_t stack_size;
-    sigjmp_buf env;
-} CoroutineUContext;
+/*
+ * Backend interface
+ *
+ * Implemented by one of coroutine_asm.c, coroutine_sigsetjmp.c and
+ * coroutine_ucontext.c, picked with COROUTINE_BACKEND in the Makefile.
+ * Created coroutines start in a loop that calls the entry point and then
+ * switches to the caller with COROUTINE_TERMINATE, so that they can be
+ * reused by qemu_coroutine_create().
+ */
+extern const char *const qemu_coroutine_backend;
+
+Coroutine *qemu_coroutine_new(void);
+void qemu_coroutine_delete(Coroutine *co);
+CoroutineAction qemu_coroutine_switch(Coroutine *from, Coroutine *to,
+                                      CoroutineAction action);
+
+void *qemu_alloc_stack(size_t *sz);
+void qemu_free_stack(void *stack, size_t sz);
@@ -0,0 +1,134 @@
+/*
+ * Assembly coroutine backend
+ *
+ * coroutine_asm_switch() in coroutine_switch.S pushes the callee-saved
+ * registers and the floating point control registers (MXCSR and the x87
+ * control word, or FPCR) on the current stack, stores the stack pointer,
+ * and pops the same from the stack of the coroutine being entered.  The
+ * ABI already has the caller save everything else across the call, and
+ * the signal mask is left alone.
+ *
+ * A new coroutine gets a hand-made frame on its stack, laid out as if it
+ * had called coroutine_asm_switch() from coroutine_asm_start, so that
+ * the first switch to it starts the trampoline; creating one does not
+ * switch stacks at all.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "coroutine.h"
+
+const char *const qemu_coroutine_backend = "asm";
+
+typedef struct {
+    Coroutine base;
+
+    /* Saved stack pointer, pointing to the frame to switch to */
+    void *sp;
+} CoroutineAsm;
+
+/*
+ * Layout of the frame that coroutine_asm_switch() pops, in words from the
+ * stack pointer: where coroutine_asm_start finds its argument, the frame
+ * pointer, the return address and the floating point control registers.
+ */
+#if defined(__x86_64__)
+enum {
+    FRAME_WORDS = 8,
+    FRAME_FPCTL = 0,    /* MXCSR, x87 control word */
+    FRAME_ARG = 5,      /* rbx */
+    FRAME_FP = 6,       /* rbp */
+    FRAME_RET = 7,
+};
+/* The initial values that the ABI specifies */
+#define FRAME_FPCTL_INIT (0x1f80 | (0x037fULL << 32))
+#elif defined(__aarch64__)
+enum {
+    FRAME_WORDS = 22,
+    FRAME_ARG = 0,      /* x19 */
+    FRAME_FP = 10,      /* x29 */
+    FRAME_RET = 11,     /* x30 */
+    FRAME_FPCTL = 20,   /* FPCR */
+};
+#define FRAME_FPCTL_INIT 0
+#else
+#error "the asm coroutine backend supports x86-64 and aarch64 only"
+#endif
+
+/* In coroutine_switch.S */
+uintptr_t coroutine_asm_switch(void **save_sp, void *sp, uintptr_t ret);
+void coroutine_asm_start(void);
+
+/**
+ * Per-thread coroutine bookkeeping
+ */
+static __thread CoroutineAsm leader;
+static __thread Coroutine *current;
+
+/* noinline for the same reason as in coroutine_sigsetjmp.c */
+CoroutineAction __attribute__((noinline))
+qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
+                      CoroutineAction action)
+{
+    CoroutineAsm *from = DO_UPCAST(CoroutineAsm, base, from_);
+    CoroutineAsm *to = DO_UPCAST(CoroutineAsm, base, to_);
+
+    current = to_;
+
+    return coroutine_asm_switch(&from->sp, to->sp, action);
+}
+
+/* Called by coroutine_asm_start on the coroutine's own stack */
+void __attribute__((noreturn)) coroutine_asm_trampoline(Coroutine *co);
+
+void coroutine_asm_trampoline(Coroutine *co)
+{
+    while (1) {
+        co->entry(co->entry_arg);
+        qemu_coroutine_switch(co, co->caller, COROUTINE_TERMINATE);
+    }
+}
+
+Coroutine *qemu_coroutine_new(void)
+{
+    CoroutineAsm *co;
+    uintptr_t *frame;
+
+    co = g_malloc0(sizeof(*co));
+    co->base.stack_size = COROUTINE_STACK_SIZE;
+    co->base.stack = qemu_alloc_stack(&co->base.stack_size);
+
+    /* The two spare words keep the stack pointer 16-byte aligned, both
+     * here and once coroutine_asm_start runs.
+     */
+    frame = (uintptr_t *)((char *)co->base.stack + co->base.stack_size) -
+            FRAME_WORDS - 2;
+    /* Zero, including the frame pointer so that backtraces end here */
+    memset(frame, 0, FRAME_WORDS * sizeof(uintptr_t));
+    frame[FRAME_ARG] = (uintptr_t)&co->base;
+    frame[FRAME_RET] = (uintptr_t)coroutine_asm_start;
+    frame[FRAME_FPCTL] = FRAME_FPCTL_INIT;
+    co->sp = frame;
+
+    return &co->base;
+}
+
+void qemu_coroutine_delete(Coroutine *co_)
+{
+    CoroutineAsm *co = DO_UPCAST(CoroutineAsm, base, co_);
+
+    qemu_free_stack(co->base.stack, co->base.stack_size);
+    g_free(co);
+}
+
+int qemu_in_coroutine(void)
+{
+    return current && current->caller;
+}
+
+Coroutine *qemu_coroutine_self(void)
+{
+    if (!current) {
+        current = &leader.base;
+    }
+    return current;
+}
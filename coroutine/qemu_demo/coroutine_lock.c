@@ -0,0 +1,148 @@
+/*
+ * Coroutine queues and locks
+ *
+ * Waiters are linked through their co_queue_next, and woken up with
+ * aio_co_enter(): from a coroutine, that only appends them to its
+ * co_queue_wakeup, which qemu_aio_coroutine_enter() runs once the
+ * coroutine yields or terminates.  The locks hand themselves over to the
+ * coroutines they wake, which therefore do not check them again.
+ */
+#include "coroutine.h"
+
+void qemu_co_queue_init(CoQueue *queue)
+{
+    QSIMPLEQ_INIT(&queue->entries);
+}
+
+void coroutine_fn qemu_co_queue_wait(CoQueue *queue, CoMutex *mutex)
+{
+    Coroutine *self = qemu_coroutine_self();
+
+    QSIMPLEQ_INSERT_TAIL(&queue->entries, self, co_queue_next);
+    if (mutex) {
+        qemu_co_mutex_unlock(mutex);
+    }
+    qemu_coroutine_yield();
+    if (mutex) {
+        qemu_co_mutex_lock(mutex);
+    }
+}
+
+int qemu_co_queue_next(CoQueue *queue)
+{
+    Coroutine *next = QSIMPLEQ_FIRST(&queue->entries);
+
+    if (!next) {
+        return 0;
+    }
+    QSIMPLEQ_REMOVE_HEAD(&queue->entries, co_queue_next);
+    aio_co_enter(next);
+    return 1;
+}
+
+void qemu_co_queue_restart_all(CoQueue *queue)
+{
+    Coroutine *first;
+
+    if (qemu_in_coroutine()) {
+        QSIMPLEQ_CONCAT(&qemu_coroutine_self()->co_queue_wakeup,
+                        &queue->entries);
+        return;
+    }
+
+    /* Queue the others behind the first one, so that a single
+     * qemu_aio_coroutine_enter() runs them all
+     */
+    first = QSIMPLEQ_FIRST(&queue->entries);
+    if (!first) {
+        return;
+    }
+    QSIMPLEQ_REMOVE_HEAD(&queue->entries, co_queue_next);
+    QSIMPLEQ_CONCAT(&first->co_queue_wakeup, &queue->entries);
+    aio_co_enter(first);
+}
+
+int qemu_co_queue_empty(CoQueue *queue)
+{
+    return QSIMPLEQ_EMPTY(&queue->entries);
+}
+
+void qemu_co_mutex_init(CoMutex *mutex)
+{
+    mutex->locked = 0;
+    mutex->holder = NULL;
+    qemu_co_queue_init(&mutex->queue);
+}
+
+void coroutine_fn qemu_co_mutex_lock(CoMutex *mutex)
+{
+    if (mutex->locked) {
+        /* Still locked when qemu_co_mutex_unlock() wakes us up */
+        qemu_co_queue_wait(&mutex->queue, NULL);
+    } else {
+        mutex->locked = 1;
+    }
+    mutex->holder = qemu_coroutine_self();
+}
+
+void coroutine_fn qemu_co_mutex_unlock(CoMutex *mutex)
+{
+    assert(mutex->locked && mutex->holder == qemu_coroutine_self());
+
+    mutex->holder = NULL;
+    if (!qemu_co_queue_next(&mutex->queue)) {
+        mutex->locked = 0;
+    }
+}
+
+void qemu_co_rwlock_init(CoRwlock *lock)
+{
+    lock->owners = 0;
+    lock->readers_waiting = 0;
+    qemu_co_queue_init(&lock->readers);
+    qemu_co_queue_init(&lock->writers);
+}
+
+void coroutine_fn qemu_co_rwlock_rdlock(CoRwlock *lock)
+{
+    if (lock->owners >= 0 && qemu_co_queue_empty(&lock->writers)) {
+        lock->owners++;
+        return;
+    }
+
+    /* Counted in owners by the unlock that wakes us up */
+    lock->readers_waiting++;
+    qemu_co_queue_wait(&lock->readers, NULL);
+}
+
+void coroutine_fn qemu_co_rwlock_wrlock(CoRwlock *lock)
+{
+    if (lock->owners == 0) {
+        lock->owners = -1;
+        return;
+    }
+
+    /* owners is left at -1 for us by the unlock that wakes us up */
+    qemu_co_queue_wait(&lock->writers, NULL);
+}
+
+void coroutine_fn qemu_co_rwlock_unlock(CoRwlock *lock)
+{
+    assert(lock->owners != 0);
+
+    if (lock->owners > 0 && --lock->owners > 0) {
+        return;
+    }
+
+    if (lock->owners < 0 && lock->readers_waiting) {
+        /* A writer is done: let in the readers that queued behind it */
+        lock->owners = lock->readers_waiting;
+        lock->readers_waiting = 0;
+        qemu_co_queue_restart_all(&lock->readers);
+    } else if (!qemu_co_queue_empty(&lock->writers)) {
+        lock->owners = -1;
+        qemu_co_queue_next(&lock->writers);
+    } else {
+        lock->owners = 0;
+    }
+}
@@ -0,0 +1,106 @@
+/*
+ * ucontext coroutine backend
+ *
+ * Every switch is a swapcontext(), which saves and restores the whole
+ * register file and the signal mask, the latter with a system call.
+ */
+#include "coroutine.h"
+
+const char *const qemu_coroutine_backend = "ucontext";
+
+typedef struct {
+    Coroutine base;
+    ucontext_t uc;
+
+    /* What the coroutine that switched here passed in */
+    CoroutineAction action;
+} CoroutineUContext;
+
+/**
+ * Per-thread coroutine bookkeeping
+ */
+static __thread CoroutineUContext leader;
+static __thread Coroutine *current;
+
+/* noinline for the same reason as in coroutine_sigsetjmp.c */
+CoroutineAction __attribute__((noinline))
+qemu_coroutine_switch(Coroutine *from_, Coroutine *to_,
+                      CoroutineAction action)
+{
+    CoroutineUContext *from = DO_UPCAST(CoroutineUContext, base, from_);
+    CoroutineUContext *to = DO_UPCAST(CoroutineUContext, base, to_);
+
+    current = to_;
+    to->action = action;
+
+    if (swapcontext(&from->uc, &to->uc) == -1) {
+        abort();
+    }
+
+    return from->action;
+}
+
+static void coroutine_trampoline(int i0, int i1)
+{
+    union cc_arg arg;
+    CoroutineUContext *self;
+    Coroutine *co;
+
+    arg.i[0] = i0;
+    arg.i[1] = i1;
+    self = arg.p;
+    co = &self->base;
+
+    while (1) {
+        co->entry(co->entry_arg);
+        qemu_coroutine_switch(co, co->caller, COROUTINE_TERMINATE);
+    }
+}
+
+Coroutine *qemu_coroutine_new(void)
+{
+    CoroutineUContext *co;
+    union cc_arg arg = {0};
+
+    co = g_malloc0(sizeof(*co));
+    if (getcontext(&co->uc) == -1) {
+        abort();
+    }
+
+    co->base.stack_size = COROUTINE_STACK_SIZE;
+    co->base.stack = qemu_alloc_stack(&co->base.stack_size);
+
+    co->uc.uc_link = NULL;
+    co->uc.uc_stack.ss_sp = co->base.stack;
+    co->uc.uc_stack.ss_size = co->base.stack_size;
+    co->uc.uc_stack.ss_flags = 0;
+
+    arg.p = co;
+
+    /* The first switch to the coroutine starts the trampoline */
+    makecontext(&co->uc, (void (*)(void))coroutine_trampoline,
+                2, arg.i[0], arg.i[1]);
+
+    return &co->base;
+}
+
+void qemu_coroutine_delete(Coroutine *co_)
+{
+    CoroutineUContext *co = DO_UPCAST(CoroutineUContext, base, co_);
+
+    qemu_free_stack(co->base.stack, co->base.stack_size);
+    g_free(co);
+}
+
+int qemu_in_coroutine(void)
+{
+    return current && current->caller;
+}
+
+Coroutine *qemu_coroutine_self(void)
+{
+    if (!current) {
+        current = &leader.base;
+    }
+    return current;
+}
@@ -28,6 +28,14 @@ struct name {                                                           \
     }                                                                   \
 } while (/*CONSTCOND*/0)
 
+#define QSIMPLEQ_CONCAT(head1, head2) do {                              \
+    if (!QSIMPLEQ_EMPTY((head2))) {                                     \
+        *(head1)->sqh_last = (head2)->sqh_first;                        \
+        (head1)->sqh_last = (head2)->sqh_last;                          \
+        QSIMPLEQ_INIT((head2));                                         \
+    }                                                                   \
+} while (/*CONSTCOND*/0)
+
 #define QSIMPLEQ_INSERT_TAIL(head, elm, field) do {                     \
         (elm)->field.sqe_next = NULL;                                       \
         *(head)->sqh_last = (elm);                                          \
@@ -50,3 +58,67 @@ struct {                                                                \
 #define QSIMPLEQ_FIRST(head)        ((head)->sqh_first)
 #define QSIMPLEQ_NEXT(elm, field)   ((elm)->field.sqe_next)
 
+
+/*
+ * Singly-linked List definitions.
+ */
+#define QSLIST_HEAD(name, type)                                         \
+struct name {                                                           \
+        struct type *slh_first; /* first element */                     \
+}
+
+#define QSLIST_HEAD_INITIALIZER(head)                                   \
+        { NULL }
+
+#define QSLIST_ENTRY(type)                                              \
+struct {                                                                \
+        struct type *sle_next;  /* next element */                      \
+}
+
+/*
+ * Singly-linked List functions.
+ */
+#define QSLIST_INIT(head) do {                                          \
+        (head)->slh_first = NULL;                                       \
+} while (/*CONSTCOND*/0)
+
+#define QSLIST_INSERT_HEAD(head, elm, field) do {                       \
+        (elm)->field.sle_next = (head)->slh_first;                      \
+        (head)->slh_first = (elm);                                      \
+} while (/*CONSTCOND*/0)
+
+/* qemu_bh's aio.h has its own take on these, built on its atomic.h; code
+ * that includes both gets that one.
+ */
+#ifndef QSLIST_INSERT_HEAD_ATOMIC
+#define QSLIST_INSERT_HEAD_ATOMIC(head, elm, field) do {                \
+        typeof(elm) save_sle_next;                                      \
+        do {                                                            \
+            save_sle_next = (elm)->field.sle_next = (head)->slh_first;  \
+        } while (!__atomic_compare_exchange_n(&(head)->slh_first,       \
+                                              &save_sle_next, (elm),    \
+                                              0, __ATOMIC_SEQ_CST,      \
+                                              __ATOMIC_SEQ_CST));       \
+} while (/*CONSTCOND*/0)
+
+#define QSLIST_MOVE_ATOMIC(dest, src) do {                              \
+        (dest)->slh_first = __atomic_exchange_n(&(src)->slh_first,      \
+                                                NULL, __ATOMIC_SEQ_CST);\
+} while (/*CONSTCOND*/0)
+
+#define QSLIST_REMOVE_HEAD(head, field) do {                            \
+        (head)->slh_first = (head)->slh_first->field.sle_next;          \
+} while (/*CONSTCOND*/0)
+#endif
+
+#define QSLIST_FOREACH_SAFE(var, head, field, tvar)                     \
+        for ((var) = QSLIST_FIRST((head));                              \
+            (var) && ((tvar) = QSLIST_NEXT((var), field), 1);           \
+            (var) = (tvar))
+
+/*
+ * Singly-linked List access methods.
+ */
+#define QSLIST_EMPTY(head)      ((head)->slh_first == NULL)
+#define QSLIST_FIRST(head)      ((head)->slh_first)
+#define QSLIST_NEXT(elm, field) ((elm)->field.sle_next)
@@ -0,0 +1,162 @@
+// Shared stack scheduler benchmark
+//
+// Coroutines yield in a loop with some live stack frames, and are resumed
+// in three patterns:
+//   round-robin  one after the other;
+//   pairs        two at a time alternately, like a producer and consumer;
+//   burst        each 8 times in a row.
+// with a single shared stack, where every switch between coroutines
+// copies, the default of 4 shared stacks, and one stack per coroutine.
+// Reports yields per second and the memory taken by a parked coroutine,
+// from the growth of the RSS.  Each case runs in its own process.
+//
+// Usage: bench [coroutines] [bytes of stack] [yields per coroutine]
+
+#include "coroutine.h"
+#include <alloca.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define BURST 8
+
+enum pattern {
+	ROUND_ROBIN,
+	PAIRS,
+	BURSTS,
+};
+
+static const char *pattern_names[] = {
+	[ROUND_ROBIN] = "round-robin",
+	[PAIRS] = "pairs",
+	[BURSTS] = "burst",
+};
+
+static int ncoroutines;
+static int depth;
+static int yields;
+
+static double
+now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long
+rss_kb(void) {
+	char line[256];
+	long kb = 0;
+	FILE *f = fopen("/proc/self/status", "r");
+	while (f && fgets(line, sizeof(line), f)) {
+		sscanf(line, "VmRSS: %ld kB", &kb);
+	}
+	if (f)
+		fclose(f);
+	return kb;
+}
+
+static void
+worker(struct schedule *S, void *ud) {
+	char *frame = alloca(depth);
+	int i;
+	memset(frame, 1, depth);
+	__asm__ volatile("" : : "r"(frame) : "memory");
+	for (i=0;i<yields;i++) {
+		frame[i % depth]++;
+		coroutine_yield(S);
+	}
+}
+
+static void
+run(int nstack, enum pattern p) {
+	struct schedule *S = scheduler_open_stacks(nstack);
+	int *id = malloc(sizeof(int) * ncoroutines);
+	long before, after;
+	double start, end;
+	int i, j, alive;
+
+	before = rss_kb();
+	for (i=0;i<ncoroutines;i++) {
+		id[i] = coroutine_new(S, worker, NULL);
+		coroutine_resume(S, id[i]);
+	}
+	after = rss_kb();
+
+	start = now();
+	switch (p) {
+	case ROUND_ROBIN:
+		do {
+			alive = 0;
+			for (i=0;i<ncoroutines;i++) {
+				if (coroutine_status(S, id[i])) {
+					coroutine_resume(S, id[i]);
+					alive = 1;
+				}
+			}
+		} while (alive);
+		break;
+	case PAIRS:
+		for (i=0;i+1<ncoroutines;i+=2) {
+			while (coroutine_status(S, id[i]) || coroutine_status(S, id[i+1])) {
+				coroutine_resume(S, id[i]);
+				coroutine_resume(S, id[i+1]);
+			}
+		}
+		while (i < ncoroutines && coroutine_status(S, id[i])) {
+			coroutine_resume(S, id[i]);
+		}
+		break;
+	case BURSTS:
+		do {
+			alive = 0;
+			for (i=0;i<ncoroutines;i++) {
+				for (j=0;j<BURST && coroutine_status(S, id[i]);j++) {
+					coroutine_resume(S, id[i]);
+					alive = 1;
+				}
+			}
+		} while (alive);
+		break;
+	}
+	end = now();
+
+	printf("%-10s %-12s %8.2f M yields/s, %7.0f bytes/coroutine parked\n",
+		nstack == 1 ? "1 stack" : nstack == ncoroutines ? "dedicated" : "4 stacks",
+		pattern_names[p],
+		(double)ncoroutines * yields / (end - start) / 1e6,
+		(after - before) * 1024.0 / ncoroutines);
+
+	coroutine_close(S);
+	free(id);
+}
+
+int
+main(int argc, char *argv[]) {
+	int stacks[3];
+	int i, p;
+
+	ncoroutines = argc > 1 ? atoi(argv[1]) : 1000;
+	depth = argc > 2 ? atoi(argv[2]) : 1024;
+	yields = argc > 3 ? atoi(argv[3]) : 1000;
+	stacks[0] = 1;
+	stacks[1] = 4;
+	stacks[2] = ncoroutines;
+
+	printf("%d coroutines, %d bytes of stack, %d yields each\n",
+		ncoroutines, depth, yields);
+	fflush(stdout);
+	for (i=0;i<3;i++) {
+		for (p=ROUND_ROBIN;p<=BURSTS;p++) {
+			if (fork() == 0) {
+				run(stacks[i], p);
+				exit(0);
+			}
+			wait(NULL);
+		}
+	}
+	return 0;
+}
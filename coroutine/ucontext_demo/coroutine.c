@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <string.h>
 #include <stdint.h>
+#include <sys/mman.h>
 
 #if __APPLE__ && __MACH__
 	#include <sys/ucontext.h>
@@ -14,11 +15,34 @@
 
 #define STACK_SIZE (1024*1024)
 #define DEFAULT_COROUTINE 16
+#define DEFAULT_STACKS 4
+
+// Saved stacks come in size classes, four per power of two from 256 bytes
+// up to STACK_SIZE; those up to SAVE_CHUNK_MAX are carved from
+// SAVE_CHUNK_SIZE chunks that are only freed with the schedule.
+#define SAVE_MIN_SHIFT 8
+#define SAVE_CLASSES ((20 - SAVE_MIN_SHIFT) * 4 + 1)
+#define SAVE_CHUNK_SIZE (64*1024)
+#define SAVE_CHUNK_MAX (4*1024)
 
 struct coroutine;
 
+struct stack {
+	char *base;
+	// coroutine whose frames are on the stack, or -1
+	int owner;
+};
+
+struct save_buf {
+	struct save_buf *next;
+};
+
 struct schedule {
-	char stack[STACK_SIZE];
+	struct stack *stack;
+	int nstack;
+	int next_stack;
+	struct save_buf *free_save[SAVE_CLASSES];
+	struct save_buf *chunks;
 	ucontext_t main;
 	int nco;
 	int cap;
@@ -31,34 +55,105 @@ struct coroutine {
 	void *ud;
 	ucontext_t ctx;
 	struct schedule * sch;
-	ptrdiff_t cap;
+	struct stack *stack;
+	// bytes of stack in use when it last yielded
 	ptrdiff_t size;
+	// copy of them while another coroutine runs on the stack, or NULL
+	char *saved;
+	int save_class;
 	int status;
-	char *stack;
 };
 
+// 256, 320, 384, 448, 512, 640, ...
+static ptrdiff_t
+_class_size(int c) {
+	ptrdiff_t base = (ptrdiff_t)1 << (SAVE_MIN_SHIFT + c / 4);
+	return base + base / 4 * (c % 4);
+}
+
+static char *
+_save_alloc(struct schedule *S, ptrdiff_t size, int *class) {
+	int c = 0;
+	ptrdiff_t sz;
+	struct save_buf *b;
+
+	while (_class_size(c) < size) {
+		c++;
+	}
+	*class = c;
+	b = S->free_save[c];
+	if (b) {
+		S->free_save[c] = b->next;
+		return (char *)b;
+	}
+
+	sz = _class_size(c);
+	if (sz > SAVE_CHUNK_MAX) {
+		return malloc(sz);
+	}
+
+	// Carve a new chunk into buffers of this class, but for the first
+	// one which links the chunk list
+	char *chunk = malloc(SAVE_CHUNK_SIZE);
+	char *p;
+	((struct save_buf *)chunk)->next = S->chunks;
+	S->chunks = (struct save_buf *)chunk;
+	for (p = chunk + sz; p + sz <= chunk + SAVE_CHUNK_SIZE; p += sz) {
+		b = (struct save_buf *)p;
+		b->next = S->free_save[c];
+		S->free_save[c] = b;
+	}
+	b = S->free_save[c];
+	S->free_save[c] = b->next;
+	return (char *)b;
+}
+
+static void
+_save_free(struct schedule *S, struct coroutine *C) {
+	struct save_buf *b = (struct save_buf *)C->saved;
+
+	if (b == NULL)
+		return;
+	b->next = S->free_save[C->save_class];
+	S->free_save[C->save_class] = b;
+	C->saved = NULL;
+}
+
 struct coroutine *
 _co_new(struct schedule *S , coroutine_func func, void *ud) {
 	struct coroutine * co = malloc(sizeof(*co));
 	co->func = func;
 	co->ud = ud;
 	co->sch = S;
-	co->cap = 0;
+	co->stack = &S->stack[S->next_stack];
+	S->next_stack = (S->next_stack + 1) % S->nstack;
 	co->size = 0;
+	co->saved = NULL;
 	co->status = COROUTINE_READY;
-	co->stack = NULL;
 	return co;
 }
 
 void
 _co_delete(struct coroutine *co) {
-	free(co->stack);
+	_save_free(co->sch, co);
 	free(co);
 }
 
 struct schedule *
-scheduler_open(void) {
+scheduler_open_stacks(int nstack) {
 	struct schedule *S = malloc(sizeof(*S));
+	int i;
+	assert(nstack > 0);
+	S->nstack = nstack;
+	S->next_stack = 0;
+	S->stack = malloc(sizeof(struct stack) * nstack);
+	for (i=0;i<nstack;i++) {
+		// Mapped on first use, pages only get committed as they are touched
+		S->stack[i].base = NULL;
+		S->stack[i].owner = -1;
+	}
+	memset(S->free_save, 0, sizeof(S->free_save));
+	S->chunks = NULL;
 	S->nco = 0;
 	S->cap = DEFAULT_COROUTINE;
 	S->running = -1;
@@ -67,6 +162,11 @@ scheduler_open(void) {
 	return S;
 }
 
+struct schedule *
+scheduler_open(void) {
+	return scheduler_open_stacks(DEFAULT_STACKS);
+}
+
 void
 coroutine_close(struct schedule *S) {
 	int i;
@@ -76,6 +176,26 @@ coroutine_close(struct schedule *S) {
 			_co_delete(co);
 		}
 	}
+	for (i=0;i<SAVE_CLASSES;i++) {
+		if (_class_size(i) <= SAVE_CHUNK_MAX)
+			continue;
+		while (S->free_save[i]) {
+			struct save_buf *b = S->free_save[i];
+			S->free_save[i] = b->next;
+			free(b);
+		}
+	}
+	while (S->chunks) {
+		struct save_buf *chunk = S->chunks;
+		S->chunks = chunk->next;
+		free(chunk);
+	}
+	for (i=0;i<S->nstack;i++) {
+		if (S->stack[i].base) {
+			munmap(S->stack[i].base, STACK_SIZE);
+		}
+	}
+	free(S->stack);
 	free(S->co);
 	S->co = NULL;
 	free(S);
@@ -114,24 +234,48 @@ mainfunc(uint32_t low32, uint32_t hi32) {
 	int id = S->running;
 	struct coroutine *C = S->co[id];
 	C->func(S,C->ud);
+	C->stack->owner = -1;
 	_co_delete(C);
 	S->co[id] = NULL;
 	--S->nco;
 	S->running = -1;
 }
 
+// Make room on a stack for another coroutine: its owner, which is
+// suspended, gets the frames it left there copied out.
+static void
+_evict(struct schedule *S, struct stack *st) {
+	struct coroutine *O;
+
+	if (st->owner < 0)
+		return;
+	O = S->co[st->owner];
+	O->saved = _save_alloc(S, O->size, &O->save_class);
+	memcpy(O->saved, st->base + STACK_SIZE - O->size, O->size);
+	st->owner = -1;
+}
+
 void
 coroutine_resume(struct schedule * S, int id) {
 	assert(S->running == -1);
 	assert(id >=0 && id < S->cap);
 	struct coroutine *C = S->co[id];
+	struct stack *st;
 	if (C == NULL)
 		return;
+	st = C->stack;
 	int status = C->status;
 	switch(status) {
 	case COROUTINE_READY:
+		if (st->base == NULL) {
+			st->base = mmap(NULL, STACK_SIZE, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			assert(st->base != MAP_FAILED);
+		}
+		_evict(S, st);
+		st->owner = id;
 		getcontext(&C->ctx);
-		C->ctx.uc_stack.ss_sp = S->stack;
+		C->ctx.uc_stack.ss_sp = st->base;
 		C->ctx.uc_stack.ss_size = STACK_SIZE;
 		C->ctx.uc_link = &S->main;
 		S->running = id;
@@ -141,7 +285,14 @@ coroutine_resume(struct schedule * S, int id) {
 		swapcontext(&S->main, &C->ctx);
 		break;
 	case COROUTINE_SUSPEND:
-		memcpy(S->stack + STACK_SIZE - C->size, C->stack, C->size);
+		// Resumed right after it yielded, or alone on its stack since:
+		// its frames are still in place.
+		if (st->owner != id) {
+			_evict(S, st);
+			memcpy(st->base + STACK_SIZE - C->size, C->saved, C->size);
+			_save_free(S, C);
+			st->owner = id;
+		}
 		S->running = id;
 		C->status = COROUTINE_RUNNING;
 		swapcontext(&S->main, &C->ctx);
@@ -151,17 +302,13 @@ coroutine_resume(struct schedule * S, int id) {
 	}
 }
 
-static void
-_save_stack(struct coroutine *C, char *top) {
+// Not inlined so that dummy is below the frame of coroutine_yield(), and
+// the return address of its swapcontext() call is within the size.
+static void __attribute__((noinline))
+_mark_stack(struct coroutine *C, char *top) {
 	char dummy = 0;
 	assert(top - &dummy <= STACK_SIZE);
-	if (C->cap < top - &dummy) {
-		free(C->stack);
-		C->cap = top-&dummy;
-		C->stack = malloc(C->cap);
-	}
 	C->size = top - &dummy;
-	memcpy(C->stack, &dummy, C->size);
 }
 
 void
@@ -169,8 +316,10 @@ coroutine_yield(struct schedule * S) {
 	int id = S->running;
 	assert(id >= 0);
 	struct coroutine * C = S->co[id];
-	assert((char *)&C > S->stack);
-	_save_stack(C,S->stack + STACK_SIZE);
+	assert((char *)&C > C->stack->base);
+	// The frames stay where they are until another coroutine needs the
+	// stack, only remember how much to copy then.
+	_mark_stack(C, C->stack->base + STACK_SIZE);
 	C->status = COROUTINE_SUSPEND;
 	S->running = -1;
 	swapcontext(&C->ctx , &S->main);
@@ -189,4 +338,3 @@ int
 coroutine_running(struct schedule * S) {
 	return S->running;
 }
-
@@ -11,6 +11,8 @@ struct schedule;
 typedef void (*coroutine_func)(struct schedule *, void *ud);
 
 struct schedule * scheduler_open(void);
+// Coroutines are spread over nstack shared stacks
+struct schedule * scheduler_open_stacks(int nstack);
 void coroutine_close(struct schedule *);
 
 int coroutine_new(struct schedule *, coroutine_func, void *ud);
@@ -0,0 +1,348 @@
+/*
+ * Ring buffer benchmark
+ *
+ * Compares the lock-free ring of ring.c, in its SPSC and MPMC variants,
+ * with a mutex and condition variable protected queue of the same size:
+ *  - throughput: producers push sequence numbers in batches as fast as
+ *    they can while consumers pop them in batches, sleeping when empty;
+ *  - latency: a single producer sends a timestamp every 20 us to a
+ *    consumer that is normally asleep, so every message is a wakeup.
+ *
+ * Usage: bench_ring [messages] [batch] [producers] [consumers]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "ring.h"
+
+#define RING_SIZE       4096
+#define MAX_BATCH       256
+#define LATENCY_SAMPLES 20000
+#define LATENCY_GAP_NS  20000
+
+typedef struct MutexQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    void **slots;
+    unsigned mask;
+    unsigned head;
+    unsigned tail;
+    int waiters;
+} MutexQueue;
+
+typedef enum {
+    QUEUE_SPSC,
+    QUEUE_MPMC,
+    QUEUE_MUTEX,
+} QueueType;
+
+static const char *queue_names[] = {
+    [QUEUE_SPSC] = "spsc ring",
+    [QUEUE_MPMC] = "mpmc ring",
+    [QUEUE_MUTEX] = "mutex+cond",
+};
+
+typedef struct Queue {
+    QueueType type;
+    Ring *ring;
+    MutexQueue mq;
+} Queue;
+
+typedef struct Worker {
+    Queue *q;
+    pthread_t thread;
+    unsigned long first, count;
+    unsigned long sum;
+    int64_t *lat;
+    int nr_lat;
+} __attribute__((aligned(64))) Worker;
+
+static unsigned batch;
+
+static int64_t get_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static unsigned mq_enqueue_burst(MutexQueue *q, void * const *objs,
+                                 unsigned n)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&q->lock);
+    if (n > q->mask + 1 - (q->tail - q->head)) {
+        n = q->mask + 1 - (q->tail - q->head);
+    }
+    for (i = 0; i < n; i++) {
+        q->slots[(q->tail + i) & q->mask] = objs[i];
+    }
+    q->tail += n;
+    if (n && q->waiters) {
+        if (n > 1 && q->waiters > 1) {
+            pthread_cond_broadcast(&q->not_empty);
+        } else {
+            pthread_cond_signal(&q->not_empty);
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+static unsigned mq_dequeue_wait(MutexQueue *q, void **objs, unsigned n)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->tail == q->head) {
+        q->waiters++;
+        pthread_cond_wait(&q->not_empty, &q->lock);
+        q->waiters--;
+    }
+    if (n > q->tail - q->head) {
+        n = q->tail - q->head;
+    }
+    for (i = 0; i < n; i++) {
+        objs[i] = q->slots[(q->head + i) & q->mask];
+    }
+    q->head += n;
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+static void queue_init(Queue *q, QueueType type)
+{
+    memset(q, 0, sizeof(*q));
+    q->type = type;
+    if (type == QUEUE_MUTEX) {
+        pthread_mutex_init(&q->mq.lock, NULL);
+        pthread_cond_init(&q->mq.not_empty, NULL);
+        q->mq.slots = calloc(RING_SIZE, sizeof(void *));
+        q->mq.mask = RING_SIZE - 1;
+    } else {
+        q->ring = ring_new(RING_SIZE, type == QUEUE_SPSC ? RING_SPSC
+                                                         : RING_MPMC);
+        if (!q->ring) {
+            perror("ring_new");
+            exit(1);
+        }
+    }
+}
+
+static void queue_destroy(Queue *q)
+{
+    if (q->type == QUEUE_MUTEX) {
+        pthread_mutex_destroy(&q->mq.lock);
+        pthread_cond_destroy(&q->mq.not_empty);
+        free(q->mq.slots);
+    } else {
+        ring_free(q->ring);
+    }
+}
+
+/* Push all of @objs, yielding while the queue is full */
+static void queue_push(Queue *q, void * const *objs, unsigned n)
+{
+    while (n) {
+        unsigned done = q->type == QUEUE_MUTEX
+                        ? mq_enqueue_burst(&q->mq, objs, n)
+                        : ring_enqueue_burst(q->ring, objs, n);
+
+        if (!done) {
+            sched_yield();
+        }
+        objs += done;
+        n -= done;
+    }
+}
+
+static unsigned queue_pop_wait(Queue *q, void **objs, unsigned n)
+{
+    return q->type == QUEUE_MUTEX ? mq_dequeue_wait(&q->mq, objs, n)
+                                  : ring_dequeue_wait(q->ring, objs, n);
+}
+
+/* Messages are sequence numbers plus one, NULL tells a consumer to stop */
+static void *producer_thread(void *opaque)
+{
+    Worker *w = opaque;
+    void *objs[MAX_BATCH];
+    unsigned long i = 0;
+    unsigned j, n;
+
+    while (i < w->count) {
+        n = w->count - i < batch ? w->count - i : batch;
+        for (j = 0; j < n; j++) {
+            objs[j] = (void *)(uintptr_t)(w->first + i + j + 1);
+        }
+        queue_push(w->q, objs, n);
+        i += n;
+    }
+    return NULL;
+}
+
+static void *consumer_thread(void *opaque)
+{
+    Worker *w = opaque;
+    void *objs[MAX_BATCH];
+    unsigned i, n, stops;
+
+    for (;;) {
+        n = queue_pop_wait(w->q, objs, batch);
+        stops = 0;
+        for (i = 0; i < n; i++) {
+            if (objs[i]) {
+                w->sum += (uintptr_t)objs[i];
+                w->count++;
+            } else {
+                stops++;
+            }
+        }
+        if (stops) {
+            /* The stops are the last messages, leave the others' ones */
+            while (--stops) {
+                void *stop = NULL;
+
+                queue_push(w->q, &stop, 1);
+            }
+            return NULL;
+        }
+    }
+}
+
+static void run_throughput(QueueType type, unsigned long total,
+                           int nr_prod, int nr_cons)
+{
+    Worker *prod = calloc(nr_prod, sizeof(Worker));
+    Worker *cons = calloc(nr_cons, sizeof(Worker));
+    unsigned long received = 0, sum = 0;
+    int64_t start, end;
+    Queue q;
+    int i;
+
+    queue_init(&q, type);
+    start = get_clock();
+    for (i = 0; i < nr_cons; i++) {
+        cons[i].q = &q;
+        pthread_create(&cons[i].thread, NULL, consumer_thread, &cons[i]);
+    }
+    for (i = 0; i < nr_prod; i++) {
+        prod[i].q = &q;
+        prod[i].first = total / nr_prod * i;
+        prod[i].count = i == nr_prod - 1 ? total - prod[i].first
+                                         : total / nr_prod;
+        pthread_create(&prod[i].thread, NULL, producer_thread, &prod[i]);
+    }
+    for (i = 0; i < nr_prod; i++) {
+        pthread_join(prod[i].thread, NULL);
+    }
+    for (i = 0; i < nr_cons; i++) {
+        void *stop = NULL;
+
+        queue_push(&q, &stop, 1);
+    }
+    for (i = 0; i < nr_cons; i++) {
+        pthread_join(cons[i].thread, NULL);
+        received += cons[i].count;
+        sum += cons[i].sum;
+    }
+    end = get_clock();
+
+    if (received != total || sum != total * (total + 1) / 2) {
+        fprintf(stderr, "%s: lost messages\n", queue_names[type]);
+        abort();
+    }
+    printf("%-10s %dp/%dc: %7.2f Mmsgs/s\n", queue_names[type],
+           nr_prod, nr_cons, total * 1e3 / (end - start));
+
+    queue_destroy(&q);
+    free(prod);
+    free(cons);
+}
+
+/* One message in flight at a time, sent when the consumer is idle */
+static void *latency_consumer(void *opaque)
+{
+    Worker *w = opaque;
+    void *obj;
+
+    while (w->nr_lat < LATENCY_SAMPLES) {
+        queue_pop_wait(w->q, &obj, 1);
+        w->lat[w->nr_lat++] = get_clock() - (int64_t)(uintptr_t)obj;
+        __atomic_store_n(&w->count, w->nr_lat, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void run_latency(QueueType type)
+{
+    struct timespec gap = { 0, LATENCY_GAP_NS };
+    Worker w = { 0 };
+    Queue q;
+    unsigned long i;
+
+    queue_init(&q, type);
+    w.q = &q;
+    w.lat = calloc(LATENCY_SAMPLES, sizeof(int64_t));
+    pthread_create(&w.thread, NULL, latency_consumer, &w);
+
+    for (i = 0; i < LATENCY_SAMPLES; i++) {
+        void *obj;
+
+        nanosleep(&gap, NULL);
+        obj = (void *)(uintptr_t)get_clock();
+        queue_push(&q, &obj, 1);
+        while (__atomic_load_n(&w.count, __ATOMIC_ACQUIRE) <= i) {
+            sched_yield();
+        }
+    }
+    pthread_join(w.thread, NULL);
+
+    qsort(w.lat, LATENCY_SAMPLES, sizeof(int64_t), cmp_int64);
+    printf("%-10s wakeup latency: p50 %6.2f us, p99 %6.2f us, "
+           "p99.9 %6.2f us\n", queue_names[type],
+           w.lat[LATENCY_SAMPLES / 2] / 1e3,
+           w.lat[LATENCY_SAMPLES * 99 / 100] / 1e3,
+           w.lat[LATENCY_SAMPLES * 999 / 1000] / 1e3);
+
+    queue_destroy(&q);
+    free(w.lat);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long total = argc > 1 ? atol(argv[1]) : 10000000;
+    int nr_prod = argc > 3 ? atoi(argv[3]) : 2;
+    int nr_cons = argc > 4 ? atoi(argv[4]) : 2;
+
+    batch = argc > 2 ? atoi(argv[2]) : 32;
+    if (batch < 1 || batch > MAX_BATCH) {
+        fprintf(stderr, "batch must be between 1 and %d\n", MAX_BATCH);
+        return 1;
+    }
+
+    printf("%lu messages, batches of %u\n", total, batch);
+    run_throughput(QUEUE_SPSC, total, 1, 1);
+    run_throughput(QUEUE_MUTEX, total, 1, 1);
+    run_throughput(QUEUE_MPMC, total, nr_prod, nr_cons);
+    run_throughput(QUEUE_MUTEX, total, nr_prod, nr_cons);
+
+    run_latency(QUEUE_SPSC);
+    run_latency(QUEUE_MPMC);
+    run_latency(QUEUE_MUTEX);
+    return 0;
+}
@@ -0,0 +1,240 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include "ring.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax()   __asm__ volatile("pause" ::: "memory")
+#elif defined(__aarch64__)
+#define cpu_relax()   __asm__ volatile("yield" ::: "memory")
+#else
+#define cpu_relax()   __asm__ volatile("" ::: "memory")
+#endif
+
+/* Spins on an earlier reservation before giving up the CPU.  Its owner
+ * may have been preempted, and would otherwise only run again after the
+ * waiter's time slice ends.
+ */
+#define RING_SPIN_LIMIT 256
+
+Ring *ring_new(unsigned size, RingType type)
+{
+    Ring *r;
+    unsigned capacity = 2;
+
+    while (capacity < size) {
+        capacity *= 2;
+    }
+
+    if (posix_memalign((void **)&r, RING_CACHE_LINE, sizeof(Ring))) {
+        return NULL;
+    }
+    *r = (Ring) {
+        .type = type,
+        .mask = capacity - 1,
+        .slots = calloc(capacity, sizeof(void *)),
+    };
+
+    /* One token per woken consumer, so each read takes just one */
+    r->efd = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE);
+    if (r->efd < 0 || !r->slots) {
+        if (r->efd >= 0) {
+            close(r->efd);
+        }
+        free(r->slots);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void ring_free(Ring *r)
+{
+    close(r->efd);
+    free(r->slots);
+    free(r);
+}
+
+/* Reserve up to @n entries by advancing @ht->head.  @other is the opposite
+ * side, whose tail bounds how far the head can go: @capacity entries past
+ * it for producers, exactly at it for consumers.
+ */
+static unsigned ring_move_head(Ring *r, RingHeadTail *ht, RingHeadTail *other,
+                               unsigned capacity, unsigned n,
+                               unsigned *old_head)
+{
+    unsigned head = __atomic_load_n(&ht->head, __ATOMIC_RELAXED);
+    unsigned avail;
+
+    do {
+        /* Do not read the other tail before our head, then pair with the
+         * release in ring_update_tail() to see the entries it covers.
+         */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        avail = capacity + __atomic_load_n(&other->tail, __ATOMIC_ACQUIRE) -
+                head;
+        if (n > avail) {
+            n = avail;
+        }
+        if (!n) {
+            return 0;
+        }
+        if (r->type == RING_SPSC) {
+            __atomic_store_n(&ht->head, head + n, __ATOMIC_RELAXED);
+            break;
+        }
+    } while (!__atomic_compare_exchange_n(&ht->head, &head, head + n, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    *old_head = head;
+    return n;
+}
+
+/* Publish [@old, @new).  Reservations made before ours must be published
+ * first, since the tail says that everything before it is done.  Waiting
+ * with acquire chains their release to ours, so whoever sees our tail
+ * also sees their copies.
+ */
+static void ring_update_tail(Ring *r, RingHeadTail *ht, unsigned old,
+                             unsigned new)
+{
+    unsigned spins = 0;
+
+    if (r->type == RING_MPMC) {
+        while (__atomic_load_n(&ht->tail, __ATOMIC_ACQUIRE) != old) {
+            if (++spins < RING_SPIN_LIMIT) {
+                cpu_relax();
+            } else {
+                sched_yield();
+            }
+        }
+    }
+    __atomic_store_n(&ht->tail, new, __ATOMIC_RELEASE);
+}
+
+/* Hand a token to at most @n parked consumers */
+static void ring_wake(Ring *r, unsigned n)
+{
+    uint64_t value;
+    int parked;
+
+    /* Publish the entries before looking for parked consumers.  Pairs with
+     * the barrier in ring_dequeue_wait(): either we see the consumer
+     * parked, or it sees the entries.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    parked = __atomic_load_n(&r->nr_parked, __ATOMIC_RELAXED);
+    while (parked > 0) {
+        int k = (unsigned)parked < n ? parked : (int)n;
+
+        if (__atomic_compare_exchange_n(&r->nr_parked, &parked, parked - k,
+                                        false, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED)) {
+            value = k;
+            if (write(r->efd, &value, sizeof(value)) != sizeof(value)) {
+                abort();
+            }
+            return;
+        }
+    }
+}
+
+unsigned ring_enqueue_burst(Ring *r, void * const *objs, unsigned n)
+{
+    unsigned head, i;
+
+    n = ring_move_head(r, &r->prod, &r->cons, r->mask + 1, n, &head);
+    if (!n) {
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        r->slots[(head + i) & r->mask] = objs[i];
+    }
+    ring_update_tail(r, &r->prod, head, head + n);
+
+    /* Wake one consumer, it passes the wakeup on if it leaves entries */
+    ring_wake(r, 1);
+    return n;
+}
+
+unsigned ring_dequeue_burst(Ring *r, void **objs, unsigned n)
+{
+    unsigned head, i;
+
+    n = ring_move_head(r, &r->cons, &r->prod, 0, n, &head);
+    if (!n) {
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        objs[i] = r->slots[(head + i) & r->mask];
+    }
+    ring_update_tail(r, &r->cons, head, head + n);
+    return n;
+}
+
+static void ring_take_token(Ring *r)
+{
+    uint64_t value;
+
+    while (read(r->efd, &value, sizeof(value)) != sizeof(value)) {
+        if (errno != EINTR) {
+            abort();
+        }
+    }
+}
+
+unsigned ring_dequeue_wait(Ring *r, void **objs, unsigned n)
+{
+    unsigned got;
+    int parked;
+
+    for (;;) {
+        got = ring_dequeue_burst(r, objs, n);
+        if (got) {
+            return got;
+        }
+
+        /* Register as parked before the last look at the ring */
+        __atomic_fetch_add(&r->nr_parked, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        got = ring_dequeue_burst(r, objs, n);
+        if (got) {
+            /* Take the registration back, unless a producer claimed it:
+             * then its token is on the way and must be consumed.
+             */
+            parked = __atomic_load_n(&r->nr_parked, __ATOMIC_RELAXED);
+            while (parked > 0 &&
+                   !__atomic_compare_exchange_n(&r->nr_parked, &parked,
+                                                parked - 1, false,
+                                                __ATOMIC_RELAXED,
+                                                __ATOMIC_RELAXED)) {
+                /* retry */
+            }
+            if (parked > 0) {
+                return got;
+            }
+        }
+
+        ring_take_token(r);
+        if (!got) {
+            got = ring_dequeue_burst(r, objs, n);
+        }
+        if (got) {
+            if (ring_count(r)) {
+                ring_wake(r, 1);
+            }
+            return got;
+        }
+    }
+}
+
+unsigned ring_count(Ring *r)
+{
+    return __atomic_load_n(&r->prod.tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&r->cons.tail, __ATOMIC_ACQUIRE);
+}
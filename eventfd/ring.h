@@ -0,0 +1,63 @@
+/*
+ * Lock-free ring buffer of pointers with eventfd wakeups
+ *
+ * Producers and consumers each own a head/tail pair on its own cache line.
+ * To move n entries a side reserves them by advancing its head, copies
+ * them, then publishes them by advancing its tail; in the multi-producer
+ * or multi-consumer variant the head is advanced with a cmpxchg and the
+ * tails are published in reservation order.
+ *
+ * A consumer that finds the ring empty can park in ring_dequeue_wait().
+ * Only then do producers pay for a write to the eventfd, and only one per
+ * parked consumer: a producer claims a parked consumer before waking it,
+ * so a burst of enqueues to a sleeping consumer costs a single syscall.
+ * An enqueue wakes one consumer at most; a woken consumer that leaves
+ * entries behind wakes the next, rather than all of them racing for a
+ * burst that one of them can drain.
+ */
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+
+#define RING_CACHE_LINE 64
+
+typedef enum {
+    RING_SPSC,      /* one producer thread, one consumer thread */
+    RING_MPMC,      /* any number of both */
+} RingType;
+
+typedef struct RingHeadTail {
+    unsigned head;  /* next entry to reserve */
+    unsigned tail;  /* entries before it are done */
+} __attribute__((aligned(RING_CACHE_LINE))) RingHeadTail;
+
+typedef struct Ring {
+    RingHeadTail prod;
+    RingHeadTail cons;
+
+    /* Consumers parked on efd that no producer has claimed yet */
+    int nr_parked __attribute__((aligned(RING_CACHE_LINE)));
+    int efd;
+
+    RingType type;
+    unsigned mask;
+    void **slots;
+} Ring;
+
+/* @size is rounded up to a power of two */
+Ring *ring_new(unsigned size, RingType type);
+void ring_free(Ring *r);
+
+/* Enqueue up to @n entries, returns how many fit */
+unsigned ring_enqueue_burst(Ring *r, void * const *objs, unsigned n);
+
+/* Dequeue up to @n entries, returns how many there were */
+unsigned ring_dequeue_burst(Ring *r, void **objs, unsigned n);
+
+/* Like ring_dequeue_burst, but sleeps until at least one entry is there */
+unsigned ring_dequeue_wait(Ring *r, void **objs, unsigned n);
+
+unsigned ring_count(Ring *r);
+
+#endif /* RING_H */
@@ -1,5 +1,8 @@
+#define _GNU_SOURCE
 #include <glib.h>
+#include <string.h>
 #include <unistd.h>
+#include <poll.h>
 
 /*
  * List definitions.
@@ -36,9 +39,14 @@ struct {                                                                \
 
 typedef void IOHandler(void *opaque);
 
+typedef struct AioHandler AioHandler;
+
 struct AioContext {
     GSource source;
     QLIST_HEAD(, AioHandler) aio_handlers;
+    /* aio_handlers indexed by fd, see find_aio_handler */
+    AioHandler **fd_handlers;
+    int fd_handlers_size;
 };
 
 struct AioHandler {
@@ -50,13 +58,15 @@ struct AioHandler {
 };
 
 typedef struct AioContext AioContext;
-typedef struct AioHandler AioHandler;
 
 static AioContext *qemu_aio_context;
 static AioContext *iohandler_ctx;
 static GArray *gpollfds;
 static int max_priority;
 
+/* Without --glib the main loop polls qemu_aio_context itself, see aio_poll */
+static gboolean use_glib;
+
 static void
 fd_read_cb(void *opaque)
 {
@@ -159,6 +169,40 @@ aio_dispatch(AioContext *ctx)
     aio_dispatch_handlers(ctx);
 }
 
+/* Native mode: wait for the handlers of @ctx with a single ppoll and
+ * dispatch them, bypassing GMainContext and its per-iteration locking and
+ * walk of every source.
+ */
+static gboolean
+aio_poll(AioContext *ctx, gboolean blocking)
+{
+    struct timespec zero = { 0, 0 };
+    AioHandler *node;
+    int i = 0, ret;
+
+    g_array_set_size(gpollfds, 0);
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (node->pfd.events) {
+            g_array_append_val(gpollfds, node->pfd);
+        }
+    }
+
+    ret = ppoll((struct pollfd *)gpollfds->data, gpollfds->len,
+                blocking ? NULL : &zero, NULL);
+    if (ret <= 0) {
+        return FALSE;
+    }
+
+    /* Nothing can change the list between filling the array and here */
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (node->pfd.events) {
+            node->pfd.revents = g_array_index(gpollfds, GPollFD, i++).revents;
+        }
+    }
+    aio_dispatch(ctx);
+    return TRUE;
+}
+
 static gboolean
 aio_ctx_dispatch(GSource     *source,
                  GSourceFunc  callback,
@@ -179,6 +223,9 @@ aio_ctx_finalize(GSource     *source)
 #ifdef DEBUG
     g_print("%s\n", __FUNCTION__);
 #endif
+    AioContext *ctx = (AioContext *) source;
+
+    g_free(ctx->fd_handlers);
 }
 
 static GSourceFuncs
@@ -218,17 +265,33 @@ aio_remove_fd_handler(AioContext *ctx, AioHandler *node)
     g_free(node);
 }
 
+/* Walking aio_handlers would make registering n fds O(n^2), so the
+ * handlers are also kept in an array indexed by fd.
+ */
 static AioHandler *
 find_aio_handler(AioContext *ctx, int fd)
 {
-    AioHandler *node;
+    return fd < ctx->fd_handlers_size ? ctx->fd_handlers[fd] : NULL;
+}
 
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        if (node->pfd.fd == fd)
-            return node;
-    }
+static void
+set_aio_handler(AioContext *ctx, int fd, AioHandler *node)
+{
+    if (fd >= ctx->fd_handlers_size) {
+        int size = ctx->fd_handlers_size ? ctx->fd_handlers_size : 64;
 
-    return NULL;
+        if (!node) {
+            return;
+        }
+        while (size <= fd) {
+            size *= 2;
+        }
+        ctx->fd_handlers = g_renew(AioHandler *, ctx->fd_handlers, size);
+        memset(ctx->fd_handlers + ctx->fd_handlers_size, 0,
+               (size - ctx->fd_handlers_size) * sizeof(AioHandler *));
+        ctx->fd_handlers_size = size;
+    }
+    ctx->fd_handlers[fd] = node;
 }
 
 static void
@@ -275,6 +338,7 @@ aio_set_fd_handler(AioContext *ctx,
 
         QLIST_INSERT_HEAD(&ctx->aio_handlers, new_node, node);
     }
+    set_aio_handler(ctx, fd, new_node);
 
     if (node) {
         aio_remove_fd_handler(ctx, node);
@@ -322,6 +386,12 @@ qemu_init_main_loop()
     qemu_aio_context = aio_context_new();
     gpollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
 
+    if (!use_glib) {
+        /* A single context to wait on, the I/O handlers share it */
+        iohandler_ctx = qemu_aio_context;
+        return;
+    }
+
     src = aio_get_g_source(qemu_aio_context);
     g_source_set_name(src, "aio-context");
     g_source_attach(src, NULL);
@@ -376,6 +446,10 @@ static int main_loop_wait()
     GMainContext *context = g_main_context_default();
     int ret;
 
+    if (!use_glib) {
+        return aio_poll(qemu_aio_context, TRUE);
+    }
+
     g_main_context_acquire(context);
 
     g_array_set_size(gpollfds, 0);
@@ -397,12 +471,14 @@ static void main_loop()
     }
 }
 
+/* Usage: qemu_main_loop [--glib] */
 int main(int argc, char* argv[])
 {
     int fd;
     GError *error = NULL;
     GIOChannel *channel;
 
+    use_glib = argc > 1 && !strcmp(argv[1], "--glib");
     qemu_init_main_loop();
 
     if (!(channel = g_io_channel_new_file("test", "r", &error))) {
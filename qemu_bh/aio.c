@@ -1,28 +1,38 @@
+#define _GNU_SOURCE
 #include <glib.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <assert.h>
+#include "atomic.h"
 #include "aio.h"
+#include "async.h"
+#include "aio_stats.h"
 
 gboolean
 aio_prepare(AioContext *ctx)
 {
+    if (ctx->fdmon_ops->prepare) {
+        ctx->fdmon_ops->prepare(ctx);
+    }
     return FALSE;
 }
 
-gboolean
-aio_pending(AioContext *ctx)
+static bool fdmon_poll_pending(AioContext *ctx)
 {
     AioHandler *node;
-    gboolean result = FALSE;
+    bool result = false;
 
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
         int revents;
 
         revents = node->pfd.revents & node->pfd.events;
         if (revents & (G_IO_IN | G_IO_HUP | G_IO_ERR) && node->io_read) {
-            result = TRUE;
+            result = true;
             break;
         }
         if (revents & (G_IO_OUT | G_IO_ERR) && node->io_write) {
-            result = TRUE;
+            result = true;
             break;
         }
     }
@@ -30,66 +40,171 @@ aio_pending(AioContext *ctx)
     return result;
 }
 
-gboolean
-aio_dispatch_handlers(AioContext *ctx)
+static inline void aio_run_handler(AioHandler *node, int revents)
 {
-    AioHandler *node, *tmp;
+    if ((revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
+        node->io_read) {
+        node->io_read(node->opaque);
+    }
+    if ((revents & (G_IO_OUT | G_IO_ERR)) &&
+        node->io_write) {
+        node->io_write(node->opaque);
+    }
+}
 
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        int revents;
+static void __attribute__((noinline))
+aio_run_handler_stats(AioContext *ctx, AioHandler *node, int revents)
+{
+    int fd = node->pfd.fd;
+    void *cb = node->io_read ? (void *)node->io_read : (void *)node->io_write;
+    void *opaque = node->opaque;
+    int64_t start = get_clock();
 
-        revents = node->pfd.revents & node->pfd.events;
-        node->pfd.revents = 0;
+    aio_run_handler(node, revents);
+    aio_stats_record(ctx, AIO_STATS_HANDLER, fd, cb, opaque,
+                     start, get_clock(),
+                     ctx->stats_ready_ns ? start - ctx->stats_ready_ns : -1);
+}
+
+void aio_dispatch_handler(AioContext *ctx, AioHandler *node)
+{
+    int revents;
+
+    revents = node->pfd.revents & node->pfd.events;
+    node->pfd.revents = 0;
+
+    if (atomic_read(&node->deleted) || !revents) {
+        return;
+    }
+    if (unlikely(ctx->stats_enabled)) {
+        aio_run_handler_stats(ctx, node, revents);
+    } else {
+        aio_run_handler(node, revents);
+    }
+}
+
+static bool fdmon_poll_dispatch(AioContext *ctx)
+{
+    AioHandler *node;
+
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        aio_dispatch_handler(ctx, node);
+    }
+
+    return true;
+}
+
+/* Fallback used when the glib main loop is not involved: build a pollfd
+ * array out of all the handlers, like glib would.
+ */
+static int fdmon_poll_wait(AioContext *ctx, int64_t timeout)
+{
+    struct pollfd *pollfds = ctx->pollfds;
+    AioHandler **nodes = ctx->pollfds_nodes;
+    struct timespec ts;
+    AioHandler *node;
+    unsigned npfd = 0, i;
+    int ret;
 
-        if ((revents & (G_IO_IN | G_IO_HUP | G_IO_ERR)) &&
-            node->io_read) {
-            node->io_read(node->opaque);
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        if (node->deleted || !node->pfd.events) {
+            continue;
         }
-        if ((revents & (G_IO_OUT | G_IO_ERR)) &&
-            node->io_write) {
-            node->io_write(node->opaque);
+        if (npfd == ctx->pollfds_size) {
+            ctx->pollfds_size = npfd ? npfd * 2 : 8;
+            pollfds = g_renew(struct pollfd, pollfds, ctx->pollfds_size);
+            nodes = g_renew(AioHandler *, nodes, ctx->pollfds_size);
+            ctx->pollfds = pollfds;
+            ctx->pollfds_nodes = nodes;
         }
+        nodes[npfd] = node;
+        pollfds[npfd] = (struct pollfd) {
+            .fd = node->pfd.fd,
+            .events = node->pfd.events,
+        };
+        npfd++;
+    }
+
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000000000LL;
+        ts.tv_nsec = timeout % 1000000000LL;
+    }
+    ret = ppoll(pollfds, npfd, timeout < 0 ? NULL : &ts, NULL);
+    if (ret < 0) {
+        return -errno;
     }
 
-    return TRUE;
+    for (i = 0; i < npfd; i++) {
+        nodes[i]->pfd.revents = pollfds[i].revents;
+    }
+    return ret;
 }
 
-static bool aio_remove_fd_handler(AioContext *ctx, AioHandler *node)
+static void fdmon_poll_update(AioContext *ctx,
+                              AioHandler *old_node,
+                              AioHandler *new_node)
 {
     /* If the GSource is in the process of being destroyed then
      * g_source_remove_poll() causes an assertion failure.  Skip
      * removal in that case, because glib cleans up its state during
      * destruction anyway.
      */
-    if (!g_source_is_destroyed(&ctx->source)) {
-        g_source_remove_poll(&ctx->source, &node->pfd);
+    if (old_node && !g_source_is_destroyed(&ctx->source)) {
+        g_source_remove_poll(&ctx->source, &old_node->pfd);
     }
-
-    /* If a read is in progress, just mark the node as deleted */
-    if (qemu_lockcnt_count(&ctx->list_lock)) {
-        node->deleted = 1;
-        node->pfd.revents = 0;
-        return false;
+    if (new_node) {
+        g_source_add_poll(&ctx->source, &new_node->pfd);
     }
-    /* Otherwise, delete it for real.  We can't just mark it as
-     * deleted because deleted nodes are only cleaned up while
-     * no one is walking the handlers list.
-     */
-    QLIST_REMOVE(node, node);
-    return true;
 }
 
+const FDMonOps fdmon_poll_ops = {
+    .update = fdmon_poll_update,
+    .wait = fdmon_poll_wait,
+    .pending = fdmon_poll_pending,
+    .dispatch = fdmon_poll_dispatch,
+};
+
+gboolean
+aio_pending(AioContext *ctx)
+{
+    return ctx->fdmon_ops->pending(ctx);
+}
+
+/* Called in an RCU critical section.  Handlers removed meanwhile are
+ * freed when the outermost critical section ends.
+ */
+gboolean
+aio_dispatch_handlers(AioContext *ctx)
+{
+    return ctx->fdmon_ops->dispatch(ctx);
+}
+
+/* Called with list_lock taken, removed nodes are not in the table */
 static AioHandler *
 find_aio_handler(AioContext *ctx, int fd)
 {
-    AioHandler *node;
+    return fd < ctx->fd_handlers_size ? ctx->fd_handlers[fd] : NULL;
+}
 
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        if (node->pfd.fd == fd)
-            return node;
-    }
+/* Called with list_lock taken */
+static void
+set_aio_handler(AioContext *ctx, int fd, AioHandler *node)
+{
+    if (fd >= ctx->fd_handlers_size) {
+        int size = ctx->fd_handlers_size ? ctx->fd_handlers_size : 64;
 
-    return NULL;
+        if (!node) {
+            return;
+        }
+        while (size <= fd) {
+            size *= 2;
+        }
+        ctx->fd_handlers = g_renew(AioHandler *, ctx->fd_handlers, size);
+        memset(ctx->fd_handlers + ctx->fd_handlers_size, 0,
+               (size - ctx->fd_handlers_size) * sizeof(AioHandler *));
+        ctx->fd_handlers_size = size;
+    }
+    ctx->fd_handlers[fd] = node;
 }
 
 
@@ -102,17 +217,18 @@ void aio_set_fd_handler(AioContext *ctx,
 {
     AioHandler *node;
     AioHandler *new_node = NULL;
+    const FDMonOps *fdmon_ops;
     bool is_new = FALSE;
-    bool deleted = false;
     int poll_disable_change;
 
-    qemu_lockcnt_lock(&ctx->list_lock);
+    pthread_mutex_lock(&ctx->list_lock);
 
     node = find_aio_handler(ctx, fd);
 
     /* Are we deleting the fd handler? */
     if (!io_read && !io_write && !io_poll) {
         if (node == NULL) {
+            pthread_mutex_unlock(&ctx->list_lock);
             return;
         }
         /* Clean events in order to unregister fd from the ctx epoll. */
@@ -136,25 +252,38 @@ void aio_set_fd_handler(AioContext *ctx,
             new_node->pfd.fd = fd;
         } else {
             new_node->pfd = node->pfd;
+            if (io_poll) {
+                new_node->io_poll_begin = node->io_poll_begin;
+                new_node->io_poll_end = node->io_poll_end;
+            }
         }
-        g_source_add_poll(&ctx->source, &new_node->pfd);
 
         new_node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         new_node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
 
-        QLIST_INSERT_HEAD(&ctx->aio_handlers, new_node, node);
+        QLIST_INSERT_HEAD_RCU(&ctx->aio_handlers, new_node, node);
     }
+    set_aio_handler(ctx, fd, new_node);
 
+    /* The thread running the context may be dispatching the old node right
+     * now.  It skips deleted nodes, and the node is freed once it has
+     * finished the current iteration.
+     */
     if (node) {
-        deleted = aio_remove_fd_handler(ctx, node);
+        QLIST_REMOVE_RCU(node, node);
+        atomic_set(&node->deleted, 1);
+    }
+    fdmon_ops = ctx->fdmon_ops;
+    fdmon_ops->update(ctx, node, new_node);
+    if (node && !fdmon_ops->frees_nodes) {
+        g_free_rcu(&ctx->rcu, node, rcu);
     }
+    atomic_add(&ctx->poll_disable_cnt, poll_disable_change);
 
-    qemu_lockcnt_unlock(&ctx->list_lock);
-    aio_notify(ctx);
+    pthread_mutex_unlock(&ctx->list_lock);
 
-    if (deleted) {
-        g_free(node);
-    }
+    /* Also gets the old node freed if the context is idle */
+    aio_notify(ctx);
 }
 
 
@@ -166,3 +295,334 @@ void aio_set_event_notifier(AioContext *ctx,
     aio_set_fd_handler(ctx, event_notifier_get_fd(notifier),
                        (IOHandler *)io_read, NULL, io_poll, notifier);
 }
+
+/* Set the callbacks invoked when aio_poll starts and stops busy-polling
+ * the io_poll callback of @fd, typically to disable and re-enable
+ * notifications from the other side (e.g. virtqueue kicks).
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd,
+                     IOHandler *io_poll_begin,
+                     IOHandler *io_poll_end)
+{
+    AioHandler *node;
+
+    pthread_mutex_lock(&ctx->list_lock);
+    node = find_aio_handler(ctx, fd);
+    if (node) {
+        node->io_poll_begin = io_poll_begin;
+        node->io_poll_end = io_poll_end;
+    }
+    pthread_mutex_unlock(&ctx->list_lock);
+}
+
+typedef struct {
+    AioContext *old_ctx;
+    AioContext *new_ctx;
+    int fd;
+    bool found;
+    IOHandler *io_read;
+    IOHandler *io_write;
+    AioPollFn *io_poll;
+    IOHandler *io_poll_begin;
+    IOHandler *io_poll_end;
+    void *opaque;
+} AioMoveFdData;
+
+static void aio_move_fd_detach_bh(void *opaque)
+{
+    AioMoveFdData *data = opaque;
+    AioContext *ctx = data->old_ctx;
+    AioHandler *node;
+
+    pthread_mutex_lock(&ctx->list_lock);
+    node = find_aio_handler(ctx, data->fd);
+    if (node) {
+        data->found = true;
+        data->io_read = node->io_read;
+        data->io_write = node->io_write;
+        data->io_poll = node->io_poll;
+        data->io_poll_begin = node->io_poll_begin;
+        data->io_poll_end = node->io_poll_end;
+        data->opaque = node->opaque;
+
+        /* Leave the notifications enabled for the new context */
+        if (ctx->poll_started && node->io_poll_end) {
+            node->io_poll_end(node->opaque);
+        }
+    }
+    pthread_mutex_unlock(&ctx->list_lock);
+
+    if (node) {
+        aio_set_fd_handler(ctx, data->fd, NULL, NULL, NULL, NULL);
+    }
+}
+
+static void aio_move_fd_attach_bh(void *opaque)
+{
+    AioMoveFdData *data = opaque;
+
+    aio_set_fd_handler(data->new_ctx, data->fd, data->io_read,
+                       data->io_write, data->io_poll, data->opaque);
+    aio_set_fd_poll(data->new_ctx, data->fd, data->io_poll_begin,
+                    data->io_poll_end);
+}
+
+/* Move the handler of @fd from @old_ctx to @new_ctx, e.g. to rebalance
+ * devices across IOThreads.  The handler is removed and re-added from the
+ * threads running each context, so when this returns its callbacks are
+ * neither running in @old_ctx nor going to run there again.  fds are
+ * level-triggered, so no event is lost in between.  Returns false if @fd
+ * has no handler in @old_ctx.
+ */
+bool aio_move_fd_handler(AioContext *old_ctx, AioContext *new_ctx, int fd)
+{
+    AioMoveFdData data = {
+        .old_ctx = old_ctx,
+        .new_ctx = new_ctx,
+        .fd = fd,
+    };
+
+    if (old_ctx == new_ctx) {
+        return true;
+    }
+
+    aio_wait_bh_oneshot(old_ctx, aio_move_fd_detach_bh, &data);
+    if (!data.found) {
+        return false;
+    }
+    aio_wait_bh_oneshot(new_ctx, aio_move_fd_attach_bh, &data);
+    return true;
+}
+
+static bool poll_set_started(AioContext *ctx, bool started)
+{
+    AioHandler *node;
+    bool progress = false;
+
+    if (started == ctx->poll_started) {
+        return false;
+    }
+
+    ctx->poll_started = started;
+
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        IOHandler *fn;
+
+        if (node->deleted) {
+            continue;
+        }
+
+        if (started) {
+            fn = node->io_poll_begin;
+        } else {
+            fn = node->io_poll_end;
+        }
+
+        if (fn) {
+            fn(node->opaque);
+        }
+
+        /* Poll one last time in case ->io_poll_end() raced with the event */
+        if (!started && node->io_poll) {
+            progress = node->io_poll(node->opaque) || progress;
+        }
+    }
+
+    return progress;
+}
+
+static bool run_poll_handlers_once(AioContext *ctx, int64_t *timeout)
+{
+    bool progress = false;
+    AioHandler *node;
+
+    QLIST_FOREACH_RCU(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            node->io_poll(node->opaque)) {
+            /* Polling was successful, exit try_poll_mode immediately
+             * to adjust the next polling time.
+             */
+            *timeout = 0;
+            if (node->opaque != &ctx->notifier) {
+                progress = true;
+            }
+        }
+
+        /* Caller handles freeing deleted nodes.  Don't do it here. */
+    }
+
+    return progress;
+}
+
+/* Busy-poll the io_poll callbacks for up to @max_ns nanoseconds, or until
+ * one of them makes progress or schedules a BH (which sets *timeout to 0).
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns,
+                              int64_t *timeout)
+{
+    bool progress;
+    int64_t start_time, elapsed_time;
+
+    start_time = get_clock();
+    do {
+        progress = run_poll_handlers_once(ctx, timeout);
+        elapsed_time = get_clock() - start_time;
+        if (elapsed_time >= max_ns) {
+            break;
+        }
+        /* A BH scheduled by another thread also ends polling */
+        if (atomic_read(&ctx->notified)) {
+            *timeout = 0;
+        }
+    } while (!progress && *timeout != 0);
+
+    /* If time has passed with no successful polling, adjust *timeout to
+     * keep the same ending time.
+     */
+    if (*timeout != -1) {
+        *timeout -= MIN(*timeout, elapsed_time);
+    }
+
+    return progress;
+}
+
+/* Returns true if progress was made and the blocking wait can be skipped.
+ * Otherwise *timeout is adjusted to the time left.
+ */
+static bool try_poll_mode(AioContext *ctx, int64_t *timeout)
+{
+    int64_t max_ns;
+
+    if (*timeout == -1) {
+        max_ns = ctx->poll_ns;
+    } else {
+        max_ns = MIN(*timeout, ctx->poll_ns);
+    }
+
+    if (max_ns && !atomic_read(&ctx->poll_disable_cnt)) {
+        poll_set_started(ctx, true);
+
+        if (run_poll_handlers(ctx, max_ns, timeout)) {
+            ctx->poll_stats.hits++;
+            return true;
+        }
+        ctx->poll_stats.misses++;
+    }
+
+    if (poll_set_started(ctx, false)) {
+        *timeout = 0;
+        return true;
+    }
+
+    return false;
+}
+
+static void adjust_polling_time(AioContext *ctx, int64_t block_ns)
+{
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+    } else if (ctx->poll_ns < ctx->poll_max_ns &&
+               block_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        int64_t grow = ctx->poll_grow ? ctx->poll_grow : 2;
+
+        ctx->poll_ns = ctx->poll_ns ? ctx->poll_ns * grow : 4000;
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+    }
+}
+
+/* @max_ns is the longest time aio_poll may busy-poll before blocking (0
+ * disables polling), @grow and @shrink the factors the polling window is
+ * multiplied or divided by (0 picks the defaults: double the window, drop it
+ * to zero).
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink)
+{
+    /* No thread synchronization here, it doesn't matter if an incorrect value
+     * is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
+
+void aio_context_get_poll_stats(AioContext *ctx, AioPollStats *stats)
+{
+    *stats = ctx->poll_stats;
+    stats->window_ns = ctx->poll_ns;
+    stats->max_ns = ctx->poll_max_ns;
+}
+
+/* Run one iteration of @ctx without going through the glib main loop.
+ * If @blocking is true, wait for an fd handler or BH to become ready.
+ * Returns true if some progress was made.
+ */
+bool aio_poll(AioContext *ctx, bool blocking)
+{
+    bool progress;
+    int64_t timeout;
+    int64_t start;
+
+    /* aio_notify can avoid the expensive event_notifier_set if
+     * everything (file descriptors, bottom halves) is
+     * re-evaluated before the next blocking poll().  This is
+     * already true when aio_poll is called with blocking == false;
+     * if blocking == true, it is only true after the wait below.
+     */
+    if (blocking) {
+        atomic_add(&ctx->notify_me, 2);
+    }
+
+    rcu_read_lock(&ctx->rcu);
+
+    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+
+    /* Busy-poll for a while before blocking */
+    progress = false;
+    start = 0;
+    if (ctx->poll_max_ns) {
+        start = get_clock();
+        progress = try_poll_mode(ctx, &timeout);
+        assert(!(timeout && progress));
+    }
+
+    /* Even if polling made progress (timeout is 0 then), collect the fds
+     * that are ready.
+     */
+    ctx->fdmon_ops->wait(ctx, timeout);
+    if (unlikely(ctx->stats_enabled)) {
+        ctx->stats_ready_ns = get_clock();
+    }
+
+    if (blocking) {
+        atomic_sub(&ctx->notify_me, 2);
+        aio_notify_accept(ctx);
+    }
+
+    /* Adjust polling time */
+    if (ctx->poll_max_ns) {
+        adjust_polling_time(ctx, get_clock() - start);
+    }
+
+    progress |= aio_bh_poll(ctx);
+    progress |= aio_dispatch_handlers(ctx);
+
+    rcu_read_unlock(&ctx->rcu);
+
+    progress |= timerlist_run_timers(&ctx->tl);
+
+    return progress;
+}
@@ -1,6 +1,11 @@
+#ifndef QEMU_AIO_H
+#define QEMU_AIO_H
+
 #include <glib.h>
 #include "event_notifier.h"
 #include "util.h"
+#include "qemu_timer.h"
+#include "rcu.h"
 
 /*
  * List definitions.
@@ -16,6 +21,9 @@ struct {                                                                \
         struct type **le_prev;  /* address of previous next element */  \
 }
 
+#define QLIST_EMPTY(head)                ((head)->lh_first == NULL)
+#define QLIST_FIRST(head)                ((head)->lh_first)
+
 #define QLIST_FOREACH(var, head, field)                                 \
         for ((var) = ((head)->lh_first);                                \
                 (var);                                                  \
@@ -35,22 +43,333 @@ struct {                                                                \
         *(elm)->field.le_prev = (elm)->field.le_next;                   \
 } while (/*CONSTCOND*/0)
 
+/* RCU variants: updaters are serialized by a lock, readers walk the list
+ * with QLIST_FOREACH_RCU.  A removed element keeps its le_next, so that
+ * readers standing on it can go on, and must only be freed after a grace
+ * period.  Requires atomic.h.
+ */
+#define QLIST_INSERT_HEAD_RCU(head, elm, field) do {                    \
+        (elm)->field.le_prev = &(head)->lh_first;                       \
+        (elm)->field.le_next = (head)->lh_first;                        \
+        smp_wmb(); /* fill elm before linking it */                     \
+        if ((head)->lh_first != NULL) {                                 \
+            (head)->lh_first->field.le_prev = &(elm)->field.le_next;    \
+        }                                                               \
+        atomic_rcu_set(&(head)->lh_first, (elm));                       \
+} while (/*CONSTCOND*/0)
+
+#define QLIST_REMOVE_RCU(elm, field) do {                               \
+        if ((elm)->field.le_next != NULL) {                             \
+            (elm)->field.le_next->field.le_prev = (elm)->field.le_prev; \
+        }                                                               \
+        atomic_set((elm)->field.le_prev, (elm)->field.le_next);         \
+} while (/*CONSTCOND*/0)
+
+#define QLIST_FOREACH_RCU(var, head, field)                             \
+        for ((var) = atomic_rcu_read(&(head)->lh_first);                \
+             (var);                                                     \
+             (var) = atomic_rcu_read(&(var)->field.le_next))
+
+/*
+ * Singly-linked List definitions.
+ */
+#define QSLIST_HEAD(name, type)                                          \
+struct name {                                                           \
+        struct type *slh_first; /* first element */                    \
+}
+
+#define QSLIST_ENTRY(type)                                               \
+struct {                                                                \
+        struct type *sle_next;  /* next element */                      \
+}
+
+#define QSLIST_INIT(head) do {                                           \
+        (head)->slh_first = NULL;                                       \
+} while (/*CONSTCOND*/0)
+
+/* Lock-free push, safe against concurrent pushes and QSLIST_MOVE_ATOMIC.
+ * Requires atomic.h.
+ */
+#define QSLIST_INSERT_HEAD_ATOMIC(head, elm, field) do {                     \
+        typeof(elm) save_sle_next;                                           \
+        do {                                                                 \
+            save_sle_next = (elm)->field.sle_next = (head)->slh_first;       \
+        } while (atomic_cmpxchg(&(head)->slh_first, save_sle_next, (elm)) != \
+                 save_sle_next);                                             \
+} while (/*CONSTCOND*/0)
+
+/* Steal the whole list from @src, leaving it empty.  Requires atomic.h. */
+#define QSLIST_MOVE_ATOMIC(dest, src) do {                               \
+        (dest)->slh_first = atomic_xchg(&(src)->slh_first, NULL);        \
+} while (/*CONSTCOND*/0)
+
+#define QSLIST_INSERT_HEAD(head, elm, field) do {                        \
+        (elm)->field.sle_next = (head)->slh_first;                       \
+        (head)->slh_first = (elm);                                       \
+} while (/*CONSTCOND*/0)
+
+#define QSLIST_REMOVE_HEAD(head, field) do {                             \
+        typeof((head)->slh_first) elm = (head)->slh_first;               \
+        (head)->slh_first = elm->field.sle_next;                         \
+        elm->field.sle_next = NULL;                                      \
+} while (/*CONSTCOND*/0)
+
+#define QSLIST_FOREACH(var, head, field)                                 \
+        for ((var) = (head)->slh_first; (var); (var) = (var)->field.sle_next)
+
+#define QSLIST_FOREACH_RCU(var, head, field)                             \
+        for ((var) = atomic_rcu_read(&(head)->slh_first);                \
+             (var);                                                     \
+             (var) = atomic_rcu_read(&(var)->field.sle_next))
+
+#define QSLIST_EMPTY(head)       ((head)->slh_first == NULL)
+#define QSLIST_FIRST(head)       ((head)->slh_first)
+#define QSLIST_NEXT(elm, field)  ((elm)->field.sle_next)
+
+/*
+ * Simple queue definitions.
+ */
+#define QSIMPLEQ_HEAD(name, type)                                       \
+struct name {                                                           \
+    struct type *sqh_first;    /* first element */                      \
+    struct type **sqh_last;    /* addr of last next element */          \
+}
+
+#define QSIMPLEQ_ENTRY(type)                                            \
+struct {                                                                \
+    struct type *sqe_next;    /* next element */                        \
+}
+
+#define QSIMPLEQ_INIT(head) do {                                        \
+    (head)->sqh_first = NULL;                                           \
+    (head)->sqh_last = &(head)->sqh_first;                              \
+} while (/*CONSTCOND*/0)
+
+#define QSIMPLEQ_INSERT_TAIL(head, elm, field) do {                     \
+    (elm)->field.sqe_next = NULL;                                       \
+    *(head)->sqh_last = (elm);                                          \
+    (head)->sqh_last = &(elm)->field.sqe_next;                          \
+} while (/*CONSTCOND*/0)
+
+#define QSIMPLEQ_REMOVE_HEAD(head, field) do {                          \
+    if (((head)->sqh_first = (head)->sqh_first->field.sqe_next) == NULL)\
+        (head)->sqh_last = &(head)->sqh_first;                          \
+} while (/*CONSTCOND*/0)
+
+#define QSIMPLEQ_REMOVE(head, elm, type, field) do {                    \
+    if ((head)->sqh_first == (elm)) {                                   \
+        QSIMPLEQ_REMOVE_HEAD((head), field);                            \
+    } else {                                                            \
+        struct type *curelm = (head)->sqh_first;                        \
+        while (curelm->field.sqe_next != (elm))                         \
+            curelm = curelm->field.sqe_next;                            \
+        if ((curelm->field.sqe_next =                                   \
+            curelm->field.sqe_next->field.sqe_next) == NULL)            \
+                (head)->sqh_last = &(curelm)->field.sqe_next;           \
+    }                                                                   \
+} while (/*CONSTCOND*/0)
+
+#define QSIMPLEQ_FOREACH(var, head, field)                              \
+    for ((var) = ((head)->sqh_first);                                   \
+         (var);                                                         \
+         (var) = ((var)->field.sqe_next))
+
+#define QSIMPLEQ_EMPTY(head)        ((head)->sqh_first == NULL)
+#define QSIMPLEQ_FIRST(head)        ((head)->sqh_first)
+
+#ifdef CONFIG_SHARDED_LOCKCNT
+/* Readers spread their increments over cache-line sized shards, see
+ * lockcnt.c.  The count is the sum of all shards.
+ */
+#define QEMU_LOCKCNT_SHARDS 64
+
+typedef struct QemuLockCntShard {
+    unsigned count;
+} __attribute__((aligned(64))) QemuLockCntShard;
+
+struct QemuLockCnt {
+    QemuLockCntShard shards[QEMU_LOCKCNT_SHARDS];
+    unsigned lock __attribute__((aligned(64)));
+    unsigned spin_max;      /* 0: park right away, see qemu_lockcnt_set_spin */
+    int spin_avg;
+};
+#else
 struct QemuLockCnt {
     unsigned count;
+    unsigned spin_max;      /* 0: park right away, see qemu_lockcnt_set_spin */
+    int spin_avg;
 };
+#endif
 typedef struct QemuLockCnt QemuLockCnt;
+
+void qemu_lockcnt_init(QemuLockCnt *lockcnt);
+void qemu_lockcnt_destroy(QemuLockCnt *lockcnt);
+void qemu_lockcnt_inc(QemuLockCnt *lockcnt);
+void qemu_lockcnt_dec(QemuLockCnt *lockcnt);
+bool qemu_lockcnt_dec_if_lock(QemuLockCnt *lockcnt);
+void qemu_lockcnt_lock(QemuLockCnt *lockcnt);
+void qemu_lockcnt_unlock(QemuLockCnt *lockcnt);
+void qemu_lockcnt_inc_and_unlock(QemuLockCnt *lockcnt);
+unsigned qemu_lockcnt_count(QemuLockCnt *lockcnt);
+void qemu_lockcnt_set_spin(QemuLockCnt *lockcnt, unsigned max_spins);
 typedef struct QEMUBH QEMUBH;
 
 typedef void QEMUBHFunc(void *opaque);
+
+/* Priority classes of bottom halves.  aio_bh_poll() runs the pending BHs
+ * of a higher class first, and those of a class in scheduling order.
+ */
+typedef enum {
+    QEMU_BH_PRIO_HIGH,      /* latency-critical, e.g. request completion */
+    QEMU_BH_PRIO_NORMAL,    /* the default */
+    QEMU_BH_PRIO_LOW,       /* bulk housekeeping */
+    QEMU_BH_PRIO_MAX,
+} QEMUBHPriority;
 typedef bool AioPollFn(void *opaque);
 typedef void IOHandler(void *opaque);
 
+typedef struct AioContext AioContext;
+typedef struct AioHandler AioHandler;
+
+/* How an AioContext monitors the file descriptors of its handlers */
+typedef enum {
+    /* One GPollFD per handler, polled by the glib main loop */
+    AIO_FDMON_POLL,
+    /* One epoll fd per context, updated incrementally by aio_set_fd_handler
+     * and exposed to the glib main loop as a single GPollFD.
+     */
+    AIO_FDMON_EPOLL,
+    /* io_uring multishot IORING_OP_POLL_ADD, see fdmon_io_uring.c */
+    AIO_FDMON_IO_URING,
+} AioFdMonitor;
+
+typedef struct FDMonOps {
+    /* Called with list_lock taken after @old_node has been removed from and
+     * @new_node inserted into aio_handlers.  Either may be NULL.
+     */
+    void (*update)(AioContext *ctx, AioHandler *old_node, AioHandler *new_node);
+
+    /* If true, update() takes over @old_node and frees it with g_free_rcu()
+     * once it is done with it; otherwise aio_set_fd_handler() does.
+     */
+    bool frees_nodes;
+
+    /* Called by aio_poll in an RCU critical section.  Block for up to
+     * @timeout nanoseconds (forever if -1) until some handler is ready.
+     * Returns the number of ready handlers, or a negative errno.
+     */
+    int (*wait)(AioContext *ctx, int64_t timeout);
+
+    /* Optional, called before the glib main loop polls the context */
+    void (*prepare)(AioContext *ctx);
+
+    /* Return true if some handler is ready to be dispatched */
+    bool (*pending)(AioContext *ctx);
+
+    /* Run the callbacks of ready handlers, in an RCU critical section */
+    bool (*dispatch)(AioContext *ctx);
+} FDMonOps;
+
+/* Scheduled bottom halves, pushed by any thread and popped by aio_bh_poll */
+typedef QSLIST_HEAD(, QEMUBH) BHList;
+
+/* Allocation counters of the QEMUBH pool, see aio_bh_pool_stats() */
+typedef struct BHPoolStats {
+    unsigned long allocs;    /* QEMUBHs allocated by the calling thread */
+    unsigned long hits;      /* ...of which served by its thread-local cache */
+    unsigned long refills;   /* thread caches refilled from the context pool */
+    unsigned long misses;    /* allocations that fell back to g_new */
+    unsigned long recycled;  /* QEMUBHs returned to the context pool */
+    unsigned long released;  /* QEMUBHs freed because the pool was full */
+} BHPoolStats;
+
+/* Adaptive polling counters, see aio_context_get_poll_stats() */
+typedef struct AioPollStats {
+    unsigned long hits;      /* polling phases that found work */
+    unsigned long misses;    /* polling phases that ran out of time */
+    int64_t window_ns;       /* current polling window */
+    int64_t max_ns;          /* upper bound of the window, 0 if disabled */
+} AioPollStats;
+
+/* aio_notify counters, see aio_context_get_notify_stats() */
+typedef struct AioNotifyStats {
+    unsigned long sent;        /* event_notifier_set calls */
+    unsigned long suppressed;  /* coalesced into an earlier, unaccepted one */
+    unsigned long received;    /* writes collected by the notifier handler */
+} AioNotifyStats;
+
+/* aio_bh_poll() may be called recursively (e.g. from a BH that runs a nested
+ * event loop), so each invocation grabs the pending BHs into its own slice.
+ */
+typedef struct BHListSlice BHListSlice;
+struct BHListSlice {
+    /* One list per priority class, oldest BH first */
+    BHList bh_list[QEMU_BH_PRIO_MAX];
+    QSIMPLEQ_ENTRY(BHListSlice) next;
+};
+
 struct AioContext {
     GSource source;
 
-    /* Used by AioContext users to protect from multi-threaded access.  */
+    /* Handlers of the context.  Modified by any thread with list_lock
+     * taken, walked without locks by the thread running the context.
+     */
     QLIST_HEAD(, AioHandler) aio_handlers;
 
+    /* aio_handlers indexed by fd, so that aio_set_fd_handler finds the
+     * handler to replace without walking the list.  Grown to the next power
+     * of two above the largest fd, protected by list_lock.
+     */
+    AioHandler **fd_handlers;
+    int fd_handlers_size;
+
+    /* Removed handlers are freed through this domain once the thread
+     * running the context has finished the aio_poll() or GSource dispatch
+     * that may still be looking at them.
+     */
+    RCUDomain rcu;
+
+    const FDMonOps *fdmon_ops;
+
+    /* pollfd array built by fdmon_poll_wait out of aio_handlers, only
+     * used by the thread running the context.
+     */
+    struct pollfd *pollfds;
+    AioHandler **pollfds_nodes;
+    unsigned pollfds_size;
+
+    /* Number of handlers without an io_poll callback; while non-zero
+     * aio_poll never busy-polls, because it could miss their events.
+     */
+    int poll_disable_cnt;
+
+    /* Adaptive polling: before blocking, aio_poll spins on the io_poll
+     * callbacks for up to poll_ns nanoseconds.  The window grows by
+     * poll_grow when an event arrives shortly after it expired and shrinks
+     * by poll_shrink when blocking took longer than poll_max_ns.
+     */
+    int64_t poll_ns;
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+    bool poll_started;
+    AioPollStats poll_stats;
+
+    /* epoll(7) state for AIO_FDMON_EPOLL, epollfd is -1 otherwise.
+     * epoll_nready is the number of events gathered by fdmon_epoll_wait
+     * that are still to be dispatched, or -1.  epoll_fallback is set by
+     * aio_set_fd_handler when epoll rejects an fd, and the thread running
+     * the context then switches it to AIO_FDMON_POLL.
+     */
+    int epollfd;
+    GPollFD epoll_pfd;
+    struct epoll_event *epoll_events;
+    int epoll_nready;
+    bool epoll_fallback;
+
+    /* io_uring state for AIO_FDMON_IO_URING, NULL otherwise */
+    struct AioUring *uring;
+
     /* Used to avoid unnecessary event_notifier_set calls in aio_notify;
      * accessed with atomic primitives.  If this field is 0, everything
      * (file descriptors, bottom halves, timers) will be re-evaluated
@@ -78,22 +397,47 @@ struct AioContext {
      */
     uint32_t notify_me;
 
-    /* A lock to protect between QEMUBH and AioHandler adders and deleter,
-     * and to ensure that no callbacks are removed while we're walking and
-     * dispatching them.
+    /* Serializes the updaters of aio_handlers; readers rely on RCU */
+    pthread_mutex_t list_lock;
+
+    /* Lock-free multi-producer, single-consumer list of scheduled Bottom
+     * Halves.  A BH sits on it only while it is pending, so aio_bh_poll
+     * never touches BHs that were not scheduled.
      */
-    QemuLockCnt list_lock;
+    BHList bh_list;
 
-    /* Anchor of the list of Bottom Halves belonging to the context */
-    struct QEMUBH *first_bh;
+    /* BHListSlices of the aio_bh_poll calls currently in progress */
+    QSIMPLEQ_HEAD(, BHListSlice) bh_slice_list;
+
+    /* Free QEMUBHs.  aio_bh_poll pushes the BHs it retires, any thread
+     * allocating a BH grabs the whole list into its thread-local cache.
+     */
+    BHList bh_pool;
+    int bh_pool_size;
+    BHPoolStats bh_pool_stats;
+
+    /* Budget of the BHs run by one event loop iteration, shared by nested
+     * aio_bh_poll calls; see aio_context_set_bh_budget().
+     */
+    int bh_budget_max;
+    int64_t bh_budget_ns;
+    int bh_budget_left;
+    int64_t bh_budget_deadline;
+
+    /* Bitmask of the priority classes that ran a BH in this iteration */
+    unsigned bh_budget_classes;
+
+    /* BHs left over when the budget ran out, oldest first.  They run
+     * before newer BHs of the same class at the next aio_bh_poll.
+     */
+    BHList bh_deferred[QEMU_BH_PRIO_MAX];
 
     /* Used by aio_notify.
      *
-     * "notified" is used to avoid expensive event_notifier_test_and_clear
-     * calls.  When it is clear, the EventNotifier is clear, or one thread
-     * is going to clear "notified" before processing more events.  False
-     * positives are possible, i.e. "notified" could be set even though the
-     * EventNotifier is clear.
+     * "notified" tells busy-polling that aio_notify was called since the
+     * last aio_notify_accept.  False positives are possible, i.e.
+     * "notified" could be set even though the EventNotifier is clear.  The
+     * EventNotifier is cleared by its own handler.
      *
      * Note that event_notifier_set *cannot* be optimized the same way.  For
      * more information on the problem that would result, see "#ifdef BUG2"
@@ -102,10 +446,41 @@ struct AioContext {
     bool notified;
     EventNotifier notifier;
 
+    /* Coalescing of cross-thread wakeups: every aio_notify that needs to
+     * wake the context increments notify_pending, and only the one that
+     * moves it from zero writes to the EventNotifier.  Its handler clears
+     * the EventNotifier *before* resetting the counter, so a producer that
+     * sees a non-zero count knows that a write is still outstanding and
+     * will wake the context.
+     */
+    bool notify_coalesce;
+    unsigned notify_pending;
+    AioNotifyStats notify_stats;
+
     QEMUBH *co_schedule_bh;
+
+    /* Worker threads for thread_pool_submit_aio(), created on first use
+     * with thread_pool_size workers (0 for one per CPU).
+     */
+    struct ThreadPool *thread_pool;
+    int thread_pool_size;
+
+    /* Timers run by this context; the nearest deadline bounds how long
+     * aio_poll or the glib main loop block.
+     */
+    QEMUTimerList tl;
+
+    /* Callback instrumentation, see aio_stats.c.  stats is only touched
+     * by the thread running the context; stats_ready_ns is when the fd
+     * monitor last reported ready fds.
+     */
+    bool stats_enabled;
+    struct AioStats *stats;
+    int64_t stats_ready_ns;
 };
 
 struct AioHandler {
+    struct rcu_head rcu;
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
@@ -115,15 +490,13 @@ struct AioHandler {
     int deleted;
     void *opaque;
     QLIST_ENTRY(AioHandler) node;
-};
 
-typedef struct AioContext AioContext;
-typedef struct AioHandler AioHandler;
-
-static AioContext *qemu_aio_context;
-static AioContext *iohandler_ctx;
-static GArray *gpollfds;
-static int max_priority;
+    /* Used by fdmon_io_uring.c to queue poll add/remove requests */
+    QSLIST_ENTRY(AioHandler) node_submitted;
+    unsigned flags;
+    bool uring_armed;
+    bool uring_removing;
+};
 
 gboolean
 aio_prepare(AioContext *ctx);
@@ -134,6 +507,75 @@ aio_pending(AioContext *ctx);
 gboolean
 aio_dispatch_handlers(AioContext *ctx);
 
+extern const FDMonOps fdmon_poll_ops;
+
+bool fdmon_epoll_setup(AioContext *ctx);
+void fdmon_epoll_disable(AioContext *ctx);
+
+bool fdmon_io_uring_setup(AioContext *ctx);
+void fdmon_io_uring_destroy(AioContext *ctx);
+
+/* Asynchronous read/write through the io_uring of @ctx, completed from the
+ * event loop by calling @cb with the number of bytes transferred or a
+ * negative errno.  Must be called from the thread running @ctx.  Returns
+ * -ENOTSUP if @ctx does not use AIO_FDMON_IO_URING.
+ */
+typedef void AioUringCompletionFunc(void *opaque, int ret);
+
+int aio_uring_submit_rw(AioContext *ctx, bool is_write, int fd,
+                        void *buf, size_t len, int64_t offset,
+                        AioUringCompletionFunc *cb, void *opaque);
+
+/**
+ * aio_timer_new:
+ * @ctx: the aio context
+ * @scale: the scale of the timer (SCALE_NS, SCALE_US or SCALE_MS)
+ * @cb: the callback to call on timer expiry
+ * @opaque: the opaque pointer to pass to the callback
+ *
+ * Allocate a new timer attached to the context @ctx.  The callback runs
+ * in the thread that runs @ctx; the timer may be armed and deleted with
+ * timer_mod/timer_del from any thread, and must be freed with timer_free.
+ */
+static inline QEMUTimer *aio_timer_new(AioContext *ctx, int scale,
+                                       QEMUTimerCB *cb, void *opaque)
+{
+    return timer_new_tl(&ctx->tl, scale, cb, opaque);
+}
+
+/* Like aio_timer_new, for a caller-allocated timer */
+static inline void aio_timer_init(AioContext *ctx, QEMUTimer *ts, int scale,
+                                  QEMUTimerCB *cb, void *opaque)
+{
+    timer_init_tl(ts, &ctx->tl, scale, cb, opaque);
+}
+
+int64_t aio_compute_timeout(AioContext *ctx);
+
+bool aio_poll(AioContext *ctx, bool blocking);
+
+void aio_set_fd_poll(AioContext *ctx, int fd,
+                     IOHandler *io_poll_begin,
+                     IOHandler *io_poll_end);
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink);
+
+void aio_context_get_poll_stats(AioContext *ctx, AioPollStats *stats);
+
+bool aio_move_fd_handler(AioContext *old_ctx, AioContext *new_ctx, int fd);
+
+/* The AioContext run by the calling thread, NULL if there is none */
+AioContext *qemu_get_current_aio_context(void);
+void qemu_set_current_aio_context(AioContext *ctx);
+
+/* Run @cb in the thread that runs @ctx and wait for it to return.  While
+ * waiting, the calling thread keeps running its own AioContext, if any.
+ */
+void aio_wait_bh_oneshot(AioContext *ctx, QEMUBHFunc *cb, void *opaque);
+
+void aio_dispatch_handler(AioContext *ctx, AioHandler *node);
+
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         IOHandler *io_read,
@@ -141,3 +583,9 @@ void aio_set_fd_handler(AioContext *ctx,
                         AioPollFn *io_poll,
                         void *opaque);
 
+void aio_set_event_notifier(AioContext *ctx,
+                            EventNotifier *notifier,
+                            EventNotifierHandler *io_read,
+                            AioPollFn *io_poll);
+
+#endif /* QEMU_AIO_H */
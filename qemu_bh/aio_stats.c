@@ -0,0 +1,292 @@
+/*
+ * Event loop instrumentation
+ *
+ * While enabled with aio_context_set_stats_enabled(), the event loop
+ * measures every fd handler and BH callback it runs.  The results live in
+ * a hash table owned by the thread running the context, keyed by handler
+ * fd and callback, or by BH callback and opaque so that the oneshot BHs of
+ * a given kind add up.  Other threads read them through
+ * aio_stats_snapshot(), which copies the table from the context's thread.
+ *
+ * When disabled, the only cost is one branch on ctx->stats_enabled at each
+ * call site.
+ */
+#include <glib.h>
+#include <string.h>
+#include "atomic.h"
+#include "aio_stats.h"
+
+typedef struct AioStats {
+    int64_t start_ns;
+    int nr_entries;
+    int size;               /* power of two */
+    AioCallbackStats **table;
+} AioStats;
+
+static int aio_histogram_index(int64_t value)
+{
+    int msb, shift, index;
+
+    if (value < AIO_HISTOGRAM_SUB_BUCKETS) {
+        return value < 0 ? 0 : value;
+    }
+
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - AIO_HISTOGRAM_SUB_BITS;
+    index = (shift + 1) * AIO_HISTOGRAM_SUB_BUCKETS +
+            ((value >> shift) & (AIO_HISTOGRAM_SUB_BUCKETS - 1));
+    return index < AIO_HISTOGRAM_BUCKETS ? index : AIO_HISTOGRAM_BUCKETS - 1;
+}
+
+/* Largest value that falls in bucket @index */
+int64_t aio_histogram_bucket_max(int index)
+{
+    int shift, sub;
+
+    if (index < AIO_HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+
+    shift = index / AIO_HISTOGRAM_SUB_BUCKETS - 1;
+    sub = index % AIO_HISTOGRAM_SUB_BUCKETS;
+    return ((int64_t)(AIO_HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+void aio_histogram_record(AioHistogram *h, int64_t value)
+{
+    h->count++;
+    h->buckets[aio_histogram_index(value)]++;
+}
+
+/* Return an upper bound of the @percentile-th (0..100) recorded value */
+int64_t aio_histogram_percentile(const AioHistogram *h, double percentile)
+{
+    uint64_t target, seen = 0;
+    int i;
+
+    if (!h->count) {
+        return 0;
+    }
+
+    target = (uint64_t)(h->count * percentile / 100.0);
+    if (target == 0) {
+        target = 1;
+    }
+    for (i = 0; i < AIO_HISTOGRAM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            return aio_histogram_bucket_max(i);
+        }
+    }
+    return aio_histogram_bucket_max(AIO_HISTOGRAM_BUCKETS - 1);
+}
+
+static unsigned aio_stats_hash(int fd, void *cb, void *opaque)
+{
+    uint64_t key = (uintptr_t)cb ^ ((uintptr_t)opaque << 1) ^ (unsigned)fd;
+
+    /* Fibonacci hashing, pointers have zeroes in their low bits */
+    return (key * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+static AioCallbackStats **aio_stats_find(AioStats *stats, AioStatsKind kind,
+                                         int fd, void *cb, void *opaque)
+{
+    unsigned i = aio_stats_hash(fd, cb, opaque) & (stats->size - 1);
+    AioCallbackStats *e;
+
+    while ((e = stats->table[i])) {
+        if (e->kind == kind && e->fd == fd && e->cb == cb &&
+            e->opaque == opaque) {
+            break;
+        }
+        i = (i + 1) & (stats->size - 1);
+    }
+    return &stats->table[i];
+}
+
+static void aio_stats_grow(AioStats *stats)
+{
+    AioCallbackStats **old = stats->table;
+    int old_size = stats->size;
+    int i;
+
+    stats->size = old_size ? old_size * 2 : 64;
+    stats->table = g_new0(AioCallbackStats *, stats->size);
+    for (i = 0; i < old_size; i++) {
+        AioCallbackStats *e = old[i];
+
+        if (e) {
+            *aio_stats_find(stats, e->kind, e->fd, e->cb, e->opaque) = e;
+        }
+    }
+    g_free(old);
+}
+
+void aio_stats_record(AioContext *ctx, AioStatsKind kind, int fd,
+                      void *cb, void *opaque,
+                      int64_t start_ns, int64_t end_ns, int64_t latency_ns)
+{
+    AioStats *stats = ctx->stats;
+    AioCallbackStats **slot;
+    AioCallbackStats *e;
+    int64_t run_ns = end_ns - start_ns;
+
+    if (!stats) {
+        stats = ctx->stats = g_new0(AioStats, 1);
+        stats->start_ns = start_ns;
+    }
+    /* Keep the load factor under 1/2 */
+    if (2 * (stats->nr_entries + 1) > stats->size) {
+        aio_stats_grow(stats);
+    }
+
+    slot = aio_stats_find(stats, kind, fd, cb, opaque);
+    e = *slot;
+    if (!e) {
+        e = *slot = g_new0(AioCallbackStats, 1);
+        e->kind = kind;
+        e->fd = fd;
+        e->cb = cb;
+        e->opaque = opaque;
+        stats->nr_entries++;
+    }
+
+    e->count++;
+    e->total_ns += run_ns;
+    if (run_ns > e->max_ns) {
+        e->max_ns = run_ns;
+    }
+    aio_histogram_record(&e->run_ns, run_ns);
+    if (latency_ns >= 0) {
+        aio_histogram_record(&e->latency_ns, latency_ns);
+    }
+}
+
+/* Only called from the thread running @ctx, or once it is gone */
+void aio_stats_free(AioContext *ctx)
+{
+    AioStats *stats = ctx->stats;
+    int i;
+
+    if (!stats) {
+        return;
+    }
+    for (i = 0; i < stats->size; i++) {
+        g_free(stats->table[i]);
+    }
+    g_free(stats->table);
+    g_free(stats);
+    ctx->stats = NULL;
+}
+
+void aio_context_set_stats_enabled(AioContext *ctx, bool enable)
+{
+    atomic_set(&ctx->stats_enabled, enable);
+}
+
+static void aio_stats_reset_bh(void *opaque)
+{
+    aio_stats_free(opaque);
+}
+
+/* Drop everything measured so far */
+void aio_stats_reset(AioContext *ctx)
+{
+    aio_wait_bh_oneshot(ctx, aio_stats_reset_bh, ctx);
+}
+
+typedef struct {
+    AioContext *ctx;
+    AioStatsSnapshot *snap;
+} AioStatsSnapshotData;
+
+static void aio_stats_snapshot_bh(void *opaque)
+{
+    AioStatsSnapshotData *data = opaque;
+    AioStats *stats = data->ctx->stats;
+    AioStatsSnapshot *snap = data->snap;
+    int i, n = 0;
+
+    if (!stats) {
+        return;
+    }
+
+    snap->elapsed_ns = get_clock() - stats->start_ns;
+    snap->entries = g_new(AioCallbackStats, stats->nr_entries);
+    for (i = 0; i < stats->size; i++) {
+        if (stats->table[i]) {
+            snap->entries[n++] = *stats->table[i];
+        }
+    }
+    snap->nr_entries = n;
+}
+
+/* Copy the measurements of @ctx; free the result with
+ * aio_stats_snapshot_free().
+ */
+AioStatsSnapshot *aio_stats_snapshot(AioContext *ctx)
+{
+    AioStatsSnapshotData data = {
+        .ctx = ctx,
+        .snap = g_new0(AioStatsSnapshot, 1),
+    };
+
+    aio_wait_bh_oneshot(ctx, aio_stats_snapshot_bh, &data);
+    return data.snap;
+}
+
+void aio_stats_snapshot_free(AioStatsSnapshot *snap)
+{
+    g_free(snap->entries);
+    g_free(snap);
+}
+
+static void aio_histogram_dump_json(const AioHistogram *h, FILE *f)
+{
+    bool first = true;
+    int i;
+
+    fprintf(f, "{\"count\": %llu, \"p50\": %lld, \"p90\": %lld, "
+            "\"p99\": %lld, \"p999\": %lld, \"buckets\": [",
+            (unsigned long long)h->count,
+            (long long)aio_histogram_percentile(h, 50),
+            (long long)aio_histogram_percentile(h, 90),
+            (long long)aio_histogram_percentile(h, 99),
+            (long long)aio_histogram_percentile(h, 99.9));
+
+    /* Only the non-empty buckets, as [max value, count] pairs */
+    for (i = 0; i < AIO_HISTOGRAM_BUCKETS; i++) {
+        if (h->buckets[i]) {
+            fprintf(f, "%s[%lld, %llu]", first ? "" : ", ",
+                    (long long)aio_histogram_bucket_max(i),
+                    (unsigned long long)h->buckets[i]);
+            first = false;
+        }
+    }
+    fprintf(f, "]}");
+}
+
+void aio_stats_dump_json(const AioStatsSnapshot *snap, FILE *f)
+{
+    int i;
+
+    fprintf(f, "{\"elapsed_ns\": %lld, \"callbacks\": [",
+            (long long)snap->elapsed_ns);
+    for (i = 0; i < snap->nr_entries; i++) {
+        const AioCallbackStats *e = &snap->entries[i];
+
+        fprintf(f, "%s\n  {\"type\": \"%s\", \"fd\": %d, \"cb\": \"%p\", "
+                "\"opaque\": \"%p\", \"count\": %llu, \"total_ns\": %llu, "
+                "\"max_ns\": %llu,\n   \"run_ns\": ",
+                i ? "," : "", e->kind == AIO_STATS_BH ? "bh" : "handler",
+                e->fd, e->cb, e->opaque, (unsigned long long)e->count,
+                (unsigned long long)e->total_ns,
+                (unsigned long long)e->max_ns);
+        aio_histogram_dump_json(&e->run_ns, f);
+        fprintf(f, ",\n   \"latency_ns\": ");
+        aio_histogram_dump_json(&e->latency_ns, f);
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n]}\n");
+}
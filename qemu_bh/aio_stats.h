@@ -0,0 +1,71 @@
+#ifndef AIO_STATS_H
+#define AIO_STATS_H
+
+#include <stdio.h>
+#include "aio.h"
+
+/* HDR-style log-linear histogram of nanosecond values: 16 linear
+ * sub-buckets per power of two, so any recorded value is known to within
+ * 1/16 (~6%), up to 2^41ns (~36 minutes, larger values are clamped).
+ */
+#define AIO_HISTOGRAM_SUB_BITS    4
+#define AIO_HISTOGRAM_SUB_BUCKETS (1 << AIO_HISTOGRAM_SUB_BITS)
+#define AIO_HISTOGRAM_MAX_BITS    40
+#define AIO_HISTOGRAM_BUCKETS     \
+    ((AIO_HISTOGRAM_MAX_BITS - AIO_HISTOGRAM_SUB_BITS + 2) * \
+     AIO_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct AioHistogram {
+    uint64_t count;
+    uint64_t buckets[AIO_HISTOGRAM_BUCKETS];
+} AioHistogram;
+
+void aio_histogram_record(AioHistogram *h, int64_t value);
+int64_t aio_histogram_percentile(const AioHistogram *h, double percentile);
+int64_t aio_histogram_bucket_max(int index);
+
+typedef enum {
+    AIO_STATS_HANDLER,     /* fd handler, keyed by fd and callback */
+    AIO_STATS_BH,          /* bottom half, keyed by callback and opaque */
+} AioStatsKind;
+
+/* What was measured for one fd handler or BH */
+typedef struct AioCallbackStats {
+    AioStatsKind kind;
+    int fd;                 /* -1 for BHs */
+    void *cb;
+    void *opaque;
+
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+
+    /* Time spent in the callback */
+    AioHistogram run_ns;
+
+    /* BHs: from the first qemu_bh_schedule to the callback starting.
+     * Handlers: from the fd monitor reporting the fd ready to the callback
+     * starting.
+     */
+    AioHistogram latency_ns;
+} AioCallbackStats;
+
+typedef struct AioStatsSnapshot {
+    int64_t elapsed_ns;     /* time covered since enabled or reset */
+    int nr_entries;
+    AioCallbackStats *entries;
+} AioStatsSnapshot;
+
+void aio_context_set_stats_enabled(AioContext *ctx, bool enable);
+void aio_stats_reset(AioContext *ctx);
+AioStatsSnapshot *aio_stats_snapshot(AioContext *ctx);
+void aio_stats_snapshot_free(AioStatsSnapshot *snap);
+void aio_stats_dump_json(const AioStatsSnapshot *snap, FILE *f);
+
+/* Called by the event loop, only while ctx->stats_enabled is set */
+void aio_stats_record(AioContext *ctx, AioStatsKind kind, int fd,
+                      void *cb, void *opaque,
+                      int64_t start_ns, int64_t end_ns, int64_t latency_ns);
+void aio_stats_free(AioContext *ctx);
+
+#endif /* AIO_STATS_H */
@@ -1,7 +1,12 @@
 #include <glib.h>
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "atomic.h"
 #include "aio.h"
+#include "aio_stats.h"
+#include "thread_pool.h"
 
 #define container_of(ptr, type, member) ({                      \
         const typeof(((type *) 0)->member) *__mptr = (ptr);     \
@@ -10,162 +15,534 @@
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
 
+enum {
+    /* Already enqueued and waiting for aio_bh_poll() */
+    BH_PENDING   = (1 << 0),
+
+    /* Invoke the callback */
+    BH_SCHEDULED = (1 << 1),
+
+    /* Delete without invoking callback */
+    BH_DELETED   = (1 << 2),
+
+    /* Delete after invoking callback */
+    BH_ONESHOT   = (1 << 3),
+
+    /* Schedule periodically when the event loop is idle */
+    BH_IDLE      = (1 << 4),
+};
+
+/* Default time budget of the BHs run by one event loop iteration, see
+ * aio_context_set_bh_budget()
+ */
+#define BH_BUDGET_NS    SCALE_MS
+
 struct QEMUBH {
     AioContext *ctx;
     QEMUBHFunc *cb;
     void *opaque;
-    QEMUBH *next;
-    bool scheduled;
-    bool idle;
-    bool deleted;
+    QSLIST_ENTRY(QEMUBH) next;
+    unsigned flags;
+    QEMUBHPriority prio;
+
+    /* When the BH was first scheduled, only set with stats enabled */
+    int64_t schedule_ns;
 };
 
+/***********************************************************/
+/* QEMUBH pool */
+
+/* Max number of free QEMUBHs kept by each AioContext */
+#define BH_POOL_MAX_SIZE 1024
+
+#ifndef CONFIG_NO_BH_POOL
+/* Per-thread cache of free QEMUBHs, refilled in batches from the pool of the
+ * AioContext the BH is allocated for.  Only the owning thread touches it.
+ */
+typedef struct BHPoolCache {
+    BHList list;
+    unsigned long allocs;
+    unsigned long hits;
+} BHPoolCache;
+
+static __thread BHPoolCache bh_pool_cache;
+static pthread_key_t bh_pool_key;
+static pthread_once_t bh_pool_once = PTHREAD_ONCE_INIT;
+
+static void bh_pool_cache_cleanup(void *opaque)
+{
+    BHPoolCache *cache = opaque;
+    QEMUBH *bh;
+
+    while ((bh = QSLIST_FIRST(&cache->list))) {
+        QSLIST_REMOVE_HEAD(&cache->list, next);
+        g_free(bh);
+    }
+}
+
+static void bh_pool_init(void)
+{
+    pthread_key_create(&bh_pool_key, bh_pool_cache_cleanup);
+}
+
+static QEMUBH *aio_bh_alloc(AioContext *ctx)
+{
+    BHPoolCache *cache = &bh_pool_cache;
+    QEMUBH *bh;
+
+    cache->allocs++;
+    bh = QSLIST_FIRST(&cache->list);
+    if (bh) {
+        cache->hits++;
+        QSLIST_REMOVE_HEAD(&cache->list, next);
+        return bh;
+    }
+
+    if (atomic_read(&ctx->bh_pool.slh_first)) {
+        int n = 0;
+
+        /* Free the cache when the thread exits */
+        pthread_once(&bh_pool_once, bh_pool_init);
+        pthread_setspecific(bh_pool_key, cache);
+
+        QSLIST_MOVE_ATOMIC(&cache->list, &ctx->bh_pool);
+        QSLIST_FOREACH(bh, &cache->list, next) {
+            n++;
+        }
+        atomic_sub(&ctx->bh_pool_size, n);
+        atomic_inc(&ctx->bh_pool_stats.refills);
+
+        bh = QSLIST_FIRST(&cache->list);
+        if (bh) {
+            QSLIST_REMOVE_HEAD(&cache->list, next);
+            return bh;
+        }
+    }
+
+    atomic_inc(&ctx->bh_pool_stats.misses);
+    return g_new(QEMUBH, 1);
+}
+
+/* Only called from the thread running aio_bh_poll() */
+static void aio_bh_free(AioContext *ctx, QEMUBH *bh)
+{
+    if (atomic_read(&ctx->bh_pool_size) >= BH_POOL_MAX_SIZE) {
+        ctx->bh_pool_stats.released++;
+        g_free(bh);
+        return;
+    }
+
+    ctx->bh_pool_stats.recycled++;
+    atomic_inc(&ctx->bh_pool_size);
+    QSLIST_INSERT_HEAD_ATOMIC(&ctx->bh_pool, bh, next);
+}
+#else
+static QEMUBH *aio_bh_alloc(AioContext *ctx)
+{
+    atomic_inc(&ctx->bh_pool_stats.misses);
+    return g_new(QEMUBH, 1);
+}
+
+static void aio_bh_free(AioContext *ctx, QEMUBH *bh)
+{
+    ctx->bh_pool_stats.released++;
+    g_free(bh);
+}
+#endif
+
+/* Fill @stats with the counters of @ctx's pool, plus the allocations made
+ * by the calling thread.
+ */
+void aio_bh_pool_stats(AioContext *ctx, BHPoolStats *stats)
+{
+    *stats = ctx->bh_pool_stats;
+#ifndef CONFIG_NO_BH_POOL
+    stats->allocs = bh_pool_cache.allocs;
+    stats->hits = bh_pool_cache.hits;
+#endif
+}
+
+/***********************************************************/
+
 void aio_notify(AioContext *ctx)
 {
-    /* Write e.g. bh->scheduled before reading ctx->notify_me.  Pairs
+    /* Write e.g. bh->flags before reading ctx->notify_me.  Pairs
      * with atomic_or in aio_ctx_prepare or atomic_add in aio_poll.
      */
     smp_mb();
     if (ctx->notify_me) {
-        event_notifier_set(&ctx->notifier);
+        if (!atomic_read(&ctx->notify_coalesce) ||
+            atomic_fetch_inc(&ctx->notify_pending) == 0) {
+            event_notifier_set(&ctx->notifier);
+            atomic_inc(&ctx->notify_stats.sent);
+        } else {
+            atomic_inc(&ctx->notify_stats.suppressed);
+        }
         atomic_mb_set(&ctx->notified, true);
     }
 }
 
+/* The EventNotifier itself is cleared by its handler, see
+ * aio_context_notifier_cb.
+ */
 void aio_notify_accept(AioContext *ctx)
 {
-    if (atomic_xchg(&ctx->notified, false)) {
-        event_notifier_test_and_clear(&ctx->notifier);
+    atomic_set(&ctx->notified, false);
+
+    /* Write ctx->notified before reading e.g. bh->flags */
+    smp_mb();
+}
+
+/* With @enable, concurrent aio_notify calls issue a single EventNotifier
+ * write until the context accepts it; without, each of them writes.
+ */
+void aio_context_set_notify_coalescing(AioContext *ctx, bool enable)
+{
+    atomic_set(&ctx->notify_coalesce, enable);
+}
+
+void aio_context_get_notify_stats(AioContext *ctx, AioNotifyStats *stats)
+{
+    stats->sent = atomic_read(&ctx->notify_stats.sent);
+    stats->suppressed = atomic_read(&ctx->notify_stats.suppressed);
+    stats->received = atomic_read(&ctx->notify_stats.received);
+}
+
+/* Called concurrently from any thread */
+static void aio_bh_enqueue(QEMUBH *bh, unsigned new_flags)
+{
+    AioContext *ctx = atomic_read(&bh->ctx);
+    unsigned old_flags;
+
+    /* The memory barrier implicit in atomic_fetch_or makes sure that:
+     * 1. idle & any writes needed by the callback are done before the
+     *    locations are read in the aio_bh_poll.
+     * 2. ctx is loaded before the callback has a chance to execute and bh
+     *    could be freed.
+     */
+    old_flags = atomic_fetch_or(&bh->flags, BH_PENDING | new_flags);
+    if (!(old_flags & BH_PENDING)) {
+        /* Nobody else touches the BH until it is on the list */
+        if (unlikely(atomic_read(&ctx->stats_enabled))) {
+            bh->schedule_ns = get_clock();
+        }
+        QSLIST_INSERT_HEAD_ATOMIC(&ctx->bh_list, bh, next);
+    }
+
+    aio_notify(ctx);
+}
+
+/* Only called from aio_bh_poll() and aio_ctx_finalize() */
+static QEMUBH *aio_bh_dequeue(BHList *head, unsigned *flags)
+{
+    QEMUBH *bh = atomic_rcu_read(&head->slh_first);
+
+    if (!bh) {
+        return NULL;
     }
+
+    QSLIST_REMOVE_HEAD(head, next);
+
+    /* The atomic_fetch_and is paired with aio_bh_enqueue().  The implicit
+     * memory barrier ensures that the callback sees all writes done by the
+     * scheduling thread.  It also ensures that the scheduling thread sees
+     * the cleared flag before bh->cb has run, and thus will call aio_notify
+     * again if necessary.
+     */
+    *flags = atomic_fetch_and(&bh->flags,
+                              ~(BH_PENDING | BH_SCHEDULED | BH_IDLE));
+    return bh;
 }
 
-void aio_bh_schedule_oneshot(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
+void aio_bh_schedule_oneshot_prio(AioContext *ctx, QEMUBHFunc *cb,
+                                  void *opaque, QEMUBHPriority prio)
 {
     QEMUBH *bh;
-    bh = g_new(QEMUBH, 1);
+    bh = aio_bh_alloc(ctx);
     *bh = (QEMUBH){
         .ctx = ctx,
         .cb = cb,
         .opaque = opaque,
+        .prio = prio,
     };
-    qemu_lockcnt_lock(&ctx->list_lock);
-    bh->next = ctx->first_bh;
-    bh->scheduled = 1;
-    bh->deleted = 1;
-    /* Make sure that the members are ready before putting bh into list */
-    smp_wmb();
-    ctx->first_bh = bh;
-    qemu_lockcnt_unlock(&ctx->list_lock);
-    aio_notify(ctx);
+    aio_bh_enqueue(bh, BH_SCHEDULED | BH_ONESHOT);
 }
 
-QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
+void aio_bh_schedule_oneshot(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
+{
+    aio_bh_schedule_oneshot_prio(ctx, cb, opaque, QEMU_BH_PRIO_NORMAL);
+}
+
+/* A new BH is not put on any list until it is scheduled, so creating
+ * thousands of long-lived BHs costs nothing in aio_bh_poll.
+ */
+QEMUBH *aio_bh_new_prio(AioContext *ctx, QEMUBHFunc *cb, void *opaque,
+                        QEMUBHPriority prio)
 {
     QEMUBH *bh;
-    bh = g_new(QEMUBH, 1);
+    bh = aio_bh_alloc(ctx);
     *bh = (QEMUBH){
         .ctx = ctx,
         .cb = cb,
         .opaque = opaque,
+        .prio = prio,
     };
-    qemu_lockcnt_lock(&ctx->list_lock);
-    bh->next = ctx->first_bh;
-    /* Make sure that the members are ready before putting bh into list */
-    smp_wmb();
-    ctx->first_bh = bh;
-    qemu_lockcnt_unlock(&ctx->list_lock);
     return bh;
 }
 
+QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
+{
+    return aio_bh_new_prio(ctx, cb, opaque, QEMU_BH_PRIO_NORMAL);
+}
+
 void aio_bh_call(QEMUBH *bh)
 {
     bh->cb(bh->opaque);
 }
 
-/* Multiple occurrences of aio_bh_poll cannot be called concurrently.
- * The count in ctx->list_lock is incremented before the call, and is
- * not affected by the call.
+static void __attribute__((noinline))
+aio_bh_call_stats(AioContext *ctx, QEMUBH *bh)
+{
+    QEMUBHFunc *cb = bh->cb;
+    void *opaque = bh->opaque;
+    int64_t latency = -1;
+    int64_t start = get_clock();
+
+    if (bh->schedule_ns) {
+        latency = start - bh->schedule_ns;
+        bh->schedule_ns = 0;
+    }
+    aio_bh_call(bh);
+    aio_stats_record(ctx, AIO_STATS_BH, -1, cb, opaque,
+                     start, get_clock(), latency);
+}
+
+/* Move the BHs of @list in front of those of @head */
+static void bh_list_splice_head(BHList *head, BHList *list)
+{
+    QEMUBH **tail = &QSLIST_FIRST(list);
+
+    if (!*tail) {
+        return;
+    }
+    while (*tail) {
+        tail = &QSLIST_NEXT(*tail, next);
+    }
+    *tail = QSLIST_FIRST(head);
+    QSLIST_FIRST(head) = QSLIST_FIRST(list);
+    QSLIST_INIT(list);
+}
+
+/* Sort the BHs scheduled since the last call into the lists of @slice by
+ * priority.  ctx->bh_list has the newest BH first, so pushing them one by
+ * one leaves the oldest first; BHs deferred by the last iteration go in
+ * front of them.  Returns false if @slice is empty.
  */
-int aio_bh_poll(AioContext *ctx)
+static bool aio_bh_slice_fill(AioContext *ctx, BHListSlice *slice)
 {
-    QEMUBH *bh, **bhp, *next;
-    int ret;
-    bool deleted = false;
-
-    ret = 0;
-    for (bh = atomic_rcu_read(&ctx->first_bh); bh; bh = next) {
-        next = atomic_rcu_read(&bh->next);
-        /* The atomic_xchg is paired with the one in qemu_bh_schedule.  The
-         * implicit memory barrier ensures that the callback sees all writes
-         * done by the scheduling thread.  It also ensures that the scheduling
-         * thread sees the zero before bh->cb has run, and thus will call
-         * aio_notify again if necessary.
-         */
-        if (atomic_xchg(&bh->scheduled, 0)) {
-            /* Idle BHs don't count as progress */
-            if (!bh->idle) {
-                ret = 1;
-            }
-            bh->idle = 0;
-            aio_bh_call(bh);
+    BHList list;
+    QEMUBH *bh;
+    bool any = false;
+    int prio;
+
+    for (prio = 0; prio < QEMU_BH_PRIO_MAX; prio++) {
+        QSLIST_INIT(&slice->bh_list[prio]);
+    }
+
+    /* Nobody else touches the BHs while they are pending */
+    QSLIST_MOVE_ATOMIC(&list, &ctx->bh_list);
+    while ((bh = QSLIST_FIRST(&list))) {
+        QSLIST_REMOVE_HEAD(&list, next);
+        prio = atomic_read(&bh->prio);
+        QSLIST_INSERT_HEAD(&slice->bh_list[prio], bh, next);
+    }
+
+    for (prio = 0; prio < QEMU_BH_PRIO_MAX; prio++) {
+        bh_list_splice_head(&slice->bh_list[prio], &ctx->bh_deferred[prio]);
+        any |= !QSLIST_EMPTY(&slice->bh_list[prio]);
+    }
+    return any;
+}
+
+/* Keep what is left of @slice for the next iteration.  It goes in front
+ * of what nested calls deferred, which was scheduled later.
+ */
+static void aio_bh_slice_defer(AioContext *ctx, BHListSlice *slice)
+{
+    int prio;
+
+    for (prio = 0; prio < QEMU_BH_PRIO_MAX; prio++) {
+        bh_list_splice_head(&ctx->bh_deferred[prio], &slice->bh_list[prio]);
+    }
+}
+
+/* Charge one callback to the budget of the current iteration.  The clock
+ * is only read every 16 callbacks, and the time budget starts at the first
+ * reading, so that iterations running few BHs never pay for it; it can be
+ * overrun by up to 32 callbacks.
+ */
+static void aio_bh_budget_charge(AioContext *ctx)
+{
+    int64_t now;
+
+    if ((--ctx->bh_budget_left & 15) || !ctx->bh_budget_ns) {
+        return;
+    }
+    now = get_clock();
+    if (!ctx->bh_budget_deadline) {
+        ctx->bh_budget_deadline = now + ctx->bh_budget_ns;
+    } else if (now >= ctx->bh_budget_deadline) {
+        ctx->bh_budget_left = 0;
+    }
+}
+
+/* Pick the oldest BH of the highest priority class, across the slices of
+ * all aio_bh_poll calls in progress; outer ones hold the older BHs.  Once
+ * the budget is spent, only classes that have not run a BH in this
+ * iteration get one more, so that none of them starves.  Returns NULL if
+ * there is nothing left to run.
+ */
+static QEMUBH *aio_bh_next(AioContext *ctx, unsigned *flags)
+{
+    bool spent = ctx->bh_budget_left <= 0;
+    BHListSlice *s;
+    QEMUBH *bh;
+    int prio;
+
+    for (prio = 0; prio < QEMU_BH_PRIO_MAX; prio++) {
+        if (spent && (ctx->bh_budget_classes & (1 << prio))) {
+            continue;
         }
-        if (bh->deleted) {
-            deleted = true;
+        QSIMPLEQ_FOREACH(s, &ctx->bh_slice_list, next) {
+            bh = aio_bh_dequeue(&s->bh_list[prio], flags);
+            if (bh) {
+                ctx->bh_budget_classes |= 1 << prio;
+                return bh;
+            }
         }
     }
+    return NULL;
+}
 
-    /* remove deleted bhs */
-    if (!deleted) {
-        return ret;
+/* Multiple occurrences of aio_bh_poll cannot be called concurrently,
+ * but aio_bh_poll may be re-entered from a BH callback.  Nested calls
+ * share the budget of the outermost one; BHs that do not fit in it are
+ * left for the next call.  Each nested call is an iteration of its own,
+ * though, so every class gets to run one BH again: a BH callback that
+ * waits in aio_poll() for another BH, e.g. in aio_wait_bh_oneshot(),
+ * would otherwise spin once the budget is spent.
+ */
+int aio_bh_poll(AioContext *ctx)
+{
+    BHListSlice slice;
+    QEMUBH *bh;
+    unsigned flags;
+    bool outermost = QSIMPLEQ_EMPTY(&ctx->bh_slice_list);
+    int ret = 0;
+
+    if (!aio_bh_slice_fill(ctx, &slice) && outermost) {
+        return 0;
     }
+    if (outermost) {
+        ctx->bh_budget_left = ctx->bh_budget_max ? ctx->bh_budget_max
+                                                 : INT_MAX;
+        ctx->bh_budget_deadline = 0;
+    }
+    ctx->bh_budget_classes = 0;
+    QSIMPLEQ_INSERT_TAIL(&ctx->bh_slice_list, &slice, next);
+
+    while ((bh = aio_bh_next(ctx, &flags))) {
+        /* Moved by qemu_bh_set_aio_context() while pending, pass it on */
+        if (atomic_read(&bh->ctx) != ctx) {
+            aio_bh_enqueue(bh, flags & ~BH_PENDING);
+            continue;
+        }
 
-    if (qemu_lockcnt_dec_if_lock(&ctx->list_lock)) {
-        bhp = &ctx->first_bh;
-        while (*bhp) {
-            bh = *bhp;
-            if (bh->deleted && !bh->scheduled) {
-                *bhp = bh->next;
-                g_free(bh);
+        if ((flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
+            /* Idle BHs don't count as progress */
+            if (!(flags & BH_IDLE)) {
+                ret = 1;
+            }
+            if (unlikely(ctx->stats_enabled)) {
+                aio_bh_call_stats(ctx, bh);
             } else {
-                bhp = &bh->next;
+                aio_bh_call(bh);
             }
+            aio_bh_budget_charge(ctx);
+        }
+        if (flags & (BH_DELETED | BH_ONESHOT)) {
+            aio_bh_free(ctx, bh);
         }
-        qemu_lockcnt_inc_and_unlock(&ctx->list_lock);
     }
+
+    aio_bh_slice_defer(ctx, &slice);
+    QSIMPLEQ_REMOVE(&ctx->bh_slice_list, &slice, BHListSlice, next);
     return ret;
 }
 
 void qemu_bh_schedule_idle(QEMUBH *bh)
 {
-    bh->idle = 1;
-    /* Make sure that idle & any writes needed by the callback are done
-     * before the locations are read in the aio_bh_poll.
-     */
-    atomic_mb_set(&bh->scheduled, 1);
+    aio_bh_enqueue(bh, BH_SCHEDULED | BH_IDLE);
 }
 
 void qemu_bh_schedule(QEMUBH *bh)
 {
-    AioContext *ctx;
+    aio_bh_enqueue(bh, BH_SCHEDULED);
+}
 
-    ctx = bh->ctx;
-    bh->idle = 0;
-    /* The memory barrier implicit in atomic_xchg makes sure that:
-     * 1. idle & any writes needed by the callback are done before the
-     *    locations are read in the aio_bh_poll.
-     * 2. ctx is loaded before scheduled is set and the callback has a chance
-     *    to execute.
-     */
-    if (atomic_xchg(&bh->scheduled, 1) == 0) {
-        aio_notify(ctx);
-    }
+/* This func is async.  It takes effect the next time aio_bh_poll() picks
+ * the BH up.
+ */
+void qemu_bh_set_priority(QEMUBH *bh, QEMUBHPriority prio)
+{
+    atomic_set(&bh->prio, prio);
+}
+
+/* Bound the work done by the BHs of one event loop iteration, so that BHs
+ * scheduling more BHs cannot delay fd handlers and timers for long: stop
+ * after @max_bhs callbacks or @max_ns nanoseconds, whichever comes first;
+ * zero means no limit.  Each priority class with pending BHs still runs at
+ * least one per iteration, and the BHs left over run at the next one ahead
+ * of newer BHs of their class.
+ */
+void aio_context_set_bh_budget(AioContext *ctx, int max_bhs, int64_t max_ns)
+{
+    atomic_set(&ctx->bh_budget_max, max_bhs);
+    atomic_set(&ctx->bh_budget_ns, max_ns);
+}
+
+typedef struct {
+    QEMUBH *bh;
+    AioContext *new_ctx;
+} BHMoveData;
+
+static void qemu_bh_move_bh(void *opaque)
+{
+    BHMoveData *data = opaque;
+
+    atomic_set(&data->bh->ctx, data->new_ctx);
+}
+
+/* Make @bh run in @new_ctx from now on.  The switch happens in the thread
+ * running the old context, so when this returns the callback is not
+ * running there.  If the BH is pending in the old context, that context's
+ * aio_bh_poll() passes it on to @new_ctx.
+ */
+void qemu_bh_set_aio_context(QEMUBH *bh, AioContext *new_ctx)
+{
+    BHMoveData data = {
+        .bh = bh,
+        .new_ctx = new_ctx,
+    };
+
+    aio_wait_bh_oneshot(atomic_read(&bh->ctx), qemu_bh_move_bh, &data);
 }
 
 /* This func is async.
  */
 void qemu_bh_cancel(QEMUBH *bh)
 {
-    atomic_mb_set(&bh->scheduled, 0);
+    atomic_and(&bh->flags, ~BH_SCHEDULED);
 }
 
 /* This func is async.The bottom half will do the delete action at the finial
@@ -173,8 +550,59 @@ void qemu_bh_cancel(QEMUBH *bh)
  */
 void qemu_bh_delete(QEMUBH *bh)
 {
-    bh->scheduled = 0;
-    bh->deleted = 1;
+    aio_bh_enqueue(bh, BH_DELETED);
+}
+
+/* 0 if a non-idle BH on @list is scheduled, 10ms if only idle ones are,
+ * -1 if none is
+ */
+static int64_t aio_bh_list_timeout(BHList *list)
+{
+    QEMUBH *bh;
+    int64_t timeout = -1;
+
+    QSLIST_FOREACH_RCU(bh, list, next) {
+        if ((bh->flags & (BH_SCHEDULED | BH_DELETED)) == BH_SCHEDULED) {
+            if (!(bh->flags & BH_IDLE)) {
+                return 0;
+            }
+            timeout = 10000000;
+        }
+    }
+    return timeout;
+}
+
+/* The same for all BHs that the next aio_bh_poll would look at */
+static int64_t aio_bh_timeout(AioContext *ctx)
+{
+    BHListSlice *s;
+    int64_t timeout;
+    int prio;
+
+    timeout = aio_bh_list_timeout(&ctx->bh_list);
+    for (prio = 0; prio < QEMU_BH_PRIO_MAX && timeout; prio++) {
+        timeout = qemu_soonest_timeout(timeout,
+                      aio_bh_list_timeout(&ctx->bh_deferred[prio]));
+        QSIMPLEQ_FOREACH(s, &ctx->bh_slice_list, next) {
+            timeout = qemu_soonest_timeout(timeout,
+                          aio_bh_list_timeout(&s->bh_list[prio]));
+        }
+    }
+    return timeout;
+}
+
+/* Returns 0 if a non-idle BH is scheduled, otherwise the time until the
+ * first timer expires, capped at 10ms if idle BHs are scheduled; -1 (wait
+ * for an fd event) if there is neither.
+ */
+int64_t aio_compute_timeout(AioContext *ctx)
+{
+    int64_t timeout = aio_bh_timeout(ctx);
+
+    if (!timeout) {
+        return 0;
+    }
+    return qemu_soonest_timeout(timeout, timerlist_deadline_ns(&ctx->tl));
 }
 
 static gboolean
@@ -187,8 +615,8 @@ aio_ctx_prepare(GSource *source, gint    *timeout)
 
     atomic_or(&ctx->notify_me, 1);
 
-    /* default timeout 10ms */
-    *timeout = 10;
+    /* We assume there is no timeout already supplied */
+    *timeout = qemu_timeout_ns_to_ms(aio_compute_timeout(ctx));
 
     if (aio_prepare(ctx)) {
         *timeout = 0;
@@ -204,28 +632,30 @@ aio_ctx_check(GSource *source)
     g_print("%s\n", __FUNCTION__);
 #endif
     AioContext *ctx = (AioContext *) source;
-    QEMUBH *bh;
 
     atomic_and(&ctx->notify_me, ~1);
     aio_notify_accept(ctx);
+    if (unlikely(ctx->stats_enabled)) {
+        ctx->stats_ready_ns = get_clock();
+    }
 
-    for (bh = ctx->first_bh; bh; bh = bh->next) {
-        if (bh->scheduled) {
-            return true;
-        }
+    if (aio_bh_timeout(ctx) >= 0) {
+        return true;
     }
 
-    return aio_pending(ctx);
+    return aio_pending(ctx) || timerlist_expired(&ctx->tl);
 }
 
 
 static void
 aio_dispatch(AioContext *ctx)
 {
-    qemu_lockcnt_inc(&ctx->list_lock);
+    rcu_read_lock(&ctx->rcu);
     aio_bh_poll(ctx);
     aio_dispatch_handlers(ctx);
-    qemu_lockcnt_dec(&ctx->list_lock);
+    rcu_read_unlock(&ctx->rcu);
+
+    timerlist_run_timers(&ctx->tl);
 }
 
 static gboolean
@@ -249,23 +679,60 @@ aio_ctx_finalize(GSource     *source)
     g_print("%s\n", __FUNCTION__);
 #endif
     AioContext *ctx = (AioContext *) source;
+    QEMUBH *bh;
+    unsigned flags;
+    int prio;
 
-    qemu_bh_delete(ctx->co_schedule_bh);
+    if (ctx->thread_pool) {
+        thread_pool_free(ctx->thread_pool);
+        ctx->thread_pool = NULL;
+    }
 
-    qemu_lockcnt_lock(&ctx->list_lock);
-    while (ctx->first_bh) {
-        QEMUBH *next = ctx->first_bh->next;
+    if (ctx->co_schedule_bh) {
+        qemu_bh_delete(ctx->co_schedule_bh);
+    }
+
+    /* There must be no aio_bh_poll() calls going on */
+    assert(QSIMPLEQ_EMPTY(&ctx->bh_slice_list));
 
+    while ((bh = aio_bh_dequeue(&ctx->bh_list, &flags))) {
         /* qemu_bh_delete() must have been called on BHs in this AioContext */
-        assert(ctx->first_bh->deleted);
+        assert(flags & BH_DELETED);
+
+        g_free(bh);
+    }
+    for (prio = 0; prio < QEMU_BH_PRIO_MAX; prio++) {
+        while ((bh = aio_bh_dequeue(&ctx->bh_deferred[prio], &flags))) {
+            assert(flags & BH_DELETED);
+            g_free(bh);
+        }
+    }
 
-        g_free(ctx->first_bh);
-        ctx->first_bh = next;
+    while ((bh = QSLIST_FIRST(&ctx->bh_pool))) {
+        QSLIST_REMOVE_HEAD(&ctx->bh_pool, next);
+        g_free(bh);
     }
-    qemu_lockcnt_unlock(&ctx->list_lock);
 
-    aio_set_event_notifier(ctx, &ctx->notifier, NULL);
+    aio_set_event_notifier(ctx, &ctx->notifier, NULL, NULL);
     event_notifier_cleanup(&ctx->notifier);
+
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+        g_free(ctx->epoll_events);
+    }
+    if (ctx->uring) {
+        fdmon_io_uring_destroy(ctx);
+    }
+
+    /* Free the handlers removed since the last iteration */
+    rcu_domain_cleanup(&ctx->rcu);
+    pthread_mutex_destroy(&ctx->list_lock);
+    g_free(ctx->fd_handlers);
+    g_free(ctx->pollfds);
+    g_free(ctx->pollfds_nodes);
+
+    timerlist_cleanup(&ctx->tl);
+    aio_stats_free(ctx);
 }
 
 static GSourceFuncs
@@ -276,9 +743,32 @@ aio_source_funcs = {
     aio_ctx_finalize
 };
 
-static void event_notifier_dummy_cb(EventNotifier *e)
+/* A timer became the first to expire, recompute the poll timeout */
+static void aio_timerlist_notify(void *opaque)
 {
+    aio_notify(opaque);
+}
+
+/* Clear the EventNotifier only when its readiness has been dispatched:
+ * io_uring reports a multishot poll once per write, so if another thread
+ * wrote to it and aio_notify_accept cleared it before the event was
+ * reaped, the write would be lost together with the reset of
+ * notify_pending, and every later aio_notify would be coalesced into it.
+ */
+static void aio_context_notifier_cb(EventNotifier *e)
+{
+    AioContext *ctx = container_of(e, AioContext, notifier);
+
+    /* One read collects every write since the last one */
+    atomic_set(&ctx->notify_stats.received,
+               ctx->notify_stats.received +
+               event_notifier_test_and_clear_count(e));
 
+    /* Only now may the next aio_notify write again.  Producers that
+     * incremented notify_pending before this point published their work
+     * before doing so, and the next aio_poll iteration will see it.
+     */
+    atomic_xchg(&ctx->notify_pending, 0);
 }
 
 /* Returns true if aio_notify() was called (e.g. a BH was scheduled) */
@@ -290,38 +780,186 @@ static bool event_notifier_poll(void *opaque)
     return atomic_read(&ctx->notified);
 }
 
+/* Create an AioContext whose file descriptors are monitored by @fdmon.
+ * If @fdmon is not available the context falls back to AIO_FDMON_POLL.
+ */
 AioContext *
-aio_context_new(void)
+aio_context_new_fdmon(AioFdMonitor fdmon)
 {
     int ret;
     AioContext *ctx;
 
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
 
+    ctx->epollfd = -1;
+    ctx->notify_coalesce = true;
+    ctx->bh_budget_ns = BH_BUDGET_NS;
+    ctx->fdmon_ops = &fdmon_poll_ops;
+    if (fdmon == AIO_FDMON_EPOLL && !fdmon_epoll_setup(ctx)) {
+        g_print("%s epoll not available, using poll\n", __FUNCTION__);
+    }
+    if (fdmon == AIO_FDMON_IO_URING && !fdmon_io_uring_setup(ctx)) {
+        g_print("%s io_uring not available, using poll\n", __FUNCTION__);
+    }
+
     ret = event_notifier_init(&ctx->notifier, false);
     if (ret < 0) {
         g_print("%s Failed to initialize event notifier\n", __FUNCTION__);
         goto fail;
     }
-    qemu_lockcnt_init(&ctx->list_lock);
+    pthread_mutex_init(&ctx->list_lock, NULL);
+    rcu_domain_init(&ctx->rcu);
+    QSLIST_INIT(&ctx->bh_list);
+    QSIMPLEQ_INIT(&ctx->bh_slice_list);
+    timerlist_init(&ctx->tl, aio_timerlist_notify, ctx);
 
     aio_set_event_notifier(ctx, &ctx->notifier,
                            (EventNotifierHandler *)
-                           event_notifier_dummy_cb,
+                           aio_context_notifier_cb,
                            event_notifier_poll);
     return ctx;
 fail:
+    fdmon_epoll_disable(ctx);
     g_source_destroy(&ctx->source);
     return NULL;
 }
 
+AioContext *
+aio_context_new(void)
+{
+    return aio_context_new_fdmon(AIO_FDMON_POLL);
+}
+
+void aio_context_ref(AioContext *ctx)
+{
+    g_source_ref(&ctx->source);
+}
+
+void aio_context_unref(AioContext *ctx)
+{
+    g_source_unref(&ctx->source);
+}
+
+/* Only called from the thread running @ctx */
+ThreadPool *aio_get_thread_pool(AioContext *ctx)
+{
+    if (!ctx->thread_pool) {
+        ctx->thread_pool = thread_pool_new(ctx, ctx->thread_pool_size);
+    }
+    return ctx->thread_pool;
+}
+
+/* Use @nr_workers threads from now on, 0 for one per CPU.  An existing
+ * pool is torn down, so there must be no jobs in flight.
+ */
+void aio_context_set_thread_pool_size(AioContext *ctx, int nr_workers)
+{
+    ctx->thread_pool_size = nr_workers;
+    if (ctx->thread_pool) {
+        thread_pool_free(ctx->thread_pool);
+        ctx->thread_pool = NULL;
+    }
+}
+
+static __thread AioContext *my_aio_context;
+
+AioContext *qemu_get_current_aio_context(void)
+{
+    return my_aio_context;
+}
+
+void qemu_set_current_aio_context(AioContext *ctx)
+{
+    my_aio_context = ctx;
+}
+
+typedef struct {
+    QEMUBHFunc *cb;
+    void *opaque;
+    AioContext *waiter;     /* NULL if the waiting thread runs no context */
+    bool done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} AioWaitBHData;
+
+/* Runs in the waiter's own context */
+static void aio_wait_bh_done(void *opaque)
+{
+    AioWaitBHData *data = opaque;
+
+    data->done = true;
+}
+
+static void aio_wait_bh(void *opaque)
+{
+    AioWaitBHData *data = opaque;
+    AioContext *waiter = data->waiter;
+
+    data->cb(data->opaque);
+
+    /* A bare aio_notify() is dropped if the waiter has not entered
+     * aio_poll() yet, and done alone would not wake it up from there.
+     * Hand the completion over as a BH instead, which the blocking
+     * aio_poll() is sure to see.
+     */
+    if (waiter) {
+        aio_bh_schedule_oneshot(waiter, aio_wait_bh_done, data);
+    } else {
+        /* data lives on the waiter's stack, do not touch it once done */
+        pthread_mutex_lock(&data->lock);
+        data->done = true;
+        pthread_cond_signal(&data->cond);
+        pthread_mutex_unlock(&data->lock);
+    }
+}
+
+void aio_wait_bh_oneshot(AioContext *ctx, QEMUBHFunc *cb, void *opaque)
+{
+    AioWaitBHData data = {
+        .cb = cb,
+        .opaque = opaque,
+        .waiter = qemu_get_current_aio_context(),
+    };
+
+    if (data.waiter == ctx) {
+        cb(opaque);
+        return;
+    }
+
+    if (data.waiter) {
+        /* Keep serving our own context, its thread may be waiting on us */
+        aio_bh_schedule_oneshot(ctx, aio_wait_bh, &data);
+        while (!data.done) {
+            aio_poll(data.waiter, true);
+        }
+        return;
+    }
+
+    pthread_mutex_init(&data.lock, NULL);
+    pthread_cond_init(&data.cond, NULL);
+    aio_bh_schedule_oneshot(ctx, aio_wait_bh, &data);
+    pthread_mutex_lock(&data.lock);
+    while (!data.done) {
+        pthread_cond_wait(&data.cond, &data.lock);
+    }
+    pthread_mutex_unlock(&data.lock);
+    pthread_cond_destroy(&data.cond);
+    pthread_mutex_destroy(&data.lock);
+}
+
 void
 aio_list_bh(AioContext *ctx) {
     QEMUBH *bh = NULL;
-    QEMUBH *next = NULL;
+    int prio;
 
-    for (bh = atomic_rcu_read(&ctx->first_bh); bh; bh = next) {
-        next = atomic_rcu_read(&bh->next);
-        g_print("[%s] bh = %p \n", __FUNCTION__, bh);
+    /* Only pending BHs are listed, idle ones are not linked anywhere */
+    QSLIST_FOREACH_RCU(bh, &ctx->bh_list, next) {
+        g_print("[%s] bh = %p flags = %#x\n", __FUNCTION__, bh, bh->flags);
+    }
+    for (prio = 0; prio < QEMU_BH_PRIO_MAX; prio++) {
+        QSLIST_FOREACH(bh, &ctx->bh_deferred[prio], next) {
+            g_print("[%s] bh = %p flags = %#x prio = %d (deferred)\n",
+                    __FUNCTION__, bh, bh->flags, prio);
+        }
     }
 }
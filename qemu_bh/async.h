@@ -3,8 +3,42 @@
 AioContext *
 aio_context_new(void);
 
+AioContext *
+aio_context_new_fdmon(AioFdMonitor fdmon);
+
+void aio_context_ref(AioContext *ctx);
+void aio_context_unref(AioContext *ctx);
+
 QEMUBH *
 aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque);
+QEMUBH *
+aio_bh_new_prio(AioContext *ctx, QEMUBHFunc *cb, void *opaque,
+                QEMUBHPriority prio);
+
+void
+aio_bh_schedule_oneshot(AioContext *ctx, QEMUBHFunc *cb, void *opaque);
+void
+aio_bh_schedule_oneshot_prio(AioContext *ctx, QEMUBHFunc *cb, void *opaque,
+                             QEMUBHPriority prio);
+
+void qemu_bh_schedule(QEMUBH *bh);
+void qemu_bh_schedule_idle(QEMUBH *bh);
+void qemu_bh_cancel(QEMUBH *bh);
+void qemu_bh_delete(QEMUBH *bh);
+void qemu_bh_set_aio_context(QEMUBH *bh, AioContext *new_ctx);
+void qemu_bh_set_priority(QEMUBH *bh, QEMUBHPriority prio);
+
+void aio_context_set_bh_budget(AioContext *ctx, int max_bhs, int64_t max_ns);
+
+int
+aio_bh_poll(AioContext *ctx);
+
+void aio_notify(AioContext *ctx);
+void aio_notify_accept(AioContext *ctx);
+void aio_context_set_notify_coalescing(AioContext *ctx, bool enable);
+void aio_context_get_notify_stats(AioContext *ctx, AioNotifyStats *stats);
+
+void aio_bh_pool_stats(AioContext *ctx, BHPoolStats *stats);
 
 void
 aio_list_bh(AioContext *ctx);
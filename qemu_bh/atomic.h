@@ -19,6 +19,24 @@
 /* Compiler barrier */
 #define barrier()   ({ asm volatile("" ::: "memory"); (void)0; })
 
+/* Hint to the CPU that we are in a spin-wait loop */
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax()   asm volatile("pause" ::: "memory")
+#elif defined(__aarch64__)
+#define cpu_relax()   asm volatile("yield" ::: "memory")
+#else
+#define cpu_relax()   barrier()
+#endif
+
+/* Full barrier after an atomic read-modify-write.  On x86 and s390 those
+ * are already full barriers, so only the compiler needs to be told.
+ */
+#if defined(__i386__) || defined(__x86_64__) || defined(__s390x__)
+#define smp_mb__after_rmw()   barrier()
+#else
+#define smp_mb__after_rmw()   smp_mb()
+#endif
+
 /* The variable that receives the old value of an atomically-accessed
  * variable must be non-qualified, because atomic builtins return values
  * through a pointer-type argument as in __atomic_load(&var, &old, MODEL).
@@ -0,0 +1,123 @@
+/*
+ * fd handler dispatch throughput benchmark
+ *
+ * The context has a number of handlers on eventfds that stay readable, so
+ * that each aio_poll() iteration dispatches all of them, while 0, 1 or 2
+ * updater threads keep adding and removing handlers of their own.  The
+ * handler list is walked in an RCU critical section, so the updaters never
+ * stall dispatch and removed handlers are freed between iterations.
+ *
+ * Usage: bench_aio_dispatch [handlers] [seconds]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "atomic.h"
+#include "async.h"
+
+#define MAX_UPDATERS 2
+
+typedef struct {
+    AioContext *ctx;
+    int fd;
+    unsigned long updates;
+} __attribute__((aligned(64))) Updater;
+
+static bool stop;
+static unsigned long dispatched;
+
+static void bench_read(void *opaque)
+{
+    dispatched++;
+}
+
+static void *updater_thread(void *opaque)
+{
+    Updater *u = opaque;
+
+    while (!atomic_read(&stop)) {
+        aio_set_fd_handler(u->ctx, u->fd, bench_read, NULL, NULL, NULL);
+        aio_set_fd_handler(u->ctx, u->fd, NULL, NULL, NULL, NULL);
+        u->updates += 2;
+    }
+    return NULL;
+}
+
+static void run(AioFdMonitor fdmon, const char *name, int nr_handlers,
+                int nr_updaters, double seconds)
+{
+    AioContext *ctx = aio_context_new_fdmon(fdmon);
+    Updater updaters[MAX_UPDATERS];
+    pthread_t tids[MAX_UPDATERS];
+    int *fds = g_new(int, nr_handlers);
+    unsigned long iterations = 0, updates = 0;
+    int64_t start, end, deadline;
+    uint64_t value = 1;
+    int i;
+
+    for (i = 0; i < nr_handlers; i++) {
+        fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (write(fds[i], &value, sizeof(value)) != sizeof(value)) {
+            perror("eventfd");
+            abort();
+        }
+        aio_set_fd_handler(ctx, fds[i], bench_read, NULL, NULL, NULL);
+    }
+
+    atomic_set(&stop, false);
+    for (i = 0; i < nr_updaters; i++) {
+        updaters[i] = (Updater) {
+            .ctx = ctx,
+            .fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK),
+        };
+        pthread_create(&tids[i], NULL, updater_thread, &updaters[i]);
+    }
+
+    dispatched = 0;
+    start = get_clock();
+    deadline = start + seconds * 1e9;
+    do {
+        aio_poll(ctx, false);
+        iterations++;
+    } while ((iterations & 255) || get_clock() < deadline);
+    end = get_clock();
+
+    atomic_set(&stop, true);
+    for (i = 0; i < nr_updaters; i++) {
+        pthread_join(tids[i], NULL);
+        updates += updaters[i].updates;
+        close(updaters[i].fd);
+    }
+
+    g_print("%-8s %4d handlers, %d updaters: %7.2f M dispatches/s, "
+            "%6.1f ns/dispatch, %6.2f M updates/s\n",
+            name, nr_handlers, nr_updaters, dispatched * 1e3 / (end - start),
+            (double)(end - start) / dispatched, updates * 1e3 / (end - start));
+
+    for (i = 0; i < nr_handlers; i++) {
+        aio_set_fd_handler(ctx, fds[i], NULL, NULL, NULL, NULL);
+        close(fds[i]);
+    }
+    aio_poll(ctx, false);
+    aio_poll(ctx, false);
+    aio_context_unref(ctx);
+    g_free(fds);
+}
+
+int main(int argc, char *argv[])
+{
+    int nr_handlers = argc > 1 ? atoi(argv[1]) : 64;
+    double seconds = argc > 2 ? atof(argv[2]) : 1;
+    int i;
+
+    for (i = 0; i <= MAX_UPDATERS; i++) {
+        run(AIO_FDMON_POLL, "poll", nr_handlers, i, seconds);
+    }
+    for (i = 0; i <= MAX_UPDATERS; i++) {
+        run(AIO_FDMON_EPOLL, "epoll", nr_handlers, i, seconds);
+    }
+    return 0;
+}
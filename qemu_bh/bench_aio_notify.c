@@ -0,0 +1,110 @@
+/*
+ * aio_notify coalescing benchmark
+ *
+ * Producer threads schedule BHs in a context whose thread sleeps in
+ * aio_poll(), so every schedule needs a wakeup.  Without coalescing each
+ * aio_notify writes to the EventNotifier; with it, only the first one
+ * since the context last accepted a wakeup does.
+ *
+ * Usage: bench_aio_notify [producers] [schedules-per-producer]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "atomic.h"
+#include "async.h"
+
+#define BHS_PER_PRODUCER 64
+
+static AioContext *ctx;
+static int iterations;
+static bool stop;
+static unsigned long bh_runs;
+
+static void bh_cb(void *opaque)
+{
+    bh_runs++;
+}
+
+static void *producer_thread(void *opaque)
+{
+    QEMUBH **bhs = opaque;
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        qemu_bh_schedule(bhs[i % BHS_PER_PRODUCER]);
+    }
+    return NULL;
+}
+
+static void *consumer_thread(void *opaque)
+{
+    while (!atomic_read(&stop)) {
+        aio_poll(ctx, true);
+    }
+    return NULL;
+}
+
+static void run(int nr_producers, bool coalesce)
+{
+    pthread_t *producers = g_new(pthread_t, nr_producers);
+    QEMUBH **bhs = g_new(QEMUBH *, nr_producers * BHS_PER_PRODUCER);
+    unsigned long total = (unsigned long)nr_producers * iterations;
+    AioNotifyStats stats;
+    pthread_t consumer;
+    long long start, end;
+    int i;
+
+    ctx = aio_context_new_fdmon(AIO_FDMON_EPOLL);
+    aio_context_set_notify_coalescing(ctx, coalesce);
+    for (i = 0; i < nr_producers * BHS_PER_PRODUCER; i++) {
+        bhs[i] = aio_bh_new(ctx, bh_cb, NULL);
+    }
+
+    atomic_set(&stop, false);
+    bh_runs = 0;
+    pthread_create(&consumer, NULL, consumer_thread, NULL);
+
+    start = get_clock();
+    for (i = 0; i < nr_producers; i++) {
+        pthread_create(&producers[i], NULL, producer_thread,
+                       &bhs[i * BHS_PER_PRODUCER]);
+    }
+    for (i = 0; i < nr_producers; i++) {
+        pthread_join(producers[i], NULL);
+    }
+    end = get_clock();
+
+    atomic_set(&stop, true);
+    aio_notify(ctx);
+    pthread_join(consumer, NULL);
+
+    aio_context_get_notify_stats(ctx, &stats);
+    g_print("coalescing %-3s: %6.2f Mschedules/s, %lu BH runs, "
+            "notifications sent %lu (%.1f per 1000 schedules), "
+            "suppressed %lu, received %lu\n",
+            coalesce ? "on" : "off", total * 1e3 / (end - start), bh_runs,
+            stats.sent, stats.sent * 1000.0 / total, stats.suppressed,
+            stats.received);
+
+    for (i = 0; i < nr_producers * BHS_PER_PRODUCER; i++) {
+        qemu_bh_delete(bhs[i]);
+    }
+    aio_poll(ctx, false);
+    aio_context_unref(ctx);
+    g_free(bhs);
+    g_free(producers);
+}
+
+int main(int argc, char *argv[])
+{
+    int nr_producers = argc > 1 ? atoi(argv[1]) : 8;
+
+    iterations = argc > 2 ? atoi(argv[2]) : 200000;
+
+    g_print("%d producers, %d schedules each\n", nr_producers, iterations);
+    run(nr_producers, false);
+    run(nr_producers, true);
+    return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Adaptive polling ping-pong benchmark
+ *
+ * Emulates a virtqueue: the main thread ("guest") publishes a request in
+ * shared memory and kicks an eventfd only if the device asked for
+ * notifications; the AioContext thread ("device") completes it either from
+ * the eventfd handler or from its io_poll callback.  While aio_poll is
+ * busy-polling, io_poll_begin suppresses the kicks, so a request is seen
+ * without any syscall on either side.
+ *
+ * Usage: bench_aio_poll [round-trips] [poll-max-ns]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "atomic.h"
+#include "async.h"
+
+typedef struct {
+    AioContext *ctx;
+    int kick_fd;
+    unsigned avail;         /* written by the guest */
+    unsigned used;          /* written by the device */
+    bool notify;            /* device wants kicks */
+    int stop;
+} VirtQueue;
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static bool vq_process(VirtQueue *vq)
+{
+    unsigned avail = atomic_load_acquire(&vq->avail);
+
+    if (avail == vq->used) {
+        return false;
+    }
+    atomic_store_release(&vq->used, avail);
+    return true;
+}
+
+static void vq_kick(void *opaque)
+{
+    VirtQueue *vq = opaque;
+    uint64_t value;
+
+    if (read(vq->kick_fd, &value, sizeof(value)) == sizeof(value)) {
+        vq_process(vq);
+    }
+}
+
+static bool vq_poll(void *opaque)
+{
+    return vq_process(opaque);
+}
+
+static void vq_poll_begin(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    atomic_set(&vq->notify, false);
+}
+
+static void vq_poll_end(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    atomic_set(&vq->notify, true);
+    /* Pairs with the barrier in the guest between avail and notify */
+    smp_mb();
+}
+
+static void *device_thread(void *opaque)
+{
+    VirtQueue *vq = opaque;
+
+    while (!atomic_read(&vq->stop)) {
+        aio_poll(vq->ctx, true);
+    }
+    return NULL;
+}
+
+static void run(int iterations, int64_t poll_max_ns)
+{
+    VirtQueue vq = { .notify = true };
+    long long *lat = g_new(long long, iterations);
+    long long sum = 0, start, end;
+    AioPollStats stats;
+    pthread_t tid;
+    uint64_t value = 1;
+    int i;
+
+    vq.ctx = aio_context_new_fdmon(AIO_FDMON_EPOLL);
+    vq.kick_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    aio_set_fd_handler(vq.ctx, vq.kick_fd, vq_kick, NULL, vq_poll, &vq);
+    aio_set_fd_poll(vq.ctx, vq.kick_fd, vq_poll_begin, vq_poll_end);
+    aio_context_set_poll_params(vq.ctx, poll_max_ns, 0, 0);
+
+    pthread_create(&tid, NULL, device_thread, &vq);
+
+    start = get_clock();
+    for (i = 0; i < iterations; i++) {
+        long long t0 = get_clock();
+        unsigned req = vq.avail + 1;
+
+        atomic_store_release(&vq.avail, req);
+        smp_mb();
+        if (atomic_read(&vq.notify) &&
+            write(vq.kick_fd, &value, sizeof(value)) < 0) {
+            perror("kick");
+            abort();
+        }
+        while (atomic_load_acquire(&vq.used) != req) {
+            sched_yield();
+        }
+        lat[i] = get_clock() - t0;
+        sum += lat[i];
+    }
+    end = get_clock();
+
+    atomic_set(&vq.stop, 1);
+    aio_notify(vq.ctx);
+    pthread_join(tid, NULL);
+
+    aio_context_get_poll_stats(vq.ctx, &stats);
+    qsort(lat, iterations, sizeof(*lat), cmp_ll);
+    g_print("poll-max-ns %6lld: %8.0f round-trips/s, latency avg %7.2f us "
+            "p50 %7.2f us p99 %7.2f us\n",
+            (long long)poll_max_ns, iterations * 1e9 / (end - start),
+            sum / 1000.0 / iterations, lat[iterations / 2] / 1000.0,
+            lat[iterations * 99 / 100] / 1000.0);
+    g_print("                   poll hits %lu, misses %lu, window %lld ns\n",
+            stats.hits, stats.misses, (long long)stats.window_ns);
+
+    aio_set_fd_handler(vq.ctx, vq.kick_fd, NULL, NULL, NULL, NULL);
+    close(vq.kick_fd);
+    g_free(lat);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    int64_t poll_max_ns = argc > 2 ? atoll(argv[2]) : 32768;
+
+    run(iterations, 0);
+    run(iterations, poll_max_ns);
+    return 0;
+}
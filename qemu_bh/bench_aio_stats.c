@@ -0,0 +1,128 @@
+/*
+ * Event loop instrumentation benchmark
+ *
+ * Runs BH and fd handler callbacks through aio_poll() with the
+ * instrumentation disabled and enabled, reports the cost per callback of
+ * each, and dumps the resulting snapshot as JSON.
+ *
+ * Usage: bench_aio_stats [iterations] [json-file]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "async.h"
+#include "aio_stats.h"
+
+static unsigned long runs;
+
+static void bh_cb(void *opaque)
+{
+    runs++;
+}
+
+static void oneshot_cb(void *opaque)
+{
+    runs++;
+}
+
+static void fd_read(void *opaque)
+{
+    int *fd = opaque;
+    uint64_t value;
+
+    if (read(*fd, &value, sizeof(value)) == sizeof(value)) {
+        runs++;
+    }
+}
+
+static double bench_bh(AioContext *ctx, QEMUBH *bh, int iterations)
+{
+    long long start = get_clock();
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        qemu_bh_schedule(bh);
+        aio_bh_schedule_oneshot(ctx, oneshot_cb, NULL);
+        aio_poll(ctx, false);
+    }
+    return (double)(get_clock() - start) / (2 * iterations);
+}
+
+static double bench_fd(AioContext *ctx, int fd, int iterations)
+{
+    uint64_t value = 1;
+    long long start = get_clock();
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        if (write(fd, &value, sizeof(value)) != sizeof(value)) {
+            perror("write");
+            abort();
+        }
+        aio_poll(ctx, false);
+    }
+    return (double)(get_clock() - start) / iterations;
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+    const char *json = argc > 2 ? argv[2] : NULL;
+    AioContext *ctx = aio_context_new_fdmon(AIO_FDMON_EPOLL);
+    QEMUBH *bh = aio_bh_new(ctx, bh_cb, NULL);
+    int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    AioStatsSnapshot *snap;
+    double off, on;
+    int i;
+
+    qemu_set_current_aio_context(ctx);
+    aio_set_fd_handler(ctx, fd, fd_read, NULL, NULL, &fd);
+
+    off = bench_bh(ctx, bh, iterations);
+    aio_context_set_stats_enabled(ctx, true);
+    on = bench_bh(ctx, bh, iterations);
+    aio_context_set_stats_enabled(ctx, false);
+    g_print("BH:         %7.1f ns/callback disabled, %7.1f ns enabled\n",
+            off, on);
+
+    off = bench_fd(ctx, fd, iterations);
+    aio_context_set_stats_enabled(ctx, true);
+    on = bench_fd(ctx, fd, iterations);
+    aio_context_set_stats_enabled(ctx, false);
+    g_print("fd handler: %7.1f ns/callback disabled, %7.1f ns enabled\n",
+            off, on);
+
+    snap = aio_stats_snapshot(ctx);
+    for (i = 0; i < snap->nr_entries; i++) {
+        AioCallbackStats *e = &snap->entries[i];
+
+        g_print("%-7s fd %3d cb %p: %8llu calls, avg %6.1f ns, "
+                "p99 %6lld ns, max %8llu ns, latency p50 %6lld ns "
+                "p99 %6lld ns\n",
+                e->kind == AIO_STATS_BH ? "bh" : "handler", e->fd, e->cb,
+                (unsigned long long)e->count,
+                (double)e->total_ns / e->count,
+                (long long)aio_histogram_percentile(&e->run_ns, 99),
+                (unsigned long long)e->max_ns,
+                (long long)aio_histogram_percentile(&e->latency_ns, 50),
+                (long long)aio_histogram_percentile(&e->latency_ns, 99));
+    }
+    if (json) {
+        FILE *f = fopen(json, "w");
+
+        if (f) {
+            aio_stats_dump_json(snap, f);
+            fclose(f);
+        }
+    }
+    aio_stats_snapshot_free(snap);
+
+    aio_set_fd_handler(ctx, fd, NULL, NULL, NULL, NULL);
+    close(fd);
+    qemu_bh_delete(bh);
+    aio_poll(ctx, false);
+    aio_context_unref(ctx);
+    return 0;
+}
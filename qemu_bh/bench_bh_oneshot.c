@@ -0,0 +1,139 @@
+/*
+ * One-shot bottom half throughput benchmark
+ *
+ * Producer threads fire aio_bh_schedule_oneshot() as fast as they can, with
+ * a bounded number of BHs in flight each, while the main thread runs
+ * aio_bh_poll().  Build it as bench_bh_oneshot (QEMUBH pool) and
+ * bench_bh_oneshot_nopool (-DCONFIG_NO_BH_POOL, plain g_new/g_free) to
+ * compare the two allocators.
+ *
+ * Usage: bench_bh_oneshot [producers] [inflight-per-producer] [seconds]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include "atomic.h"
+#include "async.h"
+
+typedef struct {
+    pthread_t tid;
+    AioContext *ctx;
+    int inflight;
+    int max_inflight;
+    unsigned long fired;
+} Producer;
+
+static int stop;
+static unsigned long bh_runs;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void oneshot_cb(void *opaque)
+{
+    Producer *p = opaque;
+
+    bh_runs++;
+    atomic_dec(&p->inflight);
+}
+
+static void *producer_thread(void *opaque)
+{
+    Producer *p = opaque;
+    unsigned long n = 0;
+
+    while (!atomic_read(&stop)) {
+        if (atomic_read(&p->inflight) >= p->max_inflight) {
+            sched_yield();
+            continue;
+        }
+        atomic_inc(&p->inflight);
+        aio_bh_schedule_oneshot(p->ctx, oneshot_cb, p);
+        n++;
+    }
+    p->fired = n;
+    return NULL;
+}
+
+static void oneshot_self_cb(void *opaque)
+{
+    bh_runs++;
+}
+
+int main(int argc, char *argv[])
+{
+    int nr_producers = argc > 1 ? atoi(argv[1]) : 4;
+    int max_inflight = argc > 2 ? atoi(argv[2]) : 256;
+    int seconds = argc > 3 ? atoi(argv[3]) : 2;
+    AioContext *ctx;
+    Producer *producers;
+    BHPoolStats stats;
+    unsigned long fired = 0, i;
+    long long start, end;
+    int j;
+
+    ctx = aio_context_new();
+    if (!ctx) {
+        return 1;
+    }
+
+    /* Same-thread producer: the event loop schedules its own one-shots */
+    start = now_ns();
+    for (i = 0; i < 1000000; i++) {
+        aio_bh_schedule_oneshot(ctx, oneshot_self_cb, NULL);
+        if ((i & 63) == 63) {
+            aio_bh_poll(ctx);
+        }
+    }
+    aio_bh_poll(ctx);
+    end = now_ns();
+    aio_bh_pool_stats(ctx, &stats);
+    g_print("same thread: %lu oneshots, %.1f ns/oneshot, "
+            "thread cache hit rate %.1f%%\n",
+            bh_runs, (double)(end - start) / bh_runs,
+            stats.allocs ? stats.hits * 100.0 / stats.allocs : 0.0);
+
+    /* Cross-thread producers */
+    bh_runs = 0;
+    producers = g_new0(Producer, nr_producers);
+    start = now_ns();
+    for (j = 0; j < nr_producers; j++) {
+        producers[j].ctx = ctx;
+        producers[j].max_inflight = max_inflight;
+        pthread_create(&producers[j].tid, NULL, producer_thread, &producers[j]);
+    }
+
+    end = start + seconds * 1000000000LL;
+    while (now_ns() < end) {
+        aio_bh_poll(ctx);
+    }
+
+    atomic_set(&stop, 1);
+    for (j = 0; j < nr_producers; j++) {
+        pthread_join(producers[j].tid, NULL);
+        fired += producers[j].fired;
+    }
+    aio_bh_poll(ctx);
+    end = now_ns();
+
+    aio_bh_pool_stats(ctx, &stats);
+    g_print("%d producers: %lu oneshots (%.0f/s)\n",
+            nr_producers, fired, fired * 1e9 / (end - start));
+    g_print("pool: refills %lu, misses %lu, recycled %lu, released %lu, "
+            "context hit rate %.1f%%\n",
+            stats.refills, stats.misses, stats.recycled, stats.released,
+            stats.recycled + stats.released ?
+            100.0 - stats.misses * 100.0 / (stats.recycled + stats.released) :
+            0.0);
+
+    g_free(producers);
+    return 0;
+}
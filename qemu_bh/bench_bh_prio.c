@@ -0,0 +1,197 @@
+/*
+ * Bottom half priority and budget benchmark
+ *
+ * The main thread runs aio_poll() while a set of bulk BHs keep it busy:
+ * each burns a couple of microseconds and reschedules itself, like
+ * housekeeping work that always has more to do.  Meanwhile a producer
+ * thread periodically schedules a oneshot "completion" BH and writes to an
+ * eventfd, and the latency from scheduling to the callback is recorded for
+ * both.  This is repeated with and without priority classes (completions
+ * high, bulk low) and with and without a per-iteration BH budget.
+ *
+ * Usage: bench_bh_prio [bulk BHs] [seconds] [budget us]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "atomic.h"
+#include "async.h"
+
+#define BULK_WORK_NS    2000
+#define PRODUCE_NS      50000
+#define MAX_SAMPLES     (1 << 20)
+
+typedef struct {
+    int64_t *ns;
+    int nr;
+} Samples;
+
+static AioContext *ctx;
+static bool stop;
+static unsigned long bulk_runs;
+static Samples bh_lat, fd_lat;
+static int efd;
+static int64_t fd_sent_ns;
+
+static void sample_add(Samples *s, int64_t ns)
+{
+    if (s->nr < MAX_SAMPLES) {
+        s->ns[s->nr++] = ns;
+    }
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int64_t sample_pct(Samples *s, double pct)
+{
+    int i = s->nr * pct / 100;
+
+    return s->nr ? s->ns[i < s->nr ? i : s->nr - 1] : 0;
+}
+
+static void bulk_cb(void *opaque)
+{
+    QEMUBH *bh = *(QEMUBH **)opaque;
+    int64_t end = get_clock() + BULK_WORK_NS;
+
+    while (get_clock() < end) {
+        /* housekeeping */
+    }
+    bulk_runs++;
+    if (!atomic_read(&stop)) {
+        qemu_bh_schedule(bh);
+    }
+}
+
+/* The opaque is the time the BH was scheduled */
+static void completion_cb(void *opaque)
+{
+    sample_add(&bh_lat, get_clock() - (int64_t)(uintptr_t)opaque);
+}
+
+static void fd_read(void *opaque)
+{
+    uint64_t value;
+
+    if (read(efd, &value, sizeof(value)) == sizeof(value)) {
+        sample_add(&fd_lat, get_clock() - atomic_read(&fd_sent_ns));
+        atomic_set(&fd_sent_ns, 0);
+    }
+}
+
+static void *producer_thread(void *opaque)
+{
+    QEMUBHPriority prio = (QEMUBHPriority)(uintptr_t)opaque;
+    struct timespec ts = { 0, PRODUCE_NS };
+    uint64_t value = 1;
+
+    while (!atomic_read(&stop)) {
+        int64_t now = get_clock();
+
+        aio_bh_schedule_oneshot_prio(ctx, completion_cb,
+                                     (void *)(uintptr_t)now, prio);
+
+        /* One write at a time, so that its latency is well defined */
+        if (!atomic_read(&fd_sent_ns)) {
+            atomic_set(&fd_sent_ns, now);
+            if (write(efd, &value, sizeof(value)) != sizeof(value)) {
+                abort();
+            }
+        }
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+static void print_samples(const char *what, Samples *s)
+{
+    qsort(s->ns, s->nr, sizeof(int64_t), cmp_int64);
+    g_print("  %-10s %7d samples, p50 %7.1f us, p99 %7.1f us, "
+            "p99.9 %7.1f us, max %7.1f us\n", what, s->nr,
+            sample_pct(s, 50) / 1e3, sample_pct(s, 99) / 1e3,
+            sample_pct(s, 99.9) / 1e3,
+            s->nr ? s->ns[s->nr - 1] / 1e3 : 0.0);
+}
+
+static void run(int nr_bulk, double seconds, bool prio, int64_t budget_ns)
+{
+    QEMUBH **bulk = g_new(QEMUBH *, nr_bulk);
+    pthread_t producer;
+    int64_t start, deadline;
+    int i;
+
+    ctx = aio_context_new();
+    aio_context_set_bh_budget(ctx, 0, budget_ns);
+    efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    aio_set_fd_handler(ctx, efd, fd_read, NULL, NULL, NULL);
+
+    atomic_set(&stop, false);
+    bulk_runs = 0;
+    bh_lat.nr = fd_lat.nr = 0;
+    fd_sent_ns = 0;
+
+    for (i = 0; i < nr_bulk; i++) {
+        bulk[i] = aio_bh_new_prio(ctx, bulk_cb, &bulk[i],
+                                  prio ? QEMU_BH_PRIO_LOW
+                                       : QEMU_BH_PRIO_NORMAL);
+        qemu_bh_schedule(bulk[i]);
+    }
+    pthread_create(&producer, NULL, producer_thread,
+                   (void *)(uintptr_t)(prio ? QEMU_BH_PRIO_HIGH
+                                            : QEMU_BH_PRIO_NORMAL));
+
+    start = get_clock();
+    deadline = start + seconds * 1e9;
+    while (get_clock() < deadline) {
+        aio_poll(ctx, true);
+    }
+
+    atomic_set(&stop, true);
+    pthread_join(producer, NULL);
+    for (i = 0; i < nr_bulk; i++) {
+        qemu_bh_delete(bulk[i]);
+    }
+    aio_poll(ctx, false);
+    aio_poll(ctx, false);
+
+    g_print("%s, budget %s: %.0f bulk callbacks/s\n",
+            prio ? "priorities" : "no priorities",
+            budget_ns ? "on" : "off", bulk_runs * 1e9 / (get_clock() - start));
+    print_samples("completion", &bh_lat);
+    print_samples("fd", &fd_lat);
+
+    aio_set_fd_handler(ctx, efd, NULL, NULL, NULL, NULL);
+    close(efd);
+    aio_context_unref(ctx);
+    g_free(bulk);
+}
+
+int main(int argc, char *argv[])
+{
+    int nr_bulk = argc > 1 ? atoi(argv[1]) : 512;
+    double seconds = argc > 2 ? atof(argv[2]) : 2;
+    int64_t budget_ns = (argc > 3 ? atoi(argv[3]) : 100) * SCALE_US;
+
+    bh_lat.ns = g_new(int64_t, MAX_SAMPLES);
+    fd_lat.ns = g_new(int64_t, MAX_SAMPLES);
+
+    g_print("%d bulk BHs of %d us each, budget %lld us\n", nr_bulk,
+            BULK_WORK_NS / 1000, (long long)budget_ns / 1000);
+    run(nr_bulk, seconds, false, 0);
+    run(nr_bulk, seconds, true, 0);
+    run(nr_bulk, seconds, false, budget_ns);
+    run(nr_bulk, seconds, true, budget_ns);
+
+    g_free(bh_lat.ns);
+    g_free(fd_lat.ns);
+    return 0;
+}
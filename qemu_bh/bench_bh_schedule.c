@@ -0,0 +1,138 @@
+/*
+ * Bottom half scheduling microbenchmark
+ *
+ * N producer threads keep scheduling their own BHs on one AioContext while
+ * the main thread runs aio_bh_poll() in a loop.  A configurable number of
+ * registered but never scheduled BHs shows that the cost of aio_bh_poll()
+ * depends on the scheduled BHs only.
+ *
+ * Usage: bench_bh_schedule [producers] [bhs-per-producer] [idle-bhs] [seconds]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include "atomic.h"
+#include "async.h"
+
+typedef struct {
+    pthread_t tid;
+    QEMUBH **bhs;
+    int nr_bhs;
+    unsigned long scheduled;
+} Producer;
+
+static int stop;
+static unsigned long bh_runs;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void bench_cb(void *opaque)
+{
+    bh_runs++;
+}
+
+static void idle_cb(void *opaque)
+{
+    abort();
+}
+
+static void *producer_thread(void *opaque)
+{
+    Producer *p = opaque;
+    unsigned long n = 0;
+    int i = 0;
+
+    while (!atomic_read(&stop)) {
+        qemu_bh_schedule(p->bhs[i]);
+        if (++i == p->nr_bhs) {
+            i = 0;
+        }
+        n++;
+    }
+    p->scheduled = n;
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int nr_producers = argc > 1 ? atoi(argv[1]) : 4;
+    int nr_bhs = argc > 2 ? atoi(argv[2]) : 16;
+    int nr_idle = argc > 3 ? atoi(argv[3]) : 4096;
+    int seconds = argc > 4 ? atoi(argv[4]) : 2;
+    AioContext *ctx;
+    Producer *producers;
+    QEMUBH **idle_bhs;
+    unsigned long polls = 0, scheduled = 0;
+    long long start, end;
+    int i, j;
+
+    ctx = aio_context_new();
+    if (!ctx) {
+        return 1;
+    }
+
+    idle_bhs = g_new(QEMUBH *, nr_idle);
+    for (i = 0; i < nr_idle; i++) {
+        idle_bhs[i] = aio_bh_new(ctx, idle_cb, NULL);
+    }
+
+    producers = g_new0(Producer, nr_producers);
+    for (i = 0; i < nr_producers; i++) {
+        producers[i].nr_bhs = nr_bhs;
+        producers[i].bhs = g_new(QEMUBH *, nr_bhs);
+        for (j = 0; j < nr_bhs; j++) {
+            producers[i].bhs[j] = aio_bh_new(ctx, bench_cb, NULL);
+        }
+    }
+
+    start = now_ns();
+    for (i = 0; i < nr_producers; i++) {
+        pthread_create(&producers[i].tid, NULL, producer_thread, &producers[i]);
+    }
+
+    end = start + seconds * 1000000000LL;
+    while (now_ns() < end) {
+        aio_bh_poll(ctx);
+        polls++;
+    }
+
+    atomic_set(&stop, 1);
+    for (i = 0; i < nr_producers; i++) {
+        pthread_join(producers[i].tid, NULL);
+        scheduled += producers[i].scheduled;
+    }
+    /* Drain what the producers left behind */
+    aio_bh_poll(ctx);
+    end = now_ns();
+
+    g_print("producers %d, bhs/producer %d, idle bhs %d\n",
+            nr_producers, nr_bhs, nr_idle);
+    g_print("qemu_bh_schedule calls: %lu (%.0f/s)\n",
+            scheduled, scheduled * 1e9 / (end - start));
+    g_print("callbacks run:          %lu (%.0f/s)\n",
+            bh_runs, bh_runs * 1e9 / (end - start));
+    g_print("aio_bh_poll calls:      %lu (%.1f ns/call)\n",
+            polls, (double)(end - start) / polls);
+
+    for (i = 0; i < nr_producers; i++) {
+        for (j = 0; j < nr_bhs; j++) {
+            qemu_bh_delete(producers[i].bhs[j]);
+        }
+        g_free(producers[i].bhs);
+    }
+    for (i = 0; i < nr_idle; i++) {
+        qemu_bh_delete(idle_bhs[i]);
+    }
+    aio_bh_poll(ctx);
+    g_free(idle_bhs);
+    g_free(producers);
+    return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * aio_set_fd_handler() scalability benchmark
+ *
+ * Registers a handler on each of many fds, toggles every handler between
+ * read and write interest a few times, then removes them all, and reports
+ * the cost of each call.  Finding the handler to replace is a lookup in the
+ * context's fd table, so the cost should not depend on the number of fds.
+ *
+ * The poll monitor does not look at the fds until aio_poll() runs, so it
+ * is given plain fd numbers and is not limited by RLIMIT_NOFILE.  The epoll
+ * monitor needs open fds and gets dups of one eventfd, as many as the limit
+ * allows.
+ *
+ * Usage: bench_fd_handlers [fds] [toggle rounds]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include "async.h"
+
+static void bench_read(void *opaque)
+{
+}
+
+static void bench_write(void *opaque)
+{
+}
+
+/* This thread is the only reader of the context and is outside aio_poll,
+ * so it can free the replaced handlers itself.
+ */
+static void reclaim(AioContext *ctx)
+{
+    rcu_quiescent_state(&ctx->rcu);
+}
+
+static void run(AioFdMonitor fdmon, const char *name, int *fds, int nr_fds,
+                int rounds)
+{
+    AioContext *ctx = aio_context_new_fdmon(fdmon);
+    int64_t t0, t1, t2, t3;
+    int i, r;
+
+    t0 = get_clock();
+    for (i = 0; i < nr_fds; i++) {
+        aio_set_fd_handler(ctx, fds[i], bench_read, NULL, NULL, NULL);
+    }
+    t1 = get_clock();
+    reclaim(ctx);
+
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < nr_fds; i++) {
+            aio_set_fd_handler(ctx, fds[i], NULL, bench_write, NULL, NULL);
+        }
+        for (i = 0; i < nr_fds; i++) {
+            aio_set_fd_handler(ctx, fds[i], bench_read, NULL, NULL, NULL);
+        }
+        reclaim(ctx);
+    }
+    t2 = get_clock();
+
+    for (i = 0; i < nr_fds; i++) {
+        aio_set_fd_handler(ctx, fds[i], NULL, NULL, NULL, NULL);
+    }
+    t3 = get_clock();
+    reclaim(ctx);
+
+    g_print("%-8s %6d fds: register %7.1f ns, toggle %7.1f ns, "
+            "remove %7.1f ns per call, total %7.3f s\n",
+            name, nr_fds, (double)(t1 - t0) / nr_fds,
+            rounds ? (double)(t2 - t1) / (2 * rounds * nr_fds) : 0.0,
+            (double)(t3 - t2) / nr_fds, (t3 - t0) / 1e9);
+
+    aio_context_unref(ctx);
+}
+
+int main(int argc, char *argv[])
+{
+    int nr_fds = argc > 1 ? atoi(argv[1]) : 50000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 4;
+    int *fds = g_new(int, nr_fds);
+    struct rlimit rlim;
+    int efd, nr_open, i;
+
+    /* Above the fds that stdio and the contexts may be using */
+    for (i = 0; i < nr_fds; i++) {
+        fds[i] = 256 + i;
+    }
+    run(AIO_FDMON_POLL, "poll", fds, nr_fds, rounds);
+
+    getrlimit(RLIMIT_NOFILE, &rlim);
+    rlim.rlim_cur = rlim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rlim);
+
+    efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    for (nr_open = 0; nr_open < nr_fds; nr_open++) {
+        /* Leave some fds for the context itself */
+        if (nr_open + 64 >= rlim.rlim_cur ||
+            (fds[nr_open] = dup(efd)) < 0) {
+            break;
+        }
+    }
+    run(AIO_FDMON_EPOLL, "epoll", fds, nr_open, rounds);
+
+    for (i = 0; i < nr_open; i++) {
+        close(fds[i]);
+    }
+    close(efd);
+    g_free(fds);
+    return 0;
+}
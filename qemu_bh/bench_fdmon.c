@@ -0,0 +1,163 @@
+/*
+ * fd monitor latency/throughput benchmark
+ *
+ * Registers many idle eventfds and a few hot ones on an AioContext driven
+ * by aio_poll() in its own thread, then ping-pongs through the hot fds from
+ * the main thread.  Runs once per fd monitor: poll, epoll and io_uring.
+ *
+ * Usage: bench_fdmon [idle-fds] [hot-fds] [round-trips]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include "atomic.h"
+#include "async.h"
+
+typedef struct {
+    AioContext *ctx;
+    int reply_fd;
+    int stop;
+} Bench;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void idle_read(void *opaque)
+{
+    fprintf(stderr, "idle fd became ready\n");
+    abort();
+}
+
+static Bench bench;
+
+static void hot_read(void *opaque)
+{
+    int fd = (long)opaque;
+    uint64_t value;
+    ssize_t ret;
+
+    if (read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return;
+    }
+    value = 1;
+    ret = write(bench.reply_fd, &value, sizeof(value));
+    (void)ret;
+}
+
+static void *loop_thread(void *opaque)
+{
+    Bench *b = opaque;
+
+    while (!atomic_read(&b->stop)) {
+        aio_poll(b->ctx, true);
+    }
+    return NULL;
+}
+
+static void run(AioFdMonitor fdmon, const char *name,
+                int nr_idle, int nr_hot, int iterations)
+{
+    int *idle_fds = g_new(int, nr_idle);
+    int *hot_fds = g_new(int, nr_hot);
+    long long *lat = g_new(long long, iterations);
+    long long start, end, sum = 0;
+    pthread_t tid;
+    uint64_t value;
+    int i;
+
+    bench.ctx = aio_context_new_fdmon(fdmon);
+    bench.reply_fd = eventfd(0, EFD_CLOEXEC);
+    bench.stop = 0;
+
+    for (i = 0; i < nr_idle; i++) {
+        idle_fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        aio_set_fd_handler(bench.ctx, idle_fds[i], idle_read, NULL, NULL,
+                           NULL);
+    }
+    for (i = 0; i < nr_hot; i++) {
+        hot_fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        aio_set_fd_handler(bench.ctx, hot_fds[i], hot_read, NULL, NULL,
+                           (void *)(long)hot_fds[i]);
+    }
+
+    pthread_create(&tid, NULL, loop_thread, &bench);
+
+    start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        long long t0 = now_ns();
+
+        value = 1;
+        if (write(hot_fds[i % nr_hot], &value, sizeof(value)) < 0 ||
+            read(bench.reply_fd, &value, sizeof(value)) < 0) {
+            perror("ping-pong");
+            abort();
+        }
+        lat[i] = now_ns() - t0;
+        sum += lat[i];
+    }
+    end = now_ns();
+
+    atomic_set(&bench.stop, 1);
+    aio_notify(bench.ctx);
+    pthread_join(tid, NULL);
+
+    qsort(lat, iterations, sizeof(*lat), cmp_ll);
+    g_print("%-8s %6d idle %3d hot: %8.0f round-trips/s, "
+            "latency avg %6.1f us p50 %6.1f us p99 %6.1f us\n",
+            name, nr_idle, nr_hot, iterations * 1e9 / (end - start),
+            sum / 1000.0 / iterations, lat[iterations / 2] / 1000.0,
+            lat[iterations * 99 / 100] / 1000.0);
+
+    for (i = 0; i < nr_idle; i++) {
+        aio_set_fd_handler(bench.ctx, idle_fds[i], NULL, NULL, NULL, NULL);
+        close(idle_fds[i]);
+    }
+    for (i = 0; i < nr_hot; i++) {
+        aio_set_fd_handler(bench.ctx, hot_fds[i], NULL, NULL, NULL, NULL);
+        close(hot_fds[i]);
+    }
+    /* Let the fd monitor retire the removed handlers */
+    aio_poll(bench.ctx, false);
+    aio_poll(bench.ctx, false);
+    close(bench.reply_fd);
+
+    g_free(idle_fds);
+    g_free(hot_fds);
+    g_free(lat);
+}
+
+int main(int argc, char *argv[])
+{
+    int nr_idle = argc > 1 ? atoi(argv[1]) : 1000;
+    int nr_hot = argc > 2 ? atoi(argv[2]) : 4;
+    int iterations = argc > 3 ? atoi(argv[3]) : 100000;
+    struct rlimit rl;
+
+    /* Every run needs nr_idle + nr_hot fds on top of the context's own */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    run(AIO_FDMON_POLL, "poll", nr_idle, nr_hot, iterations);
+    run(AIO_FDMON_EPOLL, "epoll", nr_idle, nr_hot, iterations);
+    run(AIO_FDMON_IO_URING, "io_uring", nr_idle, nr_hot, iterations);
+    return 0;
+}
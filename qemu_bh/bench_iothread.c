@@ -0,0 +1,211 @@
+/*
+ * IOThread scaling benchmark
+ *
+ * Spreads a set of emulated devices across 1..N IOThreads.  Each device is
+ * an eventfd whose handler does some fixed amount of "emulation" work and
+ * kicks the eventfd again, so every device keeps its IOThread busy for the
+ * whole run.  Reports the aggregate event throughput for each number of
+ * IOThreads, then the cost of moving fd handlers and BHs between them.
+ *
+ * Usage: bench_iothread [max-threads] [devices] [work-ns] [seconds]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "atomic.h"
+#include "iothread.h"
+
+typedef struct {
+    AioContext *ctx;
+    int fd;
+    unsigned long events;
+} Device;
+
+static int64_t work_ns;
+static bool stop;
+
+static void device_read(void *opaque)
+{
+    Device *dev = opaque;
+    uint64_t value = 1;
+    int64_t end;
+
+    if (read(dev->fd, &value, sizeof(value)) != sizeof(value)) {
+        return;
+    }
+
+    end = get_clock() + work_ns;
+    while (get_clock() < end) {
+        /* emulate */
+    }
+    dev->events++;
+
+    if (!atomic_read(&stop) &&
+        write(dev->fd, &value, sizeof(value)) != sizeof(value)) {
+        perror("write");
+        abort();
+    }
+}
+
+static void device_attach_bh(void *opaque)
+{
+    Device *dev = opaque;
+
+    aio_set_fd_handler(dev->ctx, dev->fd, device_read, NULL, NULL, dev);
+}
+
+static void device_detach_bh(void *opaque)
+{
+    Device *dev = opaque;
+
+    aio_set_fd_handler(dev->ctx, dev->fd, NULL, NULL, NULL, NULL);
+}
+
+static void bench_scaling(int nr_threads, Device *devs, int nr_devs,
+                          double seconds, double *base)
+{
+    IOThreadPool *pool = iothread_pool_new("bench", nr_threads,
+                                           AIO_FDMON_EPOLL, true);
+    unsigned long total = 0;
+    uint64_t value = 1;
+    long long start, end;
+    double rate;
+    int i;
+
+    atomic_set(&stop, false);
+    for (i = 0; i < nr_devs; i++) {
+        devs[i].ctx = iothread_pool_next(pool);
+        devs[i].events = 0;
+        aio_wait_bh_oneshot(devs[i].ctx, device_attach_bh, &devs[i]);
+    }
+
+    start = get_clock();
+    for (i = 0; i < nr_devs; i++) {
+        if (write(devs[i].fd, &value, sizeof(value)) != sizeof(value)) {
+            perror("write");
+            abort();
+        }
+    }
+    usleep(seconds * 1000000);
+    atomic_set(&stop, true);
+    end = get_clock();
+
+    for (i = 0; i < nr_devs; i++) {
+        aio_wait_bh_oneshot(devs[i].ctx, device_detach_bh, &devs[i]);
+        total += devs[i].events;
+    }
+    iothread_pool_free(pool);
+
+    rate = total * 1e9 / (end - start);
+    if (!*base) {
+        *base = rate;
+    }
+    g_print("%2d iothreads: %10.0f events/s  speedup %5.2fx\n",
+            nr_threads, rate, rate / *base);
+}
+
+static void bh_cb(void *opaque)
+{
+    atomic_inc((int *)opaque);
+}
+
+static void noop_bh(void *opaque)
+{
+}
+
+/* Return once every BH pending in @ctx has run or been passed on: the
+ * second BH is only seen by an aio_bh_poll() that starts after the one
+ * which ran the first.
+ */
+static void drain_bhs(AioContext *ctx)
+{
+    aio_wait_bh_oneshot(ctx, noop_bh, NULL);
+    aio_wait_bh_oneshot(ctx, noop_bh, NULL);
+}
+
+static void bench_move(Device *devs, int nr_devs)
+{
+    IOThread *a = iothread_create("move-a", AIO_FDMON_EPOLL);
+    IOThread *b = iothread_create("move-b", AIO_FDMON_EPOLL);
+    AioContext *ctx_a = iothread_get_aio_context(a);
+    AioContext *ctx_b = iothread_get_aio_context(b);
+    int rounds = 1000, runs = 0;
+    QEMUBH *bh;
+    long long start;
+    int i;
+
+    for (i = 0; i < nr_devs; i++) {
+        devs[i].ctx = ctx_a;
+        aio_wait_bh_oneshot(ctx_a, device_attach_bh, &devs[i]);
+    }
+
+    start = get_clock();
+    for (i = 0; i < rounds; i++) {
+        Device *dev = &devs[i % nr_devs];
+        AioContext *to = dev->ctx == ctx_a ? ctx_b : ctx_a;
+
+        if (!aio_move_fd_handler(dev->ctx, to, dev->fd)) {
+            g_print("fd %d not found\n", dev->fd);
+            abort();
+        }
+        dev->ctx = to;
+    }
+    g_print("aio_move_fd_handler:     %7.2f us/move\n",
+            (get_clock() - start) / 1000.0 / rounds);
+
+    for (i = 0; i < nr_devs; i++) {
+        aio_wait_bh_oneshot(devs[i].ctx, device_detach_bh, &devs[i]);
+    }
+
+    /* Move a BH back and forth while it is being scheduled */
+    bh = aio_bh_new(ctx_a, bh_cb, &runs);
+    start = get_clock();
+    for (i = 0; i < rounds; i++) {
+        qemu_bh_schedule(bh);
+        qemu_bh_set_aio_context(bh, i & 1 ? ctx_a : ctx_b);
+    }
+    g_print("qemu_bh_set_aio_context: %7.2f us/move\n",
+            (get_clock() - start) / 1000.0 / rounds);
+    drain_bhs(ctx_b);
+    drain_bhs(ctx_a);
+    qemu_bh_delete(bh);
+
+    iothread_destroy(a);
+    iothread_destroy(b);
+    g_print("BH ran %d times for %d schedules\n", runs, rounds);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    int nr_devs = argc > 2 ? atoi(argv[2]) : 64;
+    double seconds = argc > 4 ? atof(argv[4]) : 1;
+    Device *devs = g_new0(Device, nr_devs);
+    double base = 0;
+    int i;
+
+    work_ns = argc > 3 ? atoll(argv[3]) : 2000;
+    if (max_threads < 2) {
+        max_threads = 2;
+    }
+
+    for (i = 0; i < nr_devs; i++) {
+        devs[i].fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    }
+
+    g_print("%d devices, %lld ns of work per event\n",
+            nr_devs, (long long)work_ns);
+    for (i = 1; i <= max_threads; i++) {
+        bench_scaling(i, devs, nr_devs, seconds, &base);
+    }
+
+    bench_move(devs, nr_devs);
+
+    for (i = 0; i < nr_devs; i++) {
+        close(devs[i].fd);
+    }
+    g_free(devs);
+    return 0;
+}
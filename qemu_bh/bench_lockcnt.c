@@ -0,0 +1,162 @@
+/*
+ * QemuLockCnt contention benchmark
+ *
+ * Reader threads repeatedly bracket a walk of a small shared list with
+ * qemu_lockcnt_inc/qemu_lockcnt_dec, the way aio_poll() walks the handler
+ * list, while a writer thread takes the lock every millisecond to modify
+ * it.  Built twice: bench_lockcnt uses the single-word lockcnt,
+ * bench_lockcnt_sharded the per-thread sharded one.
+ *
+ * Usage: bench_lockcnt [max-readers] [seconds]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "atomic.h"
+#include "aio.h"
+
+#define LIST_LEN 8
+
+typedef struct Node {
+    int value;
+    struct Node *next;
+} Node;
+
+static QemuLockCnt lockcnt __attribute__((aligned(64)));
+static Node *list_head;
+static bool stop;
+
+typedef struct {
+    unsigned long iterations;
+    unsigned long sum;
+} __attribute__((aligned(64))) ReaderStats;
+
+static void *reader_thread(void *opaque)
+{
+    ReaderStats *stats = opaque;
+    unsigned long sum = 0, n = 0;
+    Node *node;
+
+    while (!atomic_read(&stop)) {
+        qemu_lockcnt_inc(&lockcnt);
+        for (node = atomic_rcu_read(&list_head); node;
+             node = atomic_rcu_read(&node->next)) {
+            sum += node->value;
+        }
+        qemu_lockcnt_dec(&lockcnt);
+        n++;
+    }
+
+    stats->iterations = n;
+    stats->sum = sum;
+    return NULL;
+}
+
+/* Replaces the first node every millisecond.  Like aio_dispatch_handlers,
+ * old nodes are freed only when the writer manages to catch the count at
+ * zero, otherwise they wait for a later attempt.
+ */
+static void *writer_thread(void *opaque)
+{
+    unsigned long *updates = opaque;
+    Node *old, *new, *deleted = NULL;
+
+    while (!atomic_read(&stop)) {
+        usleep(1000);
+
+        new = g_new(Node, 1);
+        qemu_lockcnt_lock(&lockcnt);
+        old = list_head;
+        new->value = old->value + 1;
+        new->next = old->next;
+        atomic_rcu_set(&list_head, new);
+        qemu_lockcnt_unlock(&lockcnt);
+
+        /* Reuse next to chain the nodes waiting to be freed */
+        old->next = deleted;
+        deleted = old;
+
+        qemu_lockcnt_inc(&lockcnt);
+        if (qemu_lockcnt_dec_if_lock(&lockcnt)) {
+            while ((old = deleted)) {
+                deleted = old->next;
+                g_free(old);
+                (*updates)++;
+            }
+            qemu_lockcnt_inc_and_unlock(&lockcnt);
+        }
+        qemu_lockcnt_dec(&lockcnt);
+    }
+    return NULL;
+}
+
+static void run(int nr_readers, double seconds, double *base)
+{
+    ReaderStats *stats = g_new0(ReaderStats, nr_readers);
+    pthread_t *readers = g_new(pthread_t, nr_readers);
+    unsigned long total = 0, updates = 0;
+    pthread_t writer;
+    long long start, end;
+    double rate;
+    int i;
+
+    atomic_set(&stop, false);
+    start = get_clock();
+    for (i = 0; i < nr_readers; i++) {
+        pthread_create(&readers[i], NULL, reader_thread, &stats[i]);
+    }
+    pthread_create(&writer, NULL, writer_thread, &updates);
+
+    usleep(seconds * 1000000);
+    atomic_set(&stop, true);
+
+    for (i = 0; i < nr_readers; i++) {
+        pthread_join(readers[i], NULL);
+        total += stats[i].iterations;
+    }
+    pthread_join(writer, NULL);
+    end = get_clock();
+
+    rate = total * 1e3 / (end - start);
+    if (!*base) {
+        *base = rate;
+    }
+    g_print("%2d readers: %8.2f Mwalks/s (%6.2f per reader, %4.2fx), "
+            "%lu nodes freed\n", nr_readers, rate, rate / nr_readers,
+            rate / *base, updates);
+
+    g_free(readers);
+    g_free(stats);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_readers = argc > 1 ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    double seconds = argc > 2 ? atof(argv[2]) : 1;
+    double base = 0;
+    int i;
+
+    qemu_lockcnt_init(&lockcnt);
+    for (i = 0; i < LIST_LEN; i++) {
+        Node *node = g_new(Node, 1);
+
+        node->value = i;
+        node->next = list_head;
+        list_head = node;
+    }
+
+#ifdef CONFIG_SHARDED_LOCKCNT
+    g_print("sharded lockcnt (%d shards)\n", QEMU_LOCKCNT_SHARDS);
+#else
+    g_print("single-word lockcnt\n");
+#endif
+    for (i = 1; i <= max_readers; i *= 2) {
+        run(i, seconds, &base);
+        if (i < max_readers && i * 2 > max_readers) {
+            run(max_readers, seconds, &base);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * QemuLockCnt hand-off latency benchmark
+ *
+ * A few threads take turns holding the lock of a QemuLockCnt for a short
+ * while, like the sweep of a list by a writer, then do some work outside
+ * it.  Whenever a thread had to wait for the lock, the time from the
+ * previous owner's unlock to its own return from qemu_lockcnt_lock is
+ * recorded.  Run once parking right away and once with spin-then-park.
+ *
+ * Usage: bench_lockcnt_handoff [threads] [seconds] [hold ns] [work ns]
+ *                              [max spins]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "atomic.h"
+#include "aio.h"
+#include "futex.h"
+
+#define MAX_SAMPLES     (1 << 20)
+
+static QemuLockCnt lockcnt __attribute__((aligned(64)));
+static int64_t release_ns __attribute__((aligned(64)));
+static bool stop;
+static int64_t hold_ns, work_ns;
+
+typedef struct {
+    int64_t *ns;
+    int nr;
+    unsigned long acquired;
+} __attribute__((aligned(64))) ThreadSamples;
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void busy_wait(int64_t ns)
+{
+    int64_t end = get_clock() + ns;
+
+    while (get_clock() < end) {
+        /* work */
+    }
+}
+
+static void *lock_thread(void *opaque)
+{
+    ThreadSamples *s = opaque;
+
+    while (!atomic_read(&stop)) {
+        int64_t start = get_clock(), now, released;
+
+        qemu_lockcnt_lock(&lockcnt);
+        now = get_clock();
+
+        /* Only count acquisitions that waited for an unlock */
+        released = atomic_read(&release_ns);
+        if (released > start && s->nr < MAX_SAMPLES) {
+            s->ns[s->nr++] = now - released;
+        }
+        s->acquired++;
+
+        busy_wait(hold_ns);
+        atomic_set(&release_ns, get_clock());
+        qemu_lockcnt_unlock(&lockcnt);
+
+        busy_wait(work_ns);
+    }
+    return NULL;
+}
+
+static void run(int nr_threads, double seconds, unsigned max_spins)
+{
+    ThreadSamples *samples = g_new0(ThreadSamples, nr_threads);
+    pthread_t *threads = g_new(pthread_t, nr_threads);
+    unsigned long acquired = 0;
+    int64_t *all, start, end;
+    int i, n = 0;
+
+    qemu_lockcnt_init(&lockcnt);
+    qemu_lockcnt_set_spin(&lockcnt, max_spins);
+    atomic_set(&stop, false);
+    release_ns = 0;
+
+    start = get_clock();
+    for (i = 0; i < nr_threads; i++) {
+        samples[i].ns = g_new(int64_t, MAX_SAMPLES);
+        pthread_create(&threads[i], NULL, lock_thread, &samples[i]);
+    }
+    usleep(seconds * 1000000);
+    atomic_set(&stop, true);
+    for (i = 0; i < nr_threads; i++) {
+        pthread_join(threads[i], NULL);
+        n += samples[i].nr;
+        acquired += samples[i].acquired;
+    }
+    end = get_clock();
+
+    all = g_new(int64_t, n ? n : 1);
+    for (i = 0, n = 0; i < nr_threads; i++) {
+        memcpy(all + n, samples[i].ns, samples[i].nr * sizeof(int64_t));
+        n += samples[i].nr;
+        g_free(samples[i].ns);
+    }
+    qsort(all, n, sizeof(int64_t), cmp_int64);
+
+    g_print("%-14s %6.2f Mlocks/s, %8d hand-offs, p50 %7.2f us, "
+            "p99 %7.2f us, p99.9 %8.2f us\n",
+            max_spins ? "spin-then-park" : "park",
+            acquired * 1e3 / (end - start), n,
+            n ? all[n / 2] / 1e3 : 0.0,
+            n ? all[(int64_t)n * 99 / 100] / 1e3 : 0.0,
+            n ? all[(int64_t)n * 999 / 1000] / 1e3 : 0.0);
+
+    qemu_lockcnt_destroy(&lockcnt);
+    g_free(all);
+    g_free(threads);
+    g_free(samples);
+}
+
+int main(int argc, char *argv[])
+{
+    int nr_threads = argc > 1 ? atoi(argv[1]) :
+                     MAX(sysconf(_SC_NPROCESSORS_ONLN), 2);
+    double seconds = argc > 2 ? atof(argv[2]) : 1;
+    unsigned max_spins = argc > 5 ? atoi(argv[5]) : 1000;
+
+    hold_ns = argc > 3 ? atoi(argv[3]) : 1000;
+    work_ns = argc > 4 ? atoi(argv[4]) : 1000;
+
+    g_print("%d threads, lock held %lld ns, %lld ns outside, futex %s\n",
+            nr_threads, (long long)hold_ns, (long long)work_ns,
+#ifdef CONFIG_FUTEX_WAITV
+            "futex_waitv"
+#else
+            "FUTEX_WAIT"
+#endif
+            );
+    run(nr_threads, seconds, 0);
+    run(nr_threads, seconds, max_spins);
+    return 0;
+}
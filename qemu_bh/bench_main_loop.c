@@ -0,0 +1,153 @@
+/*
+ * Main loop benchmark: native aio_poll() against the glib adaptor
+ *
+ * With 1, 100 and 1000 fd handlers registered on the main AioContext,
+ * measures for each main loop mode:
+ *  - iterations per second while a BH keeps rescheduling itself, so that
+ *    main_loop_wait() never blocks and only the loop's own overhead counts;
+ *  - the wake-up latency of a blocked main loop, from the write to one of
+ *    the eventfds by another thread to its read handler.
+ *
+ * Usage: bench_main_loop [seconds] [wakeups]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "atomic.h"
+#include "main_loop.h"
+
+static bool stop;
+static unsigned long bh_runs;
+static int64_t write_ns;
+static int64_t *wake_lat;
+static int nr_wakeups, nr_woken;
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void busy_bh_cb(void *opaque)
+{
+    QEMUBH *bh = *(QEMUBH **)opaque;
+
+    bh_runs++;
+    if (!stop) {
+        qemu_bh_schedule(bh);
+    }
+}
+
+static void fd_read(void *opaque)
+{
+    int *fd = opaque;
+    uint64_t value;
+
+    if (read(*fd, &value, sizeof(value)) != sizeof(value)) {
+        return;
+    }
+    if (nr_woken < nr_wakeups) {
+        wake_lat[nr_woken++] = get_clock() - atomic_read(&write_ns);
+    }
+    atomic_set(&write_ns, 0);
+}
+
+/* One write at a time, each after the previous one has been handled */
+static void *writer_thread(void *opaque)
+{
+    int fd = *(int *)opaque;
+    uint64_t value = 1;
+    int i;
+
+    for (i = 0; i < nr_wakeups; i++) {
+        while (atomic_read(&write_ns)) {
+            usleep(10);
+        }
+        usleep(50);
+        atomic_set(&write_ns, get_clock());
+        if (write(fd, &value, sizeof(value)) != sizeof(value)) {
+            abort();
+        }
+    }
+    return NULL;
+}
+
+static void run(MainLoopMode mode, int nr_handlers, double seconds)
+{
+    int *fds = g_new(int, nr_handlers);
+    QEMUBH *bh;
+    pthread_t writer;
+    int64_t start, end;
+    unsigned long iterations = 0;
+    int i;
+
+    if (qemu_init_main_loop(mode) < 0) {
+        exit(1);
+    }
+    for (i = 0; i < nr_handlers; i++) {
+        fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        qemu_set_fd_handler(fds[i], fd_read, NULL, &fds[i]);
+    }
+    /* Let the fd monitor settle the registrations */
+    main_loop_wait(true);
+
+    stop = false;
+    bh_runs = 0;
+    bh = qemu_bh_new(busy_bh_cb, &bh);
+    qemu_bh_schedule(bh);
+    start = get_clock();
+    do {
+        main_loop_wait(false);
+        iterations++;
+    } while (get_clock() - start < seconds * 1e9);
+    end = get_clock();
+    stop = true;
+    main_loop_wait(true);
+    qemu_bh_delete(bh);
+
+    nr_woken = 0;
+    write_ns = 0;
+    pthread_create(&writer, NULL, writer_thread, &fds[nr_handlers - 1]);
+    while (nr_woken < nr_wakeups) {
+        main_loop_wait(false);
+    }
+    pthread_join(writer, NULL);
+    qsort(wake_lat, nr_woken, sizeof(int64_t), cmp_int64);
+
+    g_print("%-6s %4d handlers: %8.0f iterations/s, wake-up p50 %6.1f us "
+            "p99 %6.1f us p99.9 %6.1f us\n",
+            mode == MAIN_LOOP_NATIVE ? "native" : "glib", nr_handlers,
+            iterations * 1e9 / (end - start),
+            wake_lat[nr_woken / 2] / 1e3,
+            wake_lat[nr_woken * 99 / 100] / 1e3,
+            wake_lat[nr_woken * 999 / 1000] / 1e3);
+
+    for (i = 0; i < nr_handlers; i++) {
+        qemu_set_fd_handler(fds[i], NULL, NULL, NULL);
+        close(fds[i]);
+    }
+    qemu_cleanup_main_loop();
+    g_free(fds);
+}
+
+int main(int argc, char *argv[])
+{
+    static const int handlers[] = { 1, 100, 1000 };
+    double seconds = argc > 1 ? atof(argv[1]) : 1;
+    int i;
+
+    nr_wakeups = argc > 2 ? atoi(argv[2]) : 5000;
+    wake_lat = g_new(int64_t, nr_wakeups);
+
+    for (i = 0; i < G_N_ELEMENTS(handlers); i++) {
+        run(MAIN_LOOP_NATIVE, handlers[i], seconds);
+        run(MAIN_LOOP_GLIB, handlers[i], seconds);
+    }
+
+    g_free(wake_lat);
+    return 0;
+}
@@ -0,0 +1,141 @@
+/*
+ * Thread pool benchmark
+ *
+ * For a growing number of workers, measures:
+ *  - the latency from thread_pool_submit_aio() to the completion callback
+ *    of an empty job, with one job in flight at a time;
+ *  - the throughput with many jobs in flight, each burning some CPU time
+ *    and resubmitted by its completion, and how many completions each run
+ *    of the completion BH delivers.
+ *
+ * Usage: bench_thread_pool [max workers] [seconds] [job us] [jobs in flight]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "atomic.h"
+#include "thread_pool.h"
+
+#define LATENCY_SAMPLES 20000
+
+static AioContext *ctx;
+static int64_t job_ns;
+static bool stop;
+static int inflight;
+static unsigned long completed;
+static int64_t submit_ns;
+static bool done;
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int empty_job(void *arg)
+{
+    return 0;
+}
+
+static void latency_cb(void *arg, int ret)
+{
+    *(int64_t *)arg = get_clock() - submit_ns;
+    done = true;
+}
+
+static int busy_job(void *arg)
+{
+    int64_t end = get_clock() + job_ns;
+
+    while (get_clock() < end) {
+        /* work */
+    }
+    return 0;
+}
+
+static void busy_cb(void *arg, int ret)
+{
+    completed++;
+    if (!stop) {
+        thread_pool_submit_aio(ctx, busy_job, NULL, busy_cb);
+    } else {
+        inflight--;
+    }
+}
+
+static void run(int nr_workers, double seconds, int depth)
+{
+    int64_t *lat = g_new(int64_t, LATENCY_SAMPLES);
+    ThreadPoolStats stats;
+    int64_t start, end;
+    int i;
+
+    ctx = aio_context_new();
+    qemu_set_current_aio_context(ctx);
+    aio_context_set_thread_pool_size(ctx, nr_workers);
+
+    for (i = 0; i < LATENCY_SAMPLES; i++) {
+        done = false;
+        submit_ns = get_clock();
+        thread_pool_submit_aio(ctx, empty_job, &lat[i], latency_cb);
+        while (!done) {
+            aio_poll(ctx, true);
+        }
+    }
+    qsort(lat, LATENCY_SAMPLES, sizeof(int64_t), cmp_int64);
+
+    stop = false;
+    completed = 0;
+    inflight = depth;
+    thread_pool_get_stats(aio_get_thread_pool(ctx), &stats);
+    start = get_clock();
+    for (i = 0; i < depth; i++) {
+        thread_pool_submit_aio(ctx, busy_job, NULL, busy_cb);
+    }
+    while (get_clock() - start < seconds * 1e9) {
+        aio_poll(ctx, true);
+    }
+    end = get_clock();
+    stop = true;
+    while (inflight) {
+        aio_poll(ctx, true);
+    }
+
+    {
+        unsigned long batches = stats.batches, steals = stats.steals;
+        unsigned long wakeups = stats.wakeups;
+
+        thread_pool_get_stats(aio_get_thread_pool(ctx), &stats);
+        batches = stats.batches - batches;
+        g_print("%2d workers: latency p50 %6.1f us p99 %6.1f us, "
+                "%8.0f jobs/s, %5.1f completions/BH, %7lu steals, "
+                "%7lu wakeups\n",
+                nr_workers, lat[LATENCY_SAMPLES / 2] / 1e3,
+                lat[LATENCY_SAMPLES * 99 / 100] / 1e3,
+                completed * 1e9 / (end - start),
+                batches ? (double)completed / batches : 0.0,
+                stats.steals - steals, stats.wakeups - wakeups);
+    }
+
+    qemu_set_current_aio_context(NULL);
+    aio_context_unref(ctx);
+    g_free(lat);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_workers = argc > 1 ? atoi(argv[1]) : 8;
+    double seconds = argc > 2 ? atof(argv[2]) : 1;
+    int depth = argc > 4 ? atoi(argv[4]) : 256;
+    int n;
+
+    job_ns = (argc > 3 ? atof(argv[3]) : 10) * SCALE_US;
+
+    g_print("%d jobs of %lld us in flight\n", depth,
+            (long long)job_ns / SCALE_US);
+    for (n = 1; n <= max_workers; n *= 2) {
+        run(n, seconds, depth);
+    }
+    return 0;
+}
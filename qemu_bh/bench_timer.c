@@ -0,0 +1,179 @@
+/*
+ * Timer list benchmark
+ *
+ * Arms 100k timers on an AioContext and measures the cost of arming,
+ * re-arming, cancelling and expiring them, then fires a periodic timer
+ * with that many timers still armed and reports how late aio_poll() runs
+ * it with each fd monitor.
+ *
+ * Usage: bench_timer [timers] [periodic-shots] [period-us]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "async.h"
+
+typedef struct {
+    QEMUTimer *timer;
+    int64_t period;
+    int shots;
+    int fired;
+    long long *lateness;
+} Periodic;
+
+static unsigned long expired;
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void count_cb(void *opaque)
+{
+    expired++;
+}
+
+static void periodic_cb(void *opaque)
+{
+    Periodic *p = opaque;
+    int64_t now = qemu_clock_get_ns();
+    int64_t deadline = p->period * (p->fired + 1);
+
+    /* expire_time is gone by now, so recompute it from the schedule */
+    p->lateness[p->fired] = now - (p->lateness[p->shots] + deadline);
+    if (++p->fired < p->shots) {
+        timer_mod_ns(p->timer, p->lateness[p->shots] + deadline + p->period);
+    }
+}
+
+static void shuffle(QEMUTimer **timers, int n)
+{
+    int i;
+
+    for (i = n - 1; i > 0; i--) {
+        int j = random() % (i + 1);
+        QEMUTimer *tmp = timers[i];
+
+        timers[i] = timers[j];
+        timers[j] = tmp;
+    }
+}
+
+static double per_op(long long start, int n)
+{
+    return (double)(get_clock() - start) / n;
+}
+
+static void bench_ops(int n)
+{
+    AioContext *ctx = aio_context_new_fdmon(AIO_FDMON_EPOLL);
+    QEMUTimer **timers = g_new(QEMUTimer *, n);
+    int64_t now = qemu_clock_get_ns();
+    long long start;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        timers[i] = aio_timer_new(ctx, SCALE_NS, count_cb, NULL);
+    }
+
+    start = get_clock();
+    for (i = 0; i < n; i++) {
+        timer_mod_ns(timers[i], now + 1000000000LL + random() % 1000000000LL);
+    }
+    g_print("arm:    %7.1f ns/timer\n", per_op(start, n));
+
+    shuffle(timers, n);
+    start = get_clock();
+    for (i = 0; i < n; i++) {
+        timer_mod_ns(timers[i], now + 1000000000LL + random() % 1000000000LL);
+    }
+    g_print("rearm:  %7.1f ns/timer\n", per_op(start, n));
+
+    shuffle(timers, n);
+    start = get_clock();
+    for (i = 0; i < n; i++) {
+        timer_del(timers[i]);
+    }
+    g_print("cancel: %7.1f ns/timer\n", per_op(start, n));
+
+    /* Everything expired already: one aio_poll runs all the callbacks */
+    for (i = 0; i < n; i++) {
+        timer_mod_ns(timers[i], now - random() % 1000000LL);
+    }
+    expired = 0;
+    start = get_clock();
+    while (expired < n) {
+        aio_poll(ctx, true);
+    }
+    g_print("expire: %7.1f ns/timer\n", per_op(start, n));
+
+    for (i = 0; i < n; i++) {
+        timer_free(timers[i]);
+    }
+    g_free(timers);
+}
+
+static void bench_jitter(AioFdMonitor fdmon, const char *name,
+                         int n, int shots, int64_t period)
+{
+    AioContext *ctx = aio_context_new_fdmon(fdmon);
+    QEMUTimer **timers = g_new(QEMUTimer *, n);
+    int64_t now = qemu_clock_get_ns();
+    Periodic p = {
+        .period = period,
+        .shots = shots,
+        /* the last slot holds the start time */
+        .lateness = g_new(long long, shots + 1),
+    };
+    long long sum = 0;
+    int i;
+
+    /* Background load that never expires during the run */
+    for (i = 0; i < n; i++) {
+        timers[i] = aio_timer_new(ctx, SCALE_NS, count_cb, NULL);
+        timer_mod_ns(timers[i], now + 3600 * 1000000000LL + random());
+    }
+
+    p.timer = aio_timer_new(ctx, SCALE_NS, periodic_cb, &p);
+    p.lateness[shots] = qemu_clock_get_ns();
+    timer_mod_ns(p.timer, p.lateness[shots] + period);
+    while (p.fired < shots) {
+        aio_poll(ctx, true);
+    }
+
+    for (i = 0; i < shots; i++) {
+        sum += p.lateness[i];
+    }
+    qsort(p.lateness, shots, sizeof(long long), cmp_ll);
+    g_print("%-8s lateness avg %8.1f us p50 %8.1f us p99 %8.1f us "
+            "max %8.1f us\n", name, sum / 1000.0 / shots,
+            p.lateness[shots / 2] / 1000.0,
+            p.lateness[shots * 99 / 100] / 1000.0,
+            p.lateness[shots - 1] / 1000.0);
+
+    timer_free(p.timer);
+    for (i = 0; i < n; i++) {
+        timer_free(timers[i]);
+    }
+    g_free(timers);
+    g_free(p.lateness);
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+    int shots = argc > 2 ? atoi(argv[2]) : 2000;
+    int64_t period = (argc > 3 ? atoll(argv[3]) : 500) * SCALE_US;
+
+    g_print("%d timers\n", n);
+    bench_ops(n);
+
+    g_print("periodic %lld us timer, %d shots, %d timers armed\n",
+            (long long)(period / SCALE_US), shots, n);
+    bench_jitter(AIO_FDMON_POLL, "poll", n, shots, period);
+    bench_jitter(AIO_FDMON_EPOLL, "epoll", n, shots, period);
+    bench_jitter(AIO_FDMON_IO_URING, "io_uring", n, shots, period);
+    return 0;
+}
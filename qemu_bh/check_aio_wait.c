@@ -0,0 +1,128 @@
+/*
+ * aio_wait_bh_oneshot() check between IOThreads
+ *
+ * Each of two IOThreads runs a loop that moves its own fd handler and BH
+ * to the other IOThread and back, with aio_move_fd_handler() and
+ * qemu_bh_set_aio_context().  Half of those calls wait for a BH in the
+ * other IOThread, which is itself busy waiting on the first one, so the
+ * completions race with the waiter going to sleep in aio_poll().  A lost
+ * wakeup leaves a loop stuck, which the main thread reports after
+ * TIMEOUT_SEC.
+ *
+ * Usage: check_aio_wait [iterations]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "atomic.h"
+#include "iothread.h"
+
+#define TIMEOUT_SEC 60
+
+typedef struct {
+    AioContext *home;
+    AioContext *other;
+    int fd;
+    QEMUBH *bh;
+    unsigned long moves;
+    bool done;
+} Mover;
+
+static unsigned long iterations;
+
+static void fd_read(void *opaque)
+{
+}
+
+static void bh_cb(void *opaque)
+{
+}
+
+static void mover_attach_bh(void *opaque)
+{
+    Mover *m = opaque;
+
+    aio_set_fd_handler(m->home, m->fd, fd_read, NULL, NULL, m);
+}
+
+static void mover_detach_bh(void *opaque)
+{
+    Mover *m = opaque;
+
+    aio_set_fd_handler(m->home, m->fd, NULL, NULL, NULL, NULL);
+}
+
+/* Runs in m->home, each iteration waits twice for m->other */
+static void mover_run(void *opaque)
+{
+    Mover *m = opaque;
+    unsigned long i;
+
+    for (i = 0; i < iterations; i++) {
+        if (!aio_move_fd_handler(m->home, m->other, m->fd) ||
+            !aio_move_fd_handler(m->other, m->home, m->fd)) {
+            fprintf(stderr, "fd handler lost after %lu moves\n", i);
+            abort();
+        }
+        qemu_bh_schedule(m->bh);
+        qemu_bh_set_aio_context(m->bh, m->other);
+        qemu_bh_set_aio_context(m->bh, m->home);
+        atomic_set(&m->moves, i + 1);
+    }
+    atomic_mb_set(&m->done, true);
+}
+
+int main(int argc, char *argv[])
+{
+    IOThread *iothreads[2];
+    Mover movers[2];
+    int64_t deadline;
+    int i;
+
+    iterations = argc > 1 ? atol(argv[1]) : 20000;
+
+    for (i = 0; i < 2; i++) {
+        iothreads[i] = iothread_create(i ? "mover-b" : "mover-a",
+                                       AIO_FDMON_POLL);
+    }
+    for (i = 0; i < 2; i++) {
+        Mover *m = &movers[i];
+
+        m->home = iothread_get_aio_context(iothreads[i]);
+        m->other = iothread_get_aio_context(iothreads[!i]);
+        m->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        m->bh = aio_bh_new(m->home, bh_cb, m);
+        m->moves = 0;
+        m->done = false;
+        aio_wait_bh_oneshot(m->home, mover_attach_bh, m);
+    }
+
+    for (i = 0; i < 2; i++) {
+        aio_bh_schedule_oneshot(movers[i].home, mover_run, &movers[i]);
+    }
+
+    deadline = get_clock() + TIMEOUT_SEC * 1000000000LL;
+    while (!atomic_mb_read(&movers[0].done) ||
+           !atomic_mb_read(&movers[1].done)) {
+        if (get_clock() > deadline) {
+            fprintf(stderr, "stuck after %lu and %lu of %lu iterations\n",
+                    atomic_read(&movers[0].moves),
+                    atomic_read(&movers[1].moves), iterations);
+            abort();
+        }
+        usleep(1000);
+    }
+
+    for (i = 0; i < 2; i++) {
+        aio_wait_bh_oneshot(movers[i].home, mover_detach_bh, &movers[i]);
+        qemu_bh_delete(movers[i].bh);
+        close(movers[i].fd);
+    }
+    for (i = 0; i < 2; i++) {
+        iothread_destroy(iothreads[i]);
+    }
+    printf("OK  %lu iterations in each of 2 IOThreads\n", iterations);
+    return 0;
+}
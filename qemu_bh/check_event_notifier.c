@@ -0,0 +1,140 @@
+/*
+ * EventNotifier counting check
+ *
+ * Checks event_notifier_set_n() and EVENT_NOTIFIER_SEMAPHORE:
+ *  - counter: set_n(n) is collected by a single test_and_clear_count(),
+ *    which returns n, and test_and_clear() sees it exactly once;
+ *  - semaphore: a poster thread signals tokens in batches with set_n()
+ *    while reader threads drain them with test_and_clear_count().  Each
+ *    read must take a single token, and the readers must take exactly as
+ *    many as were posted, leaving none behind.
+ * check_event_notifier_pipe runs the same checks on the pipe emulation,
+ * which it forces with CONFIG_NO_EVENTFD.  The pipe drops the events that
+ * do not fit, so the poster keeps at most MAX_OUTSTANDING in flight.
+ *
+ * Usage: check_event_notifier [readers] [tokens]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <sched.h>
+#include <assert.h>
+#include <pthread.h>
+#include "atomic.h"
+#include "event_notifier.h"
+
+#define MAX_OUTSTANDING 4096
+
+static EventNotifier notifier;
+static uint64_t total;
+static uint64_t consumed;
+
+static void check_counter(void)
+{
+    EventNotifier e;
+    uint64_t n;
+
+    assert(event_notifier_init(&e, false) == 0);
+    assert(event_notifier_test_and_clear_count(&e) == 0);
+
+    for (n = 1; n <= MAX_OUTSTANDING; n *= 2) {
+        assert(event_notifier_set_n(&e, n) == 0);
+        assert(event_notifier_set_n(&e, 0) == 0);
+        assert(event_notifier_test_and_clear_count(&e) == n);
+        assert(event_notifier_test_and_clear_count(&e) == 0);
+
+        assert(event_notifier_set_n(&e, n) == 0);
+        assert(event_notifier_test_and_clear(&e) == 1);
+        assert(event_notifier_test_and_clear(&e) == 0);
+    }
+
+    /* Initially active */
+    event_notifier_cleanup(&e);
+    assert(event_notifier_init(&e, true) == 0);
+    assert(event_notifier_test_and_clear_count(&e) == 1);
+    event_notifier_cleanup(&e);
+    printf("counter    OK\n");
+}
+
+static void *reader_thread(void *opaque)
+{
+    struct pollfd pfd = {
+        .fd = event_notifier_get_fd(&notifier),
+        .events = POLLIN,
+    };
+    unsigned long *reads = opaque;
+    uint64_t got;
+
+    while (atomic_read(&consumed) < total) {
+        if (poll(&pfd, 1, 10) <= 0) {
+            continue;
+        }
+        /* Readers race for the token, the losers get nothing */
+        got = event_notifier_test_and_clear_count(&notifier);
+        if (got) {
+            assert(got == 1);
+            atomic_add(&consumed, got);
+            (*reads)++;
+        }
+    }
+    return NULL;
+}
+
+static void check_semaphore(int nr_readers)
+{
+    pthread_t *threads = calloc(nr_readers, sizeof(*threads));
+    unsigned long *reads = calloc(nr_readers, sizeof(*reads));
+    unsigned long sum = 0;
+    uint64_t posted = 0, batch = 1;
+    int i;
+
+    assert(event_notifier_init_flags(&notifier, false,
+                                     EVENT_NOTIFIER_SEMAPHORE) == 0);
+    for (i = 0; i < nr_readers; i++) {
+        pthread_create(&threads[i], NULL, reader_thread, &reads[i]);
+    }
+
+    /* Batches of 1, 2, 4... up to MAX_OUTSTANDING tokens, over and over */
+    while (posted < total) {
+        uint64_t n = batch < total - posted ? batch : total - posted;
+
+        while (posted + n - atomic_read(&consumed) > MAX_OUTSTANDING) {
+            sched_yield();
+        }
+        assert(event_notifier_set_n(&notifier, n) == 0);
+        posted += n;
+        batch = batch < MAX_OUTSTANDING ? batch * 2 : 1;
+    }
+
+    for (i = 0; i < nr_readers; i++) {
+        pthread_join(threads[i], NULL);
+        sum += reads[i];
+    }
+    assert(consumed == total && sum == total);
+    assert(event_notifier_test_and_clear_count(&notifier) == 0);
+
+    event_notifier_cleanup(&notifier);
+    printf("semaphore  OK  %lu tokens taken by %d readers:", sum, nr_readers);
+    for (i = 0; i < nr_readers; i++) {
+        printf(" %lu", reads[i]);
+    }
+    printf("\n");
+    free(reads);
+    free(threads);
+}
+
+int main(int argc, char *argv[])
+{
+    int nr_readers = argc > 1 ? atoi(argv[1]) : 4;
+
+    total = argc > 2 ? atol(argv[2]) : 200000;
+
+#ifdef CONFIG_NO_EVENTFD
+    printf("pipe emulation\n");
+#else
+    printf("eventfd\n");
+#endif
+    check_counter();
+    check_semaphore(nr_readers);
+    return 0;
+}
@@ -60,14 +60,32 @@ void event_notifier_init_fd(EventNotifier *e, int fd)
 {
     e->rfd = fd;
     e->wfd = fd;
+    e->flags = 0;
 }
 
-int event_notifier_init(EventNotifier *e, int active)
+/*
+ * With EVENT_NOTIFIER_SEMAPHORE in @flags, every event is a token that a
+ * single event_notifier_test_and_clear_count() takes, so that each one is
+ * handled exactly once even with several readers.  Without, a read
+ * collects all the events signalled since the previous one.
+ *
+ * The pipe emulation stores one byte per event, so it can hold no more
+ * than the pipe's capacity; events beyond that are dropped.
+ */
+int event_notifier_init_flags(EventNotifier *e, int active, int flags)
 {
     int fds[2];
     int ret;
 
-    ret = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    e->flags = flags;
+#ifdef CONFIG_NO_EVENTFD
+    /* Exercise the pipe emulation on hosts that do have eventfd */
+    ret = -1;
+    errno = ENOSYS;
+#else
+    ret = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC |
+                     (flags & EVENT_NOTIFIER_SEMAPHORE ? EFD_SEMAPHORE : 0));
+#endif
     if (ret >= 0) {
         e->rfd = e->wfd = ret;
     } else {
@@ -101,6 +119,11 @@ fail:
     return ret;
 }
 
+int event_notifier_init(EventNotifier *e, int active)
+{
+    return event_notifier_init_flags(e, active, 0);
+}
+
 void event_notifier_cleanup(EventNotifier *e)
 {
     if (e->rfd != e->wfd) {
@@ -118,12 +141,32 @@ int event_notifier_get_fd(const EventNotifier *e)
 
 int event_notifier_set(EventNotifier *e)
 {
-    static const uint64_t value = 1;
+    return event_notifier_set_n(e, 1);
+}
+
+/* Signal @n events with a single write */
+int event_notifier_set_n(EventNotifier *e, uint64_t n)
+{
+    static const char zeroes[512];
     ssize_t ret;
 
-    do {
-        ret = write(e->wfd, &value, sizeof(value));
-    } while (ret < 0 && errno == EINTR);
+    if (!n) {
+        return 0;
+    }
+
+    if (e->rfd == e->wfd) {
+        do {
+            ret = write(e->wfd, &n, sizeof(n));
+        } while (ret < 0 && errno == EINTR);
+    } else {
+        /* One byte per event, the pipe fills up at its capacity */
+        do {
+            ret = write(e->wfd, zeroes, n < sizeof(zeroes) ? n : sizeof(zeroes));
+            if (ret > 0) {
+                n -= ret;
+            }
+        } while ((ret < 0 && errno == EINTR) || (ret > 0 && n));
+    }
 
     /* EAGAIN is fine, a read must be pending.  */
     if (ret < 0 && errno != EAGAIN) {
@@ -138,12 +181,47 @@ int event_notifier_test_and_clear(EventNotifier *e)
     ssize_t len;
     char buffer[512];
 
-    /* Drain the notify pipe.  For eventfd, only 8 bytes will be read.  */
+    /* Drain the notify pipe.  For eventfd, only 8 bytes will be read,
+     * except that a semaphore gives one event per read.
+     */
     value = 0;
     do {
         len = read(e->rfd, buffer, sizeof(buffer));
         value |= (len > 0);
-    } while ((len == -1 && errno == EINTR) || len == sizeof(buffer));
+    } while ((len == -1 && errno == EINTR) || len == sizeof(buffer) ||
+             (len > 0 && (e->flags & EVENT_NOTIFIER_SEMAPHORE)));
 
     return value;
 }
+
+/* Returns how many events were consumed: all of those signalled since the
+ * last call, or at most one for a semaphore notifier.  0 if none.
+ */
+uint64_t event_notifier_test_and_clear_count(EventNotifier *e)
+{
+    uint64_t count = 0;
+    ssize_t len;
+    char buffer[512];
+
+    if (e->rfd == e->wfd) {
+        do {
+            len = read(e->rfd, &count, sizeof(count));
+        } while (len == -1 && errno == EINTR);
+        return len == sizeof(count) ? count : 0;
+    }
+
+    if (e->flags & EVENT_NOTIFIER_SEMAPHORE) {
+        do {
+            len = read(e->rfd, buffer, 1);
+        } while (len == -1 && errno == EINTR);
+        return len == 1;
+    }
+
+    do {
+        len = read(e->rfd, buffer, sizeof(buffer));
+        if (len > 0) {
+            count += len;
+        }
+    } while ((len == -1 && errno == EINTR) || len == sizeof(buffer));
+    return count;
+}
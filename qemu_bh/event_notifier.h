@@ -10,9 +10,15 @@
  * See the COPYING file in the top-level directory.
  */
 
+#include <stdint.h>
+
+/* Flags for event_notifier_init_flags */
+#define EVENT_NOTIFIER_SEMAPHORE  1  /* each read takes a single event */
+
 struct EventNotifier {
     int rfd;
     int wfd;
+    int flags;
 };
 
 typedef struct EventNotifier EventNotifier;
@@ -20,9 +26,12 @@ typedef struct EventNotifier EventNotifier;
 typedef void EventNotifierHandler(EventNotifier *);
 
 int event_notifier_init(EventNotifier *, int active);
+int event_notifier_init_flags(EventNotifier *, int active, int flags);
 void event_notifier_cleanup(EventNotifier *);
 int event_notifier_set(EventNotifier *);
+int event_notifier_set_n(EventNotifier *, uint64_t n);
 int event_notifier_test_and_clear(EventNotifier *);
+uint64_t event_notifier_test_and_clear_count(EventNotifier *);
 
 void event_notifier_init_fd(EventNotifier *, int fd);
 int event_notifier_get_fd(const EventNotifier *);
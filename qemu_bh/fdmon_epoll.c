@@ -0,0 +1,227 @@
+/*
+ * epoll(7) file descriptor monitoring
+ *
+ * The handlers of the AioContext live in a persistent epoll set that is
+ * updated incrementally by aio_set_fd_handler().  Only the epoll fd itself
+ * is added to the GSource, so the glib main loop polls one fd per context
+ * and aio_dispatch_handlers() only visits the handlers that are ready.
+ */
+#define _GNU_SOURCE
+#include <glib.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+#include "aio.h"
+
+/* Max number of ready handlers dispatched per iteration.  epoll is level
+ * triggered, so the others stay ready for the next one.
+ */
+#define EPOLL_BATCH 128
+
+static int epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static int pfd_events_from_epoll(int epoll_events)
+{
+    return (epoll_events & EPOLLIN ? G_IO_IN : 0) |
+           (epoll_events & EPOLLOUT ? G_IO_OUT : 0) |
+           (epoll_events & EPOLLHUP ? G_IO_HUP : 0) |
+           (epoll_events & EPOLLERR ? G_IO_ERR : 0);
+}
+
+static void fdmon_epoll_update(AioContext *ctx,
+                               AioHandler *old_node,
+                               AioHandler *new_node)
+{
+    struct epoll_event event = {
+        .data.ptr = new_node,
+        .events = new_node ? epoll_events_from_pfd(new_node->pfd.events) : 0,
+    };
+    int r;
+
+    if (!new_node) {
+        r = epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, old_node->pfd.fd, &event);
+    } else if (!old_node) {
+        r = epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, new_node->pfd.fd, &event);
+    } else {
+        r = epoll_ctl(ctx->epollfd, EPOLL_CTL_MOD, new_node->pfd.fd, &event);
+    }
+
+    /* e.g. EPERM for regular files, which epoll does not support.  The
+     * thread running the context may be waiting on the epoll fd or
+     * dispatching its events, so leave the switch to poll to that thread.
+     * aio_set_fd_handler wakes it up once we return.
+     */
+    if (r) {
+        atomic_set(&ctx->epoll_fallback, true);
+    }
+}
+
+/* Called by the thread running @ctx before it touches the epoll state.
+ * Returns true if @ctx has been switched to the poll monitor.
+ */
+static bool fdmon_epoll_fallback(AioContext *ctx)
+{
+    if (likely(!atomic_read(&ctx->epoll_fallback))) {
+        return false;
+    }
+
+    pthread_mutex_lock(&ctx->list_lock);
+    fdmon_epoll_disable(ctx);
+    pthread_mutex_unlock(&ctx->list_lock);
+    return true;
+}
+
+static void fdmon_epoll_prepare(AioContext *ctx)
+{
+    /* Add the GPollFD of each handler before glib polls */
+    fdmon_epoll_fallback(ctx);
+}
+
+static int fdmon_epoll_wait(AioContext *ctx, int64_t timeout)
+{
+    struct pollfd pfd = {
+        .fd = ctx->epollfd,
+        .events = POLLIN,
+    };
+    struct timespec ts;
+    int ret;
+
+    if (fdmon_epoll_fallback(ctx)) {
+        return ctx->fdmon_ops->wait(ctx, timeout);
+    }
+
+    /* epoll_wait only has millisecond resolution, ppoll has nanosecond
+     * resolution for higher-precision timer deadlines.
+     */
+    if (timeout > 0) {
+        ts.tv_sec = timeout / 1000000000LL;
+        ts.tv_nsec = timeout % 1000000000LL;
+        ret = ppoll(&pfd, 1, &ts, NULL);
+        if (ret < 0) {
+            return -errno;
+        }
+        if (ret == 0) {
+            ctx->epoll_nready = 0;
+            return 0;
+        }
+        timeout = 0;
+    }
+
+    ret = epoll_wait(ctx->epollfd, ctx->epoll_events, EPOLL_BATCH,
+                     timeout < 0 ? -1 : 0);
+    if (ret < 0) {
+        return -errno;
+    }
+    ctx->epoll_nready = ret;
+    return ret;
+}
+
+static bool fdmon_epoll_pending(AioContext *ctx)
+{
+    /* Let dispatch do the switch */
+    if (atomic_read(&ctx->epoll_fallback)) {
+        return true;
+    }
+    return ctx->epoll_pfd.revents != 0 || ctx->epoll_nready > 0;
+}
+
+static bool fdmon_epoll_dispatch(AioContext *ctx)
+{
+    struct epoll_event *events = ctx->epoll_events;
+    int i, ret;
+
+    if (fdmon_epoll_fallback(ctx)) {
+        return ctx->fdmon_ops->dispatch(ctx);
+    }
+
+    ctx->epoll_pfd.revents = 0;
+
+    /* Events may have been gathered already by fdmon_epoll_wait.  Nodes
+     * removed since then are marked deleted and skipped.
+     */
+    ret = ctx->epoll_nready;
+    ctx->epoll_nready = -1;
+    if (ret < 0) {
+        do {
+            ret = epoll_wait(ctx->epollfd, events, EPOLL_BATCH, 0);
+        } while (ret < 0 && errno == EINTR);
+    }
+
+    for (i = 0; i < ret; i++) {
+        AioHandler *node = events[i].data.ptr;
+
+        node->pfd.revents = pfd_events_from_epoll(events[i].events);
+        aio_dispatch_handler(ctx, node);
+    }
+
+    return ret > 0;
+}
+
+static const FDMonOps fdmon_epoll_ops = {
+    .update = fdmon_epoll_update,
+    .prepare = fdmon_epoll_prepare,
+    .wait = fdmon_epoll_wait,
+    .pending = fdmon_epoll_pending,
+    .dispatch = fdmon_epoll_dispatch,
+};
+
+/* Switch @ctx back to one GPollFD per handler.  Called with list_lock
+ * taken by the thread running @ctx, or before @ctx is used.
+ */
+void fdmon_epoll_disable(AioContext *ctx)
+{
+    AioHandler *node;
+
+    if (ctx->epollfd < 0) {
+        return;
+    }
+
+    if (!g_source_is_destroyed(&ctx->source)) {
+        g_source_remove_poll(&ctx->source, &ctx->epoll_pfd);
+    }
+    close(ctx->epollfd);
+    ctx->epollfd = -1;
+    ctx->epoll_pfd.fd = -1;
+    ctx->epoll_pfd.revents = 0;
+    ctx->epoll_nready = -1;
+    g_free(ctx->epoll_events);
+    ctx->epoll_events = NULL;
+    ctx->epoll_fallback = false;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted) {
+            g_source_add_poll(&ctx->source, &node->pfd);
+        }
+    }
+
+    ctx->fdmon_ops = &fdmon_poll_ops;
+}
+
+/* Must be called before any handler is added to @ctx.  Returns false, and
+ * leaves @ctx with the poll monitor, if epoll is not available.
+ */
+bool fdmon_epoll_setup(AioContext *ctx)
+{
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx->epollfd < 0) {
+        return false;
+    }
+
+    ctx->epoll_pfd.fd = ctx->epollfd;
+    ctx->epoll_pfd.events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+    ctx->epoll_pfd.revents = 0;
+    g_source_add_poll(&ctx->source, &ctx->epoll_pfd);
+
+    ctx->epoll_events = g_new(struct epoll_event, EPOLL_BATCH);
+    ctx->epoll_nready = -1;
+
+    ctx->fdmon_ops = &fdmon_epoll_ops;
+    return true;
+}
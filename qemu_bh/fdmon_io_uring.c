@@ -0,0 +1,503 @@
+/*
+ * io_uring file descriptor monitoring
+ *
+ * Each handler gets a multishot IORING_OP_POLL_ADD request, so an fd that
+ * stays registered costs nothing per iteration: readiness shows up as a
+ * completion in the shared CQ ring.  Poll add/remove requests and
+ * aio_uring_submit_rw() reads/writes are queued in the SQ ring and
+ * submitted together, so one aio_poll iteration does at most one
+ * io_uring_enter(2) for both submission and waiting.
+ *
+ * The ring is used without liburing.  CONFIG_IO_URING is set by the
+ * Makefile probe when linux/io_uring.h knows about multishot poll; the
+ * running kernel is probed again in fdmon_io_uring_setup().
+ */
+#include <glib.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include "atomic.h"
+#include "aio.h"
+
+#ifdef CONFIG_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+
+#define FDMON_IO_URING_ENTRIES  128
+
+enum {
+    FDMON_IO_URING_PENDING  = (1 << 0),  /* on the submit_list */
+    FDMON_IO_URING_ADD      = (1 << 1),  /* submit IORING_OP_POLL_ADD */
+    FDMON_IO_URING_REMOVE   = (1 << 2),  /* submit IORING_OP_POLL_REMOVE */
+    FDMON_IO_URING_DELETING = (1 << 3),  /* free once the poll is gone */
+};
+
+/* user_data of poll requests is the AioHandler, that of poll remove
+ * requests the AioHandler with URING_REMOVE_TAG set, and that of
+ * aio_uring_submit_rw requests the AioUringRequest with URING_RW_TAG set.
+ */
+#define URING_RW_TAG     1
+#define URING_REMOVE_TAG 2
+
+typedef struct AioUringRequest {
+    AioUringCompletionFunc *cb;
+    void *opaque;
+} AioUringRequest;
+
+typedef struct AioUring {
+    int fd;
+    GPollFD pfd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;          /* next free SQE, published on submit */
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring;
+    size_t ring_size;
+    size_t sqes_size;
+
+    /* Handlers with poll add/remove requests to submit, pushed from any
+     * thread by fdmon_io_uring_update.
+     */
+    QSLIST_HEAD(, AioHandler) submit_list;
+
+    /* Poll requests that have not posted their final completion yet */
+    unsigned nr_armed;
+} AioUring;
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   flags, arg, argsz);
+}
+
+static unsigned uring_to_submit(AioUring *u)
+{
+    return u->sqe_tail - atomic_read(u->sq_head);
+}
+
+/* Submit the queued SQEs and optionally wait for @min_complete CQEs for up
+ * to @timeout nanoseconds.
+ */
+static int uring_submit_and_wait(AioUring *u, unsigned min_complete,
+                                 int64_t timeout)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg = {
+        .sigmask_sz = _NSIG / 8,
+    };
+    unsigned flags = 0;
+    int ret;
+
+    /* Publish the SQEs to the kernel */
+    atomic_store_release(u->sq_tail, u->sqe_tail);
+
+    if (min_complete) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeout >= 0) {
+            ts.tv_sec = timeout / 1000000000LL;
+            ts.tv_nsec = timeout % 1000000000LL;
+            arg.ts = (uintptr_t)&ts;
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+    } else if (!uring_to_submit(u)) {
+        return 0;
+    }
+
+    do {
+        ret = io_uring_enter(u->fd, uring_to_submit(u), min_complete, flags,
+                             flags & IORING_ENTER_EXT_ARG ? &arg : NULL,
+                             flags & IORING_ENTER_EXT_ARG ? sizeof(arg) : 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0 && errno != ETIME && errno != EBUSY) {
+        return -errno;
+    }
+    return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(AioUring *u)
+{
+    struct io_uring_sqe *sqe;
+
+    /* Ring full, hand what we have over to the kernel */
+    while (u->sqe_tail - atomic_load_acquire(u->sq_head) == u->sq_entries) {
+        uring_submit_and_wait(u, 0, 0);
+    }
+
+    sqe = &u->sqes[u->sqe_tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sqe_tail++;
+    return sqe;
+}
+
+static void uring_enqueue(AioUring *u, AioHandler *node, unsigned flags)
+{
+    unsigned old_flags;
+
+    old_flags = atomic_fetch_or(&node->flags, FDMON_IO_URING_PENDING | flags);
+    if (!(old_flags & FDMON_IO_URING_PENDING)) {
+        QSLIST_INSERT_HEAD_ATOMIC(&u->submit_list, node, node_submitted);
+    }
+}
+
+/* Turn the submit_list into SQEs, only called from the event loop thread */
+static void uring_fill_sq_ring(AioContext *ctx)
+{
+    AioUring *u = ctx->uring;
+    QSLIST_HEAD(, AioHandler) submit_list;
+    AioHandler *node;
+    unsigned flags;
+
+    QSLIST_MOVE_ATOMIC(&submit_list, &u->submit_list);
+
+    while ((node = QSLIST_FIRST(&submit_list))) {
+        QSLIST_REMOVE_HEAD(&submit_list, node_submitted);
+
+        flags = atomic_fetch_and(&node->flags, ~(FDMON_IO_URING_PENDING |
+                                                 FDMON_IO_URING_ADD |
+                                                 FDMON_IO_URING_REMOVE));
+        if (flags & FDMON_IO_URING_ADD) {
+            struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = node->pfd.fd;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            sqe->poll32_events = node->pfd.events | G_IO_ERR | G_IO_HUP;
+            sqe->user_data = (uintptr_t)node;
+            node->uring_armed = true;
+            u->nr_armed++;
+        }
+        if (flags & FDMON_IO_URING_REMOVE) {
+            if (node->uring_armed && !node->uring_removing) {
+                struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+                /* The final poll completion will free the node */
+                sqe->opcode = IORING_OP_POLL_REMOVE;
+                sqe->fd = -1;
+                sqe->addr = (uintptr_t)node;
+                sqe->user_data = (uintptr_t)node | URING_REMOVE_TAG;
+                node->uring_removing = true;
+            } else if (!node->uring_armed && !node->uring_removing) {
+                g_free_rcu(&ctx->rcu, node, rcu);
+            }
+        }
+    }
+}
+
+static void fdmon_io_uring_update(AioContext *ctx,
+                                  AioHandler *old_node,
+                                  AioHandler *new_node)
+{
+    AioUring *u = ctx->uring;
+
+    if (new_node) {
+        uring_enqueue(u, new_node, FDMON_IO_URING_ADD);
+    }
+
+    if (old_node) {
+        /* IORING_OP_POLL_ADD and IORING_OP_POLL_REMOVE are asynchronous,
+         * and a completion for the old poll may already be in the CQ ring.
+         * The node is freed once the kernel is done with it.
+         */
+        uring_enqueue(u, old_node, FDMON_IO_URING_REMOVE |
+                                   FDMON_IO_URING_DELETING);
+    }
+}
+
+static bool uring_cq_ready(AioUring *u)
+{
+    return *u->cq_head != atomic_load_acquire(u->cq_tail);
+}
+
+static void fdmon_io_uring_prepare(AioContext *ctx)
+{
+    uring_fill_sq_ring(ctx);
+    uring_submit_and_wait(ctx->uring, 0, 0);
+}
+
+static int fdmon_io_uring_wait(AioContext *ctx, int64_t timeout)
+{
+    AioUring *u = ctx->uring;
+    int ret;
+
+    uring_fill_sq_ring(ctx);
+
+    if (uring_cq_ready(u)) {
+        timeout = 0;
+    }
+
+    ret = uring_submit_and_wait(u, timeout ? 1 : 0, timeout);
+    if (ret < 0) {
+        return ret;
+    }
+    return atomic_load_acquire(u->cq_tail) - *u->cq_head;
+}
+
+static bool fdmon_io_uring_pending(AioContext *ctx)
+{
+    return uring_cq_ready(ctx->uring);
+}
+
+static bool uring_process_cqe(AioContext *ctx, struct io_uring_cqe *cqe)
+{
+    AioHandler *node;
+    unsigned flags;
+
+    if (cqe->user_data & URING_RW_TAG) {
+        AioUringRequest *req =
+            (AioUringRequest *)(uintptr_t)(cqe->user_data & ~URING_RW_TAG);
+
+        req->cb(req->opaque, cqe->res);
+        g_free(req);
+        return true;
+    }
+
+    if (cqe->user_data & URING_REMOVE_TAG) {
+        node = (AioHandler *)(uintptr_t)(cqe->user_data & ~URING_REMOVE_TAG);
+        node->uring_removing = false;
+
+        /* -EALREADY means that the poll was being completed, and a
+         * multishot poll may well stay armed afterwards: try again.
+         * Otherwise whichever of the two completions comes last frees
+         * the node.
+         */
+        if (node->uring_armed) {
+            if (cqe->res == -EALREADY) {
+                uring_enqueue(ctx->uring, node, FDMON_IO_URING_REMOVE);
+            }
+        } else if (!(atomic_read(&node->flags) & FDMON_IO_URING_PENDING)) {
+            g_free_rcu(&ctx->rcu, node, rcu);
+        }
+        return false;
+    }
+
+    node = (AioHandler *)(uintptr_t)cqe->user_data;
+    flags = atomic_read(&node->flags);
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        /* The poll request is gone, either removed or terminated by the
+         * kernel.  Free the node, or arm the poll again.  If a poll remove
+         * is still queued, uring_fill_sq_ring will see the node disarmed
+         * and free it; if one is in flight, its completion will.
+         */
+        node->uring_armed = false;
+        ctx->uring->nr_armed--;
+        if (flags & FDMON_IO_URING_DELETING) {
+            if (!(flags & FDMON_IO_URING_PENDING) && !node->uring_removing) {
+                g_free_rcu(&ctx->rcu, node, rcu);
+            }
+            return false;
+        }
+        if (cqe->res >= 0) {
+            uring_enqueue(ctx->uring, node, FDMON_IO_URING_ADD);
+        }
+    }
+
+    if (node->deleted) {
+        return false;
+    }
+
+    node->pfd.revents = cqe->res < 0 ? G_IO_ERR : cqe->res;
+    aio_dispatch_handler(ctx, node);
+    return true;
+}
+
+static bool fdmon_io_uring_dispatch(AioContext *ctx)
+{
+    AioUring *u = ctx->uring;
+    unsigned head, tail;
+    bool progress = false;
+
+    u->pfd.revents = 0;
+
+    head = *u->cq_head;
+    tail = atomic_load_acquire(u->cq_tail);
+    while (head != tail) {
+        /* Copy the CQE, a callback may re-enter and reap more */
+        struct io_uring_cqe cqe = u->cqes[head & u->cq_mask];
+
+        atomic_store_release(u->cq_head, ++head);
+        progress |= uring_process_cqe(ctx, &cqe);
+
+        head = *u->cq_head;
+        tail = atomic_load_acquire(u->cq_tail);
+    }
+
+    return progress;
+}
+
+static const FDMonOps fdmon_io_uring_ops = {
+    .update = fdmon_io_uring_update,
+    .frees_nodes = true,
+    .wait = fdmon_io_uring_wait,
+    .prepare = fdmon_io_uring_prepare,
+    .pending = fdmon_io_uring_pending,
+    .dispatch = fdmon_io_uring_dispatch,
+};
+
+int aio_uring_submit_rw(AioContext *ctx, bool is_write, int fd,
+                        void *buf, size_t len, int64_t offset,
+                        AioUringCompletionFunc *cb, void *opaque)
+{
+    AioUringRequest *req;
+    struct io_uring_sqe *sqe;
+
+    if (!ctx->uring) {
+        return -ENOTSUP;
+    }
+
+    req = g_new(AioUringRequest, 1);
+    req->cb = cb;
+    req->opaque = opaque;
+
+    /* Submitted with the next fdmon_io_uring_wait or prepare */
+    sqe = uring_get_sqe(ctx->uring);
+    sqe->opcode = is_write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t)req | URING_RW_TAG;
+    return 0;
+}
+
+/* Must be called before any handler is added to @ctx.  Returns false, and
+ * leaves @ctx with the poll monitor, if the kernel lacks io_uring or one of
+ * the features used here.
+ */
+bool fdmon_io_uring_setup(AioContext *ctx)
+{
+    struct io_uring_params p;
+    AioUring *u;
+    unsigned *sq_array;
+    unsigned i;
+    size_t sq_size, cq_size;
+
+    memset(&p, 0, sizeof(p));
+    u = g_new0(AioUring, 1);
+    u->fd = syscall(__NR_io_uring_setup, FDMON_IO_URING_ENTRIES, &p);
+    if (u->fd < 0) {
+        g_free(u);
+        return false;
+    }
+
+    /* There is no feature bit for multishot poll, but it came in 5.13
+     * together with IORING_FEAT_RSRC_TAGS.
+     */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_RSRC_TAGS)) {
+        goto fail;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size = MAX(sq_size, cq_size);
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED) {
+        goto fail;
+    }
+
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        munmap(u->ring, u->ring_size);
+        goto fail;
+    }
+
+    u->sq_head = u->ring + p.sq_off.head;
+    u->sq_tail = u->ring + p.sq_off.tail;
+    u->sq_mask = *(unsigned *)(u->ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sqe_tail = *u->sq_tail;
+    u->cq_head = u->ring + p.cq_off.head;
+    u->cq_tail = u->ring + p.cq_off.tail;
+    u->cq_mask = *(unsigned *)(u->ring + p.cq_off.ring_mask);
+    u->cqes = u->ring + p.cq_off.cqes;
+
+    /* SQEs are always consumed in order, map them one to one */
+    sq_array = u->ring + p.sq_off.array;
+    for (i = 0; i < p.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+
+    QSLIST_INIT(&u->submit_list);
+
+    /* The ring fd is readable when completions are available */
+    u->pfd.fd = u->fd;
+    u->pfd.events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+    g_source_add_poll(&ctx->source, &u->pfd);
+
+    ctx->uring = u;
+    ctx->fdmon_ops = &fdmon_io_uring_ops;
+    return true;
+
+fail:
+    close(u->fd);
+    g_free(u);
+    return false;
+}
+
+/* All handlers must have been removed.  Submit the poll removals that
+ * are still queued and reap their completions, so that the nodes are
+ * handed over to RCU, before tearing the ring down.  If the thread that
+ * armed the polls has exited, the kernel completes them from a worker
+ * thread, so this can take a while.
+ */
+void fdmon_io_uring_destroy(AioContext *ctx)
+{
+    AioUring *u = ctx->uring;
+
+    while (u->nr_armed || !QSLIST_EMPTY(&u->submit_list)) {
+        uring_fill_sq_ring(ctx);
+        if (!uring_cq_ready(u)) {
+            /* Give up if a handler was left behind */
+            uring_submit_and_wait(u, 1, 1000 * SCALE_MS);
+            if (!uring_cq_ready(u)) {
+                break;
+            }
+        }
+        fdmon_io_uring_dispatch(ctx);
+    }
+
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->ring, u->ring_size);
+    close(u->fd);
+    g_free(u);
+    ctx->uring = NULL;
+}
+
+#else /* !CONFIG_IO_URING */
+
+int aio_uring_submit_rw(AioContext *ctx, bool is_write, int fd,
+                        void *buf, size_t len, int64_t offset,
+                        AioUringCompletionFunc *cb, void *opaque)
+{
+    return -ENOTSUP;
+}
+
+bool fdmon_io_uring_setup(AioContext *ctx)
+{
+    return false;
+}
+
+void fdmon_io_uring_destroy(AioContext *ctx)
+{
+}
+
+#endif /* !CONFIG_IO_URING */
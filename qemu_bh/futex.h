@@ -17,17 +17,60 @@
 #include <sys/syscall.h>
 #include <linux/futex.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #define qemu_futex(...)              syscall(__NR_futex, __VA_ARGS__)
 
+/* All futexes are private to the process, which saves the kernel a lookup
+ * of the mm on each call.
+ *
+ * If the headers know about futex_waitv (Linux 5.16), waits go through it
+ * with a single waiter.  A futex2 waiter with FUTEX_PRIVATE_FLAG hashes to
+ * the same key as a FUTEX_WAIT_PRIVATE one, so FUTEX_WAKE_PRIVATE wakes
+ * both kinds.  Kernels without it return ENOSYS and the classic syscall is
+ * used from then on.  Build with -DCONFIG_NO_FUTEX_WAITV to never try it.
+ */
+#if defined(__NR_futex_waitv) && !defined(CONFIG_NO_FUTEX_WAITV)
+#define CONFIG_FUTEX_WAITV
+static int qemu_futex_waitv_enosys;
+
+static inline long qemu_futex_waitv(void *f, unsigned val)
+{
+    struct futex_waitv waiter = {
+        .val = val,
+        .uaddr = (uintptr_t)f,
+        .flags = FUTEX_32 | FUTEX_PRIVATE_FLAG,
+    };
+
+    return syscall(__NR_futex_waitv, &waiter, 1, 0, NULL, 0);
+}
+#endif
+
 static inline void qemu_futex_wake(void *f, int n)
 {
-    qemu_futex(f, FUTEX_WAKE, n, NULL, NULL, 0);
+    qemu_futex(f, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static inline long qemu_futex_wait_once(void *f, unsigned val)
+{
+#ifdef CONFIG_FUTEX_WAITV
+    if (!__atomic_load_n(&qemu_futex_waitv_enosys, __ATOMIC_RELAXED)) {
+        long ret = qemu_futex_waitv(f, val);
+
+        if (ret >= 0 || errno != ENOSYS) {
+            return ret < 0 ? ret : 0;
+        }
+        __atomic_store_n(&qemu_futex_waitv_enosys, 1, __ATOMIC_RELAXED);
+    }
+#endif
+    return qemu_futex(f, FUTEX_WAIT_PRIVATE, (int) val, NULL, NULL, 0);
 }
 
 static inline void qemu_futex_wait(void *f, unsigned val)
 {
-    while (qemu_futex(f, FUTEX_WAIT, (int) val, NULL, NULL, 0)) {
+    while (qemu_futex_wait_once(f, val)) {
         switch (errno) {
         case EWOULDBLOCK:
             return;
@@ -0,0 +1,183 @@
+/*
+ * IOThreads
+ *
+ * Each IOThread owns an AioContext and runs aio_poll() on it until it is
+ * destroyed.  Devices are bound to an IOThread by registering their fd
+ * handlers and BHs in its context, and can be moved to another one at
+ * runtime with aio_move_fd_handler() and qemu_bh_set_aio_context().
+ */
+#define _GNU_SOURCE
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "atomic.h"
+#include "iothread.h"
+
+static void *iothread_run(void *opaque)
+{
+    IOThread *iothread = opaque;
+
+    qemu_set_current_aio_context(iothread->ctx);
+
+    pthread_mutex_lock(&iothread->init_done_lock);
+    iothread->thread_id = syscall(SYS_gettid);
+    pthread_cond_signal(&iothread->init_done_cond);
+    pthread_mutex_unlock(&iothread->init_done_lock);
+
+    while (!atomic_read(&iothread->stopping)) {
+        aio_poll(iothread->ctx, true);
+    }
+
+    qemu_set_current_aio_context(NULL);
+    return NULL;
+}
+
+static void iothread_stop_bh(void *opaque)
+{
+    IOThread *iothread = opaque;
+
+    /* Runs in the IOThread, aio_poll returns right after */
+    atomic_set(&iothread->stopping, true);
+}
+
+IOThread *iothread_create(const char *name, AioFdMonitor fdmon)
+{
+    IOThread *iothread = g_new0(IOThread, 1);
+    int ret;
+
+    iothread->name = g_strdup(name);
+    iothread->thread_id = -1;
+    iothread->ctx = aio_context_new_fdmon(fdmon);
+    if (!iothread->ctx) {
+        goto fail;
+    }
+
+    pthread_mutex_init(&iothread->init_done_lock, NULL);
+    pthread_cond_init(&iothread->init_done_cond, NULL);
+
+    ret = pthread_create(&iothread->thread, NULL, iothread_run, iothread);
+    if (ret) {
+        g_print("%s: pthread_create: %s\n", __FUNCTION__, strerror(ret));
+        pthread_cond_destroy(&iothread->init_done_cond);
+        pthread_mutex_destroy(&iothread->init_done_lock);
+        aio_context_unref(iothread->ctx);
+        goto fail;
+    }
+    pthread_setname_np(iothread->thread, name);
+
+    /* Wait for initialization to complete */
+    pthread_mutex_lock(&iothread->init_done_lock);
+    while (iothread->thread_id == -1) {
+        pthread_cond_wait(&iothread->init_done_cond,
+                          &iothread->init_done_lock);
+    }
+    pthread_mutex_unlock(&iothread->init_done_lock);
+
+    return iothread;
+
+fail:
+    g_free(iothread->name);
+    g_free(iothread);
+    return NULL;
+}
+
+/* The fd handlers and BHs of the IOThread's context must have been removed
+ * or moved elsewhere.
+ */
+void iothread_destroy(IOThread *iothread)
+{
+    aio_bh_schedule_oneshot(iothread->ctx, iothread_stop_bh, iothread);
+    pthread_join(iothread->thread, NULL);
+
+    /* Run the BHs that were scheduled while the thread was stopping */
+    aio_poll(iothread->ctx, false);
+    aio_context_unref(iothread->ctx);
+
+    pthread_cond_destroy(&iothread->init_done_cond);
+    pthread_mutex_destroy(&iothread->init_done_lock);
+    g_free(iothread->name);
+    g_free(iothread);
+}
+
+AioContext *iothread_get_aio_context(IOThread *iothread)
+{
+    return iothread->ctx;
+}
+
+/* Pin the IOThread to @cpu, or let it run anywhere if @cpu is -1.
+ * Returns 0 or a negative errno.
+ */
+int iothread_set_affinity(IOThread *iothread, int cpu)
+{
+    cpu_set_t cpuset;
+    int i;
+
+    CPU_ZERO(&cpuset);
+    if (cpu < 0) {
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            CPU_SET(i, &cpuset);
+        }
+    } else {
+        CPU_SET(cpu, &cpuset);
+    }
+
+    return -pthread_setaffinity_np(iothread->thread, sizeof(cpuset), &cpuset);
+}
+
+/* Create @nr_threads IOThreads named "@name-N"; with @pin, IOThread N is
+ * pinned to the N-th CPU the process may run on, wrapping around.
+ */
+IOThreadPool *iothread_pool_new(const char *name, int nr_threads,
+                                AioFdMonitor fdmon, bool pin)
+{
+    IOThreadPool *pool = g_new0(IOThreadPool, 1);
+    cpu_set_t allowed;
+    int i, cpu = -1;
+
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    pool->threads = g_new0(IOThread *, nr_threads);
+    for (i = 0; i < nr_threads; i++) {
+        char *thread_name = g_strdup_printf("%s-%d", name, i);
+
+        pool->threads[i] = iothread_create(thread_name, fdmon);
+        g_free(thread_name);
+        if (!pool->threads[i]) {
+            iothread_pool_free(pool);
+            return NULL;
+        }
+        pool->nr_threads++;
+
+        if (pin) {
+            do {
+                cpu = (cpu + 1) % CPU_SETSIZE;
+            } while (!CPU_ISSET(cpu, &allowed));
+            iothread_set_affinity(pool->threads[i], cpu);
+        }
+    }
+
+    return pool;
+}
+
+void iothread_pool_free(IOThreadPool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->nr_threads; i++) {
+        iothread_destroy(pool->threads[i]);
+    }
+    g_free(pool->threads);
+    g_free(pool);
+}
+
+/* Pick the context for the next device, round-robin */
+AioContext *iothread_pool_next(IOThreadPool *pool)
+{
+    unsigned i = atomic_fetch_inc(&pool->next) % pool->nr_threads;
+
+    return iothread_get_aio_context(pool->threads[i]);
+}
@@ -0,0 +1,36 @@
+#ifndef IOTHREAD_H
+#define IOTHREAD_H
+
+#include <pthread.h>
+#include "async.h"
+
+/* A thread running the event loop of its own AioContext */
+typedef struct IOThread {
+    char *name;
+    pthread_t thread;
+    AioContext *ctx;
+    int thread_id;              /* kernel tid, valid once created */
+    bool stopping;
+
+    pthread_mutex_t init_done_lock;
+    pthread_cond_t init_done_cond;
+} IOThread;
+
+/* A fixed set of IOThreads that work is spread across round-robin */
+typedef struct IOThreadPool {
+    int nr_threads;
+    IOThread **threads;
+    unsigned next;
+} IOThreadPool;
+
+IOThread *iothread_create(const char *name, AioFdMonitor fdmon);
+void iothread_destroy(IOThread *iothread);
+AioContext *iothread_get_aio_context(IOThread *iothread);
+int iothread_set_affinity(IOThread *iothread, int cpu);
+
+IOThreadPool *iothread_pool_new(const char *name, int nr_threads,
+                                AioFdMonitor fdmon, bool pin);
+void iothread_pool_free(IOThreadPool *pool);
+AioContext *iothread_pool_next(IOThreadPool *pool);
+
+#endif /* IOTHREAD_H */
@@ -1,8 +1,54 @@
+#include <limits.h>
 #include "util.h"
 #include "aio.h"
 #include "atomic.h"
 #include "futex.h"
 
+/* Optional spin-then-park.  Before marking the lock contended, a waiter
+ * polls it for a while, in the hope that the owner only holds it for a
+ * short sweep; getting it that way saves both the futex wait and the
+ * owner's wake.  The number of spins adapts to how long the lock has been
+ * held lately: each successful spin pulls spin_avg towards the iterations
+ * it took, each failed one decays it, so a lock held for long (or a
+ * uniprocessor host) soon goes back to parking almost right away.
+ */
+#define QEMU_LOCKCNT_SPIN_MIN      16
+
+void qemu_lockcnt_set_spin(QemuLockCnt *lockcnt, unsigned max_spins)
+{
+    atomic_set(&lockcnt->spin_max, max_spins);
+    atomic_set(&lockcnt->spin_avg, 0);
+}
+
+/* Poll *word until the bits in mask are clear, but no longer than the
+ * current limit of lockcnt.  Returns the last value read.
+ */
+static unsigned lockcnt_spin(QemuLockCnt *lockcnt, unsigned *word,
+                             unsigned mask)
+{
+    unsigned max = atomic_read(&lockcnt->spin_max);
+    unsigned val = atomic_read(word);
+    int avg, limit, i;
+
+    if (!max || !(val & mask)) {
+        return val;
+    }
+
+    avg = atomic_read(&lockcnt->spin_avg);
+    limit = MIN(max, avg * 2 + QEMU_LOCKCNT_SPIN_MIN);
+    for (i = 0; i < limit; i++) {
+        cpu_relax();
+        val = atomic_read(word);
+        if (!(val & mask)) {
+            atomic_set(&lockcnt->spin_avg, avg + (i - avg) / 8);
+            return val;
+        }
+    }
+    atomic_set(&lockcnt->spin_avg, avg - (avg + 7) / 8);
+    return val;
+}
+
+#ifndef CONFIG_SHARDED_LOCKCNT
 /* On Linux, bits 0-1 are a futex-based lock, bits 2-31 are the counter.
  * For the mutex algorithm see Ulrich Drepper's "Futexes Are Tricky" (ok,
  * this is not the most relaxing citation I could make...).  It is similar
@@ -20,6 +66,8 @@
 void qemu_lockcnt_init(QemuLockCnt *lockcnt)
 {
     lockcnt->count = 0;
+    lockcnt->spin_max = 0;
+    lockcnt->spin_avg = 0;
 }
 
 /* *val is the current value of lockcnt->count.
@@ -53,6 +101,13 @@ static bool qemu_lockcnt_cmpxchg_or_wait(QemuLockCnt *lockcnt, int *val,
         }
     }
 
+    /* Give a briefly held lock a chance to be released before moving to
+     * the waiting state.
+     */
+    if ((*val & QEMU_LOCKCNT_STATE_MASK) != QEMU_LOCKCNT_STATE_FREE) {
+        *val = lockcnt_spin(lockcnt, &lockcnt->count, QEMU_LOCKCNT_STATE_MASK);
+    }
+
     /* The slow path moves from locked to waiting if necessary, then
      * does a futex wait.  Both steps can be repeated ad nauseam,
      * only getting out of the loop if we can have another shot at the
@@ -227,3 +282,168 @@ void qemu_lockcnt_unlock(QemuLockCnt *lockcnt)
         lockcnt_wake(lockcnt);
     }
 }
+#else
+/* Sharded variant.  qemu_lockcnt_inc and qemu_lockcnt_dec only touch the
+ * shard of the calling thread, so readers running on different CPUs do
+ * not bounce a cache line.  The writer side pays instead: counting means
+ * summing every shard.
+ *
+ * lockcnt->lock is a futex-based mutex (mutex2 in "Futexes Are Tricky"):
+ * 0 free, 1 locked, 2 locked with waiters.  The count may only leave zero
+ * while it is free; a reader increments its shard and then checks the
+ * lock, while the writer takes the lock and then sums the shards, so with
+ * a full barrier on both sides at least one of them sees the other.  A
+ * reader that finds the lock taken backs off and waits for it.  This is
+ * stricter than the unsharded version, which only makes the 0->1
+ * increment wait, but readers cannot tell cheaply whether the count is
+ * zero.
+ *
+ * Increments and decrements of one critical section may hit different
+ * shards, which is fine because only the sum is meaningful.
+ */
+
+#define QEMU_LOCKCNT_FREE    0
+#define QEMU_LOCKCNT_LOCKED  1
+#define QEMU_LOCKCNT_WAITING 2
+
+static unsigned lockcnt_next_shard;
+static __thread int lockcnt_shard = -1;
+
+static inline QemuLockCntShard *lockcnt_my_shard(QemuLockCnt *lockcnt)
+{
+    if (unlikely(lockcnt_shard < 0)) {
+        lockcnt_shard = atomic_fetch_inc(&lockcnt_next_shard) %
+                        QEMU_LOCKCNT_SHARDS;
+    }
+    return &lockcnt->shards[lockcnt_shard];
+}
+
+void qemu_lockcnt_init(QemuLockCnt *lockcnt)
+{
+    int i;
+
+    for (i = 0; i < QEMU_LOCKCNT_SHARDS; i++) {
+        lockcnt->shards[i].count = 0;
+    }
+    lockcnt->lock = QEMU_LOCKCNT_FREE;
+    lockcnt->spin_max = 0;
+    lockcnt->spin_avg = 0;
+}
+
+void qemu_lockcnt_destroy(QemuLockCnt *lockcnt)
+{
+}
+
+static void lockcnt_wait_unlocked(QemuLockCnt *lockcnt)
+{
+    unsigned val = lockcnt_spin(lockcnt, &lockcnt->lock, ~0u);
+
+    while (val != QEMU_LOCKCNT_FREE) {
+        if (val == QEMU_LOCKCNT_LOCKED) {
+            val = atomic_cmpxchg(&lockcnt->lock, QEMU_LOCKCNT_LOCKED,
+                                 QEMU_LOCKCNT_WAITING);
+            if (val != QEMU_LOCKCNT_LOCKED) {
+                continue;
+            }
+        }
+        qemu_futex_wait(&lockcnt->lock, QEMU_LOCKCNT_WAITING);
+        val = atomic_read(&lockcnt->lock);
+    }
+}
+
+void qemu_lockcnt_inc(QemuLockCnt *lockcnt)
+{
+    QemuLockCntShard *shard = lockcnt_my_shard(lockcnt);
+
+    for (;;) {
+        atomic_inc(&shard->count);
+        smp_mb__after_rmw();
+        if (likely(atomic_read(&lockcnt->lock) == QEMU_LOCKCNT_FREE)) {
+            return;
+        }
+
+        /* The writer may be counting on the count staying zero */
+        atomic_dec(&shard->count);
+        lockcnt_wait_unlocked(lockcnt);
+    }
+}
+
+void qemu_lockcnt_dec(QemuLockCnt *lockcnt)
+{
+    atomic_dec(&lockcnt_my_shard(lockcnt)->count);
+}
+
+unsigned qemu_lockcnt_count(QemuLockCnt *lockcnt)
+{
+    unsigned sum = 0;
+    int i;
+
+    for (i = 0; i < QEMU_LOCKCNT_SHARDS; i++) {
+        sum += atomic_read(&lockcnt->shards[i].count);
+    }
+    return sum;
+}
+
+void qemu_lockcnt_lock(QemuLockCnt *lockcnt)
+{
+    unsigned val;
+
+    val = atomic_cmpxchg(&lockcnt->lock, QEMU_LOCKCNT_FREE,
+                         QEMU_LOCKCNT_LOCKED);
+    while (val != QEMU_LOCKCNT_FREE &&
+           lockcnt_spin(lockcnt, &lockcnt->lock, ~0u) == QEMU_LOCKCNT_FREE) {
+        val = atomic_cmpxchg(&lockcnt->lock, QEMU_LOCKCNT_FREE,
+                             QEMU_LOCKCNT_LOCKED);
+    }
+    if (val != QEMU_LOCKCNT_FREE) {
+        if (val != QEMU_LOCKCNT_WAITING) {
+            val = atomic_xchg(&lockcnt->lock, QEMU_LOCKCNT_WAITING);
+        }
+        while (val != QEMU_LOCKCNT_FREE) {
+            qemu_futex_wait(&lockcnt->lock, QEMU_LOCKCNT_WAITING);
+            val = atomic_xchg(&lockcnt->lock, QEMU_LOCKCNT_WAITING);
+        }
+    }
+    smp_mb__after_rmw();
+}
+
+void qemu_lockcnt_unlock(QemuLockCnt *lockcnt)
+{
+    /* Wake everybody, waiting readers can all proceed */
+    if (atomic_xchg(&lockcnt->lock, QEMU_LOCKCNT_FREE) ==
+        QEMU_LOCKCNT_WAITING) {
+        qemu_futex_wake(&lockcnt->lock, INT_MAX);
+    }
+}
+
+/* If the counter is one, decrement it and return locked.  Otherwise do
+ * nothing.
+ *
+ * If the function returns true, it is impossible for the counter to
+ * become nonzero until the next qemu_lockcnt_unlock.
+ */
+bool qemu_lockcnt_dec_if_lock(QemuLockCnt *lockcnt)
+{
+    /* Cheap check first: with other readers around there is no point in
+     * stopping them.  The sum can only be trusted under the lock.
+     */
+    if (qemu_lockcnt_count(lockcnt) != 1) {
+        return false;
+    }
+
+    qemu_lockcnt_lock(lockcnt);
+    if (qemu_lockcnt_count(lockcnt) == 1) {
+        atomic_dec(&lockcnt_my_shard(lockcnt)->count);
+        return true;
+    }
+    qemu_lockcnt_unlock(lockcnt);
+    return false;
+}
+
+void qemu_lockcnt_inc_and_unlock(QemuLockCnt *lockcnt)
+{
+    /* We hold the lock, so no need to check it */
+    atomic_inc(&lockcnt_my_shard(lockcnt)->count);
+    qemu_lockcnt_unlock(lockcnt);
+}
+#endif
@@ -0,0 +1,206 @@
+/*
+ * Main loop
+ *
+ * In native mode each iteration is a single aio_poll() of the main
+ * AioContext: it computes its own timeout from the BHs and the timer list,
+ * waits on its fd monitor and dispatches, without locking, preparing or
+ * walking a GMainContext.
+ *
+ * The glib mode is an adaptor for programs that also need glib sources:
+ * the AioContexts are attached as GSources to the default GMainContext,
+ * which is driven by hand with g_main_context_prepare/query/check/dispatch.
+ */
+#define _GNU_SOURCE
+#include <glib.h>
+#include <stdio.h>
+#include <poll.h>
+#include "main_loop.h"
+
+static MainLoopMode main_loop_mode;
+static AioContext *qemu_aio_context;
+static AioContext *iohandler_ctx;
+static GArray *gpollfds;
+static int max_priority;
+
+AioContext *qemu_get_aio_context(void)
+{
+    return qemu_aio_context;
+}
+
+AioContext *iohandler_get_aio_context(void)
+{
+    return iohandler_ctx;
+}
+
+void qemu_set_fd_handler(int fd, IOHandler *fd_read, IOHandler *fd_write,
+                         void *opaque)
+{
+    aio_set_fd_handler(qemu_aio_context, fd, fd_read, fd_write, NULL, opaque);
+}
+
+/* Functions to operate on the main QEMU AioContext.  */
+QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
+{
+    return aio_bh_new(qemu_aio_context, cb, opaque);
+}
+
+static void attach_g_source(AioContext *ctx, const char *name)
+{
+    g_source_set_name(&ctx->source, name);
+    g_source_attach(&ctx->source, NULL);
+}
+
+int qemu_init_main_loop(MainLoopMode mode)
+{
+    qemu_aio_context = aio_context_new_fdmon(AIO_FDMON_EPOLL);
+    if (!qemu_aio_context) {
+        perror("create main aio context\n");
+        return -1;
+    }
+    main_loop_mode = mode;
+    qemu_set_current_aio_context(qemu_aio_context);
+
+    if (mode == MAIN_LOOP_NATIVE) {
+        /* There is a single AioContext to wait on, so the I/O handlers
+         * share it with everything else.
+         */
+        aio_context_ref(qemu_aio_context);
+        iohandler_ctx = qemu_aio_context;
+        return 0;
+    }
+
+    iohandler_ctx = aio_context_new_fdmon(AIO_FDMON_EPOLL);
+    if (!iohandler_ctx) {
+        perror("create iohandler aio context\n");
+        aio_context_unref(qemu_aio_context);
+        qemu_aio_context = NULL;
+        return -1;
+    }
+
+    gpollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+    attach_g_source(qemu_aio_context, "aio-context");
+    attach_g_source(iohandler_ctx, "io-handler");
+    return 0;
+}
+
+void qemu_cleanup_main_loop(void)
+{
+    if (main_loop_mode == MAIN_LOOP_GLIB) {
+        /* Detach from the GMainContext, which drops its reference */
+        g_source_destroy(&iohandler_ctx->source);
+        g_source_destroy(&qemu_aio_context->source);
+        g_array_free(gpollfds, TRUE);
+        gpollfds = NULL;
+    }
+
+    qemu_set_current_aio_context(NULL);
+    aio_context_unref(iohandler_ctx);
+    aio_context_unref(qemu_aio_context);
+    iohandler_ctx = qemu_aio_context = NULL;
+}
+
+static int glib_pollfds_idx;
+static int glib_n_poll_fds;
+
+static void glib_pollfds_fill(int64_t *cur_timeout)
+{
+    GMainContext *context = g_main_context_default();
+    int timeout = 0;
+    int64_t timeout_ns;
+    int n;
+
+    g_main_context_prepare(context, &max_priority);
+
+    glib_pollfds_idx = gpollfds->len;
+    n = glib_n_poll_fds;
+
+    do {
+        GPollFD *pfds;
+        glib_n_poll_fds = n;
+        g_array_set_size(gpollfds, glib_pollfds_idx + glib_n_poll_fds);
+        pfds = &g_array_index(gpollfds, GPollFD, glib_pollfds_idx);
+        n = g_main_context_query(context, max_priority, &timeout, pfds,
+                                 glib_n_poll_fds);
+    } while (n != glib_n_poll_fds);
+
+    if (timeout < 0) {
+        timeout_ns = -1;
+    } else {
+        timeout_ns = (int64_t)timeout * (int64_t)SCALE_MS;
+    }
+
+    *cur_timeout = qemu_soonest_timeout(timeout_ns, *cur_timeout);
+}
+
+static int qemu_poll_ns(GPollFD *fds, guint nfds, int64_t timeout)
+{
+    struct timespec ts;
+    int64_t tvsec;
+
+    if (timeout < 0) {
+        return ppoll((struct pollfd *)fds, nfds, NULL, NULL);
+    }
+
+    tvsec = timeout / 1000000000LL;
+    /* Avoid possibly overflowing and specifying a negative number of
+     * seconds, which would turn a very long timeout into a busy-wait.
+     */
+    if (tvsec > (int64_t)INT32_MAX) {
+        tvsec = INT32_MAX;
+    }
+    ts.tv_sec = tvsec;
+    ts.tv_nsec = timeout % 1000000000LL;
+    return ppoll((struct pollfd *)fds, nfds, &ts, NULL);
+}
+
+static void glib_pollfds_poll(void)
+{
+    GMainContext *context = g_main_context_default();
+    GPollFD *pfds = &g_array_index(gpollfds, GPollFD, glib_pollfds_idx);
+
+    if (g_main_context_check(context, max_priority, pfds, glib_n_poll_fds)) {
+        g_main_context_dispatch(context);
+    }
+}
+
+static int main_loop_wait_glib(bool nonblocking)
+{
+    GMainContext *context = g_main_context_default();
+    int64_t timeout_ns;
+    int ret;
+
+    g_main_context_acquire(context);
+
+    /* glib rounds the GSource timeouts up to milliseconds, use the exact
+     * timer deadlines of our own contexts.
+     */
+    if (nonblocking) {
+        timeout_ns = 0;
+    } else {
+        timeout_ns = qemu_soonest_timeout(
+                         timerlist_deadline_ns(&qemu_aio_context->tl),
+                         timerlist_deadline_ns(&iohandler_ctx->tl));
+    }
+
+    g_array_set_size(gpollfds, 0);
+    glib_pollfds_fill(&timeout_ns);
+
+    ret = qemu_poll_ns((GPollFD *)gpollfds->data, gpollfds->len, timeout_ns);
+
+    glib_pollfds_poll();
+
+    g_main_context_release(context);
+
+    return ret;
+}
+
+/* Run one iteration of the main loop.  Returns the number of ready file
+ * descriptors in glib mode and whether progress was made in native mode.
+ */
+int main_loop_wait(bool nonblocking)
+{
+    if (main_loop_mode == MAIN_LOOP_NATIVE) {
+        return aio_poll(qemu_aio_context, !nonblocking);
+    }
+    return main_loop_wait_glib(nonblocking);
+}
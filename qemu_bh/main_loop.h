@@ -0,0 +1,29 @@
+#ifndef MAIN_LOOP_H
+#define MAIN_LOOP_H
+
+#include "async.h"
+
+/* How main_loop_wait() waits for events */
+typedef enum {
+    /* aio_poll() on the main AioContext, glib is not involved */
+    MAIN_LOOP_NATIVE,
+
+    /* The AioContexts are GSources of the default GMainContext and every
+     * iteration goes through g_main_context_prepare/query/check/dispatch.
+     * Only needed when glib sources must run alongside the AioContexts.
+     */
+    MAIN_LOOP_GLIB,
+} MainLoopMode;
+
+int qemu_init_main_loop(MainLoopMode mode);
+void qemu_cleanup_main_loop(void);
+int main_loop_wait(bool nonblocking);
+
+AioContext *qemu_get_aio_context(void);
+AioContext *iohandler_get_aio_context(void);
+
+void qemu_set_fd_handler(int fd, IOHandler *fd_read, IOHandler *fd_write,
+                         void *opaque);
+QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque);
+
+#endif /* MAIN_LOOP_H */
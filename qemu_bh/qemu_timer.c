@@ -0,0 +1,318 @@
+/*
+ * Timer lists
+ *
+ * Each AioContext owns a QEMUTimerList.  Its nearest deadline is folded
+ * into the timeout aio_poll() and the GSource pass to poll/epoll/io_uring,
+ * and expired timers are run after the bottom halves and fd handlers.
+ */
+#include <glib.h>
+#include <limits.h>
+#include "atomic.h"
+#include "qemu_timer.h"
+
+int qemu_timeout_ns_to_ms(int64_t ns)
+{
+    int64_t ms;
+
+    if (ns < 0) {
+        return -1;
+    }
+    if (!ns) {
+        return 0;
+    }
+
+    /* Always round up, because it's better to wait too long than to wait too
+     * little and effectively busy-wait
+     */
+    ms = (ns + SCALE_MS - 1) / SCALE_MS;
+
+    /* To avoid overflow problems, limit this to 2^31, i.e. approx 25 days */
+    return ms < INT_MAX ? ms : INT_MAX;
+}
+
+/* Binary min-heap helpers, called with active_timers_lock held */
+
+static void timer_heap_set(QEMUTimerList *timer_list, int i, QEMUTimer *ts)
+{
+    timer_list->heap[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timer_heap_sift_up(QEMUTimerList *timer_list, int i)
+{
+    QEMUTimer *ts = timer_list->heap[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (timer_list->heap[parent]->expire_time <= ts->expire_time) {
+            break;
+        }
+        timer_heap_set(timer_list, i, timer_list->heap[parent]);
+        i = parent;
+    }
+    timer_heap_set(timer_list, i, ts);
+}
+
+static void timer_heap_sift_down(QEMUTimerList *timer_list, int i)
+{
+    QEMUTimer *ts = timer_list->heap[i];
+    int n = timer_list->nr_timers;
+
+    for (;;) {
+        int child = 2 * i + 1;
+
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n &&
+            timer_list->heap[child + 1]->expire_time <
+            timer_list->heap[child]->expire_time) {
+            child++;
+        }
+        if (ts->expire_time <= timer_list->heap[child]->expire_time) {
+            break;
+        }
+        timer_heap_set(timer_list, i, timer_list->heap[child]);
+        i = child;
+    }
+    timer_heap_set(timer_list, i, ts);
+}
+
+static void timer_heap_insert(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    if (timer_list->nr_timers == timer_list->heap_size) {
+        timer_list->heap_size = timer_list->heap_size ?
+                                timer_list->heap_size * 2 : 16;
+        timer_list->heap = g_renew(QEMUTimer *, timer_list->heap,
+                                   timer_list->heap_size);
+    }
+    timer_heap_set(timer_list, timer_list->nr_timers++, ts);
+    timer_heap_sift_up(timer_list, ts->heap_index);
+}
+
+static void timer_heap_remove(QEMUTimerList *timer_list, QEMUTimer *ts)
+{
+    int i = ts->heap_index;
+    QEMUTimer *last = timer_list->heap[--timer_list->nr_timers];
+
+    ts->heap_index = -1;
+    ts->expire_time = -1;
+    if (last == ts) {
+        return;
+    }
+
+    /* Move the last timer into the hole and restore the heap property,
+     * which may require moving it either way.
+     */
+    timer_heap_set(timer_list, i, last);
+    if (i > 0 &&
+        timer_list->heap[(i - 1) / 2]->expire_time > last->expire_time) {
+        timer_heap_sift_up(timer_list, i);
+    } else {
+        timer_heap_sift_down(timer_list, i);
+    }
+}
+
+void timerlist_init(QEMUTimerList *timer_list,
+                    QEMUTimerListNotifyCB *cb, void *opaque)
+{
+    pthread_mutex_init(&timer_list->active_timers_lock, NULL);
+    timer_list->heap = NULL;
+    timer_list->nr_timers = 0;
+    timer_list->heap_size = 0;
+    timer_list->notify_cb = cb;
+    timer_list->notify_opaque = opaque;
+}
+
+/* The timers themselves belong to their users, who must have deleted them */
+void timerlist_cleanup(QEMUTimerList *timer_list)
+{
+    g_free(timer_list->heap);
+    timer_list->heap = NULL;
+    timer_list->nr_timers = timer_list->heap_size = 0;
+    pthread_mutex_destroy(&timer_list->active_timers_lock);
+}
+
+bool timerlist_has_timers(QEMUTimerList *timer_list)
+{
+    return atomic_read(&timer_list->nr_timers) != 0;
+}
+
+bool timerlist_expired(QEMUTimerList *timer_list)
+{
+    int64_t expire_time;
+
+    if (!timerlist_has_timers(timer_list)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&timer_list->active_timers_lock);
+    if (!timer_list->nr_timers) {
+        pthread_mutex_unlock(&timer_list->active_timers_lock);
+        return false;
+    }
+    expire_time = timer_list->heap[0]->expire_time;
+    pthread_mutex_unlock(&timer_list->active_timers_lock);
+
+    return expire_time <= qemu_clock_get_ns();
+}
+
+/* Return the number of nanoseconds until the first timer expires, 0 if it
+ * has expired already, -1 if there are no timers.
+ */
+int64_t timerlist_deadline_ns(QEMUTimerList *timer_list)
+{
+    int64_t delta;
+    int64_t expire_time;
+
+    if (!timerlist_has_timers(timer_list)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&timer_list->active_timers_lock);
+    if (!timer_list->nr_timers) {
+        pthread_mutex_unlock(&timer_list->active_timers_lock);
+        return -1;
+    }
+    expire_time = timer_list->heap[0]->expire_time;
+    pthread_mutex_unlock(&timer_list->active_timers_lock);
+
+    delta = expire_time - qemu_clock_get_ns();
+    return delta <= 0 ? 0 : delta;
+}
+
+/* Run the callbacks of all expired timers; a callback may re-arm or delete
+ * any timer, including its own.  Returns true if a callback was run.
+ */
+bool timerlist_run_timers(QEMUTimerList *timer_list)
+{
+    QEMUTimer *ts;
+    int64_t current_time;
+    bool progress = false;
+    QEMUTimerCB *cb;
+    void *opaque;
+
+    if (!timerlist_has_timers(timer_list)) {
+        return false;
+    }
+
+    current_time = qemu_clock_get_ns();
+    pthread_mutex_lock(&timer_list->active_timers_lock);
+    for (;;) {
+        ts = timer_list->nr_timers ? timer_list->heap[0] : NULL;
+        if (!ts || ts->expire_time > current_time) {
+            break;
+        }
+
+        /* remove timer from the heap before calling the callback */
+        timer_heap_remove(timer_list, ts);
+        cb = ts->cb;
+        opaque = ts->opaque;
+
+        /* run the callback (the timer list can be modified) */
+        pthread_mutex_unlock(&timer_list->active_timers_lock);
+        cb(opaque);
+        pthread_mutex_lock(&timer_list->active_timers_lock);
+
+        progress = true;
+    }
+    pthread_mutex_unlock(&timer_list->active_timers_lock);
+
+    return progress;
+}
+
+void timer_init_tl(QEMUTimer *ts, QEMUTimerList *timer_list, int scale,
+                   QEMUTimerCB *cb, void *opaque)
+{
+    ts->timer_list = timer_list;
+    ts->cb = cb;
+    ts->opaque = opaque;
+    ts->scale = scale;
+    ts->expire_time = -1;
+    ts->heap_index = -1;
+}
+
+QEMUTimer *timer_new_tl(QEMUTimerList *timer_list, int scale,
+                        QEMUTimerCB *cb, void *opaque)
+{
+    QEMUTimer *ts = g_new0(QEMUTimer, 1);
+
+    timer_init_tl(ts, timer_list, scale, cb, opaque);
+    return ts;
+}
+
+void timer_free(QEMUTimer *ts)
+{
+    timer_del(ts);
+    g_free(ts);
+}
+
+/* stop a timer, but do not dealloc it */
+void timer_del(QEMUTimer *ts)
+{
+    QEMUTimerList *timer_list = ts->timer_list;
+
+    pthread_mutex_lock(&timer_list->active_timers_lock);
+    if (ts->heap_index >= 0) {
+        timer_heap_remove(timer_list, ts);
+    }
+    pthread_mutex_unlock(&timer_list->active_timers_lock);
+}
+
+/* modify the current timer so that it will be fired when current_time
+ * >= expire_time. The corresponding callback will be called.
+ */
+void timer_mod_ns(QEMUTimer *ts, int64_t expire_time)
+{
+    QEMUTimerList *timer_list = ts->timer_list;
+    bool rearm;
+
+    pthread_mutex_lock(&timer_list->active_timers_lock);
+    if (ts->heap_index >= 0) {
+        int64_t old_time = ts->expire_time;
+
+        ts->expire_time = MAX(expire_time, 0);
+        if (ts->expire_time < old_time) {
+            timer_heap_sift_up(timer_list, ts->heap_index);
+        } else {
+            timer_heap_sift_down(timer_list, ts->heap_index);
+        }
+    } else {
+        ts->expire_time = MAX(expire_time, 0);
+        timer_heap_insert(timer_list, ts);
+    }
+    rearm = ts->heap_index == 0;
+    pthread_mutex_unlock(&timer_list->active_timers_lock);
+
+    /* Rearm if necessary  */
+    if (rearm && timer_list->notify_cb) {
+        timer_list->notify_cb(timer_list->notify_opaque);
+    }
+}
+
+/* modify the current timer so that it will be fired when current_time
+ * >= expire_time. The corresponding callback will be called.
+ * @expire_time is in the units of the timer's scale.
+ */
+void timer_mod(QEMUTimer *ts, int64_t expire_time)
+{
+    timer_mod_ns(ts, expire_time * ts->scale);
+}
+
+bool timer_pending(QEMUTimer *ts)
+{
+    return atomic_read(&ts->expire_time) != -1;
+}
+
+bool timer_expired(QEMUTimer *ts, int64_t current_time)
+{
+    int64_t expire_time = atomic_read(&ts->expire_time);
+
+    return expire_time != -1 && expire_time <= current_time * ts->scale;
+}
+
+int64_t timer_expire_time_ns(QEMUTimer *ts)
+{
+    return timer_pending(ts) ? ts->expire_time : -1;
+}
@@ -0,0 +1,87 @@
+#ifndef QEMU_TIMER_H
+#define QEMU_TIMER_H
+
+#include <pthread.h>
+#include "util.h"
+
+#define SCALE_MS 1000000
+#define SCALE_US 1000
+#define SCALE_NS 1
+
+typedef void QEMUTimerCB(void *opaque);
+typedef void QEMUTimerListNotifyCB(void *opaque);
+
+typedef struct QEMUTimer QEMUTimer;
+typedef struct QEMUTimerList QEMUTimerList;
+
+struct QEMUTimer {
+    int64_t expire_time;        /* in nanoseconds */
+    QEMUTimerList *timer_list;
+    QEMUTimerCB *cb;
+    void *opaque;
+    int scale;
+    int heap_index;             /* -1 if the timer is not pending */
+};
+
+/* Pending timers of an AioContext, kept in a binary min-heap ordered by
+ * expire_time so that arming, cancelling and expiring a timer are
+ * O(log n) and the nearest deadline is O(1).  Timers may be armed and
+ * cancelled from any thread; callbacks run in the thread that calls
+ * timerlist_run_timers().
+ */
+struct QEMUTimerList {
+    pthread_mutex_t active_timers_lock;
+    QEMUTimer **heap;
+    int nr_timers;
+    int heap_size;
+
+    /* Called when a timer becomes the first to expire, so that the thread
+     * waiting on the list can recompute its timeout.
+     */
+    QEMUTimerListNotifyCB *notify_cb;
+    void *notify_opaque;
+};
+
+/* Monotonic clock in nanoseconds, the time base of every timer */
+static inline int64_t qemu_clock_get_ns(void)
+{
+    return get_clock();
+}
+
+static inline int64_t qemu_clock_get_ms(void)
+{
+    return qemu_clock_get_ns() / SCALE_MS;
+}
+
+/* Return the soonest of two timeouts in nanoseconds, -1 meaning infinite */
+static inline int64_t qemu_soonest_timeout(int64_t timeout1, int64_t timeout2)
+{
+    /* we can abuse the fact that -1 (which means infinite) is a very
+     * large positive integer when cast to uint64_t
+     */
+    return ((uint64_t) timeout1 < (uint64_t) timeout2) ? timeout1 : timeout2;
+}
+
+int qemu_timeout_ns_to_ms(int64_t ns);
+
+void timerlist_init(QEMUTimerList *timer_list,
+                    QEMUTimerListNotifyCB *cb, void *opaque);
+void timerlist_cleanup(QEMUTimerList *timer_list);
+bool timerlist_has_timers(QEMUTimerList *timer_list);
+bool timerlist_expired(QEMUTimerList *timer_list);
+int64_t timerlist_deadline_ns(QEMUTimerList *timer_list);
+bool timerlist_run_timers(QEMUTimerList *timer_list);
+
+void timer_init_tl(QEMUTimer *ts, QEMUTimerList *timer_list, int scale,
+                   QEMUTimerCB *cb, void *opaque);
+QEMUTimer *timer_new_tl(QEMUTimerList *timer_list, int scale,
+                        QEMUTimerCB *cb, void *opaque);
+void timer_free(QEMUTimer *ts);
+void timer_del(QEMUTimer *ts);
+void timer_mod_ns(QEMUTimer *ts, int64_t expire_time);
+void timer_mod(QEMUTimer *ts, int64_t expire_time);
+bool timer_pending(QEMUTimer *ts);
+bool timer_expired(QEMUTimer *ts, int64_t current_time);
+int64_t timer_expire_time_ns(QEMUTimer *ts);
+
+#endif /* QEMU_TIMER_H */
@@ -0,0 +1,60 @@
+/*
+ * Quiescent-state-based RCU, see rcu.h
+ *
+ * call_rcu1() pushes onto a lock-free LIFO with a full barrier after the
+ * updater has unlinked the element, and the reader steals the whole LIFO
+ * with another one at its quiescent state.  So when a callback runs, the
+ * reader has left the critical section in which it may have seen the
+ * element, and it sees the element unlinked from then on.
+ */
+#include <glib.h>
+#include <assert.h>
+#include "atomic.h"
+#include "rcu.h"
+
+void rcu_domain_init(RCUDomain *d)
+{
+    d->pending = NULL;
+    d->read_depth = 0;
+}
+
+/* Run the callbacks that are still queued.  There must be no reader left. */
+void rcu_domain_cleanup(RCUDomain *d)
+{
+    assert(d->read_depth == 0);
+
+    /* Callbacks may queue more callbacks */
+    while (atomic_read(&d->pending)) {
+        rcu_quiescent_state(d);
+    }
+}
+
+/* Called by the reader thread outside any critical section */
+void rcu_quiescent_state(RCUDomain *d)
+{
+    struct rcu_head *head, *next, *prev = NULL;
+
+    head = atomic_xchg(&d->pending, NULL);
+
+    /* Run the callbacks in the order they were queued */
+    while (head) {
+        next = head->next;
+        head->next = prev;
+        prev = head;
+        head = next;
+    }
+    while ((head = prev)) {
+        prev = head->next;
+        head->func(head);
+    }
+}
+
+void call_rcu1(RCUDomain *d, struct rcu_head *head, RCUCBFunc *func)
+{
+    struct rcu_head *old;
+
+    head->func = func;
+    do {
+        old = head->next = atomic_read(&d->pending);
+    } while (atomic_cmpxchg(&d->pending, old, head) != old);
+}
@@ -0,0 +1,73 @@
+#ifndef QEMU_RCU_H
+#define QEMU_RCU_H
+
+#include <stddef.h>
+#include "atomic.h"
+
+/*
+ * Quiescent-state-based RCU for data read by one event loop
+ *
+ * An RCUDomain protects data that is modified by any thread but only read
+ * by the thread running one event loop, such as the handler list of an
+ * AioContext.  Updaters unlink elements with the *_RCU list macros and
+ * hand them to call_rcu(); the reader brackets each loop iteration with
+ * rcu_read_lock()/rcu_read_unlock().  Leaving the outermost critical
+ * section is a quiescent state: the reader holds no pointer into the data
+ * any more and later iterations cannot find the unlinked elements, so
+ * every callback queued until then is run right there.
+ *
+ * The read side costs no atomic operation and no memory barrier.  The
+ * reader may block inside a critical section (e.g. in ppoll or
+ * epoll_wait), so an updater must wake it up, for example with
+ * aio_notify(), if it wants its callbacks to run promptly.
+ */
+
+struct rcu_head;
+typedef void RCUCBFunc(struct rcu_head *head);
+
+struct rcu_head {
+    struct rcu_head *next;
+    RCUCBFunc *func;
+};
+
+typedef struct RCUDomain {
+    /* Callbacks queued by call_rcu1, pushed by any thread */
+    struct rcu_head *pending;
+
+    /* Nesting level of rcu_read_lock, only used by the reader thread */
+    int read_depth;
+} RCUDomain;
+
+void rcu_domain_init(RCUDomain *d);
+void rcu_domain_cleanup(RCUDomain *d);
+void rcu_quiescent_state(RCUDomain *d);
+void call_rcu1(RCUDomain *d, struct rcu_head *head, RCUCBFunc *func);
+
+static inline void rcu_read_lock(RCUDomain *d)
+{
+    d->read_depth++;
+    barrier();
+}
+
+static inline void rcu_read_unlock(RCUDomain *d)
+{
+    barrier();
+    if (--d->read_depth == 0 && atomic_read(&d->pending)) {
+        rcu_quiescent_state(d);
+    }
+}
+
+/* Call @func(@obj) after a grace period.  The rcu_head @field must be the
+ * first field of @obj, so that @func can take @obj directly.
+ */
+#define call_rcu(d, obj, func, field)                                       \
+    call_rcu1((d), ({                                                       \
+        char __attribute__((unused))                                        \
+            offset_must_be_zero[-offsetof(typeof(*(obj)), field)];          \
+        &(obj)->field;                                                      \
+    }), (RCUCBFunc *)(func))
+
+#define g_free_rcu(d, obj, field)                                           \
+    call_rcu(d, obj, g_free, field)
+
+#endif /* QEMU_RCU_H */
@@ -0,0 +1,246 @@
+/*
+ * RCU torture test for the AioContext handler list
+ *
+ * One thread runs aio_poll() on a context whose eventfds are all kept
+ * readable, so that every iteration busy-polls and dispatches whatever
+ * handlers are registered.  Updater threads meanwhile register, replace
+ * and remove these handlers as fast as they can.  Each registration gets a
+ * fresh TortureHandler as its opaque; once the handler is replaced or
+ * removed the updater retires it with call_rcu(), which poisons and frees
+ * it.  A callback that sees a poisoned TortureHandler, or an access to a
+ * freed AioHandler (caught by AddressSanitizer), means that a grace period
+ * ended too early.
+ *
+ * Usage: rcutorture [seconds] [updaters]
+ */
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include "atomic.h"
+#include "async.h"
+
+#define NR_SLOTS        32
+
+#define TORTURE_LIVE    0x4c495645
+#define TORTURE_DEAD    0x44454144
+
+typedef struct TortureHandler {
+    struct rcu_head rcu;
+    unsigned magic;
+    int slot;
+} TortureHandler;
+
+typedef struct {
+    int id;
+    unsigned long adds;
+    unsigned long replaces;
+    unsigned long removes;
+} __attribute__((aligned(64))) Updater;
+
+static AioContext *ctx;
+static int slot_fds[NR_SLOTS];
+static int nr_updaters;
+static bool stop;
+
+static unsigned long nr_dispatched;
+static unsigned long nr_polled;
+static unsigned long nr_retired;
+static unsigned long nr_reclaimed;
+static unsigned long nr_errors;
+
+static void torture_check(TortureHandler *th, const char *what)
+{
+    if (atomic_read(&th->magic) != TORTURE_LIVE) {
+        fprintf(stderr, "%s callback ran on a reclaimed handler (slot %d)\n",
+                what, th->slot);
+        atomic_inc(&nr_errors);
+    }
+}
+
+static void torture_read(void *opaque)
+{
+    torture_check(opaque, "io_read");
+    nr_dispatched++;
+}
+
+static bool torture_poll(void *opaque)
+{
+    torture_check(opaque, "io_poll");
+    nr_polled++;
+    return false;
+}
+
+static void torture_reclaim(TortureHandler *th)
+{
+    atomic_set(&th->magic, TORTURE_DEAD);
+    atomic_inc(&nr_reclaimed);
+    g_free(th);
+}
+
+static void torture_retire(TortureHandler *th)
+{
+    atomic_inc(&nr_retired);
+    call_rcu(&ctx->rcu, th, torture_reclaim, rcu);
+}
+
+static TortureHandler *torture_register(int slot)
+{
+    TortureHandler *th = g_new0(TortureHandler, 1);
+
+    th->magic = TORTURE_LIVE;
+    th->slot = slot;
+    aio_set_fd_handler(ctx, slot_fds[slot], torture_read, NULL,
+                       torture_poll, th);
+    return th;
+}
+
+static void *loop_thread(void *opaque)
+{
+    unsigned long *iterations = opaque;
+
+    qemu_set_current_aio_context(ctx);
+    while (!atomic_read(&stop)) {
+        aio_poll(ctx, true);
+        (*iterations)++;
+    }
+    qemu_set_current_aio_context(NULL);
+    return NULL;
+}
+
+/* Each updater owns the slots congruent to its id */
+static void *updater_thread(void *opaque)
+{
+    Updater *u = opaque;
+    TortureHandler *cur[NR_SLOTS] = { NULL };
+    unsigned seed = u->id + 1;
+    int slot;
+
+    while (!atomic_read(&stop)) {
+        unsigned r = rand_r(&seed);
+        TortureHandler *old;
+
+        slot = u->id + (r >> 8) % (NR_SLOTS / nr_updaters) * nr_updaters;
+        old = cur[slot];
+        if (!old) {
+            cur[slot] = torture_register(slot);
+            u->adds++;
+            continue;
+        }
+
+        if (r & 2) {
+            cur[slot] = torture_register(slot);
+            u->replaces++;
+        } else {
+            aio_set_fd_handler(ctx, slot_fds[slot], NULL, NULL, NULL, NULL);
+            cur[slot] = NULL;
+            u->removes++;
+        }
+        torture_retire(old);
+
+        /* Give the loop thread a chance on machines with few CPUs */
+        if (!(r & 0x30)) {
+            sched_yield();
+        }
+    }
+
+    for (slot = 0; slot < NR_SLOTS; slot++) {
+        if (cur[slot]) {
+            aio_set_fd_handler(ctx, slot_fds[slot], NULL, NULL, NULL, NULL);
+            torture_retire(cur[slot]);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct {
+        AioFdMonitor fdmon;
+        const char *name;
+    } fdmons[] = {
+        { AIO_FDMON_POLL, "poll" },
+        { AIO_FDMON_EPOLL, "epoll" },
+        { AIO_FDMON_IO_URING, "io_uring" },
+    };
+    double seconds = argc > 1 ? atof(argv[1]) : 1;
+    Updater *updaters;
+    unsigned long iterations, adds, replaces, removes;
+    uint64_t value = 1;
+    pthread_t loop, *tids;
+    int i, j;
+
+    nr_updaters = argc > 2 ? atoi(argv[2]) : 2;
+    if (nr_updaters < 1 || nr_updaters > NR_SLOTS) {
+        fprintf(stderr, "updaters must be between 1 and %d\n", NR_SLOTS);
+        return 1;
+    }
+    updaters = g_new0(Updater, nr_updaters);
+    tids = g_new(pthread_t, nr_updaters);
+
+    for (i = 0; i < NR_SLOTS; i++) {
+        slot_fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (write(slot_fds[i], &value, sizeof(value)) != sizeof(value)) {
+            perror("eventfd");
+            return 1;
+        }
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(fdmons); i++) {
+        ctx = aio_context_new_fdmon(fdmons[i].fdmon);
+        aio_context_set_poll_params(ctx, 16384, 0, 0);
+        atomic_set(&stop, false);
+        nr_dispatched = nr_polled = nr_retired = nr_reclaimed = 0;
+        iterations = adds = replaces = removes = 0;
+
+        pthread_create(&loop, NULL, loop_thread, &iterations);
+        for (j = 0; j < nr_updaters; j++) {
+            updaters[j] = (Updater) { .id = j };
+            pthread_create(&tids[j], NULL, updater_thread, &updaters[j]);
+        }
+
+        usleep(seconds * 1000000);
+        atomic_set(&stop, true);
+
+        for (j = 0; j < nr_updaters; j++) {
+            pthread_join(tids[j], NULL);
+            adds += updaters[j].adds;
+            replaces += updaters[j].replaces;
+            removes += updaters[j].removes;
+        }
+        aio_notify(ctx);
+        pthread_join(loop, NULL);
+
+        /* Let the fd monitor and RCU retire what is left */
+        aio_poll(ctx, false);
+        aio_poll(ctx, false);
+
+        g_print("%-8s %8lu iterations, %9lu dispatched, %9lu polled, "
+                "%7lu adds, %7lu replaces, %7lu removes, %7lu/%lu reclaimed\n",
+                fdmons[i].name, iterations, nr_dispatched, nr_polled, adds,
+                replaces, removes, nr_reclaimed, nr_retired);
+        if (nr_reclaimed != nr_retired) {
+            fprintf(stderr, "%lu handlers were never reclaimed\n",
+                    nr_retired - nr_reclaimed);
+            nr_errors++;
+        }
+
+        aio_context_unref(ctx);
+    }
+
+    for (i = 0; i < NR_SLOTS; i++) {
+        close(slot_fds[i]);
+    }
+    g_free(tids);
+    g_free(updaters);
+
+    if (nr_errors) {
+        g_print("FAILED: %lu errors\n", nr_errors);
+        return 1;
+    }
+    g_print("OK\n");
+    return 0;
+}
@@ -0,0 +1,377 @@
+/*
+ * Thread pool for blocking or CPU-heavy work
+ *
+ * Each AioContext can have a pool of worker threads, created on its first
+ * thread_pool_submit_aio().  Every worker owns a deque of jobs: the
+ * submitter pushes a job onto the deque of a parked worker if there is one,
+ * otherwise round-robin; a worker pops the oldest job of its own deque and,
+ * once it is empty, steals the newer half of another one before it parks.
+ *
+ * Finished jobs are pushed onto a lock-free list, and only the push that
+ * finds the list empty schedules the completion BH.  So a burst of
+ * completions costs one BH and one aio_notify in the context's thread,
+ * and the callbacks run in the order the jobs finished.
+ */
+#include <glib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "atomic.h"
+#include "futex.h"
+#include "thread_pool.h"
+
+/* Most jobs a thief takes at once */
+#define THREAD_POOL_MAX_STEAL   32
+
+enum {
+    WORKER_RUNNING,
+    WORKER_PARKED,
+};
+
+typedef struct ThreadPoolElement ThreadPoolElement;
+struct ThreadPoolElement {
+    ThreadPoolFunc *func;
+    void *arg;
+    ThreadPoolCompletionFunc *cb;
+    int ret;
+    ThreadPoolElement *next;
+};
+
+typedef struct ThreadPoolWorker {
+    ThreadPool *pool;
+    pthread_t thread;
+    int index;
+
+    /* Ring of jobs, jobs[head & (size - 1)] is the oldest.  Pushed by the
+     * submitter, popped by the owner, stolen by the other workers, all with
+     * lock taken; head and tail are also read without it to skip empty
+     * deques.
+     */
+    pthread_mutex_t lock;
+    ThreadPoolElement **jobs;
+    unsigned head;
+    unsigned tail;
+    unsigned size;
+
+    /* Futex word, WORKER_PARKED while the worker sleeps */
+    int state;
+
+    unsigned long steals;
+} __attribute__((aligned(64))) ThreadPoolWorker;
+
+struct ThreadPool {
+    AioContext *ctx;
+    int nr_workers;
+    ThreadPoolWorker *workers;
+    bool stopping;
+
+    /* Finished jobs, newest first, pushed by the workers */
+    ThreadPoolElement *completions;
+    QEMUBH *completion_bh;
+
+    /* Only touched by the thread running ctx */
+    unsigned next_worker;
+    unsigned nr_inflight;
+    ThreadPoolStats stats;
+};
+
+static unsigned worker_nr_jobs(ThreadPoolWorker *w)
+{
+    return atomic_read(&w->tail) - atomic_read(&w->head);
+}
+
+/* Called with w->lock taken */
+static void worker_grow(ThreadPoolWorker *w)
+{
+    ThreadPoolElement **jobs = g_new(ThreadPoolElement *, w->size * 2);
+    unsigned i;
+
+    for (i = w->head; i != w->tail; i++) {
+        jobs[i & (w->size * 2 - 1)] = w->jobs[i & (w->size - 1)];
+    }
+    g_free(w->jobs);
+    w->jobs = jobs;
+    w->size *= 2;
+}
+
+static void worker_push(ThreadPoolWorker *w, ThreadPoolElement **reqs, int n)
+{
+    int i;
+
+    pthread_mutex_lock(&w->lock);
+    while (w->tail - w->head + n > w->size) {
+        worker_grow(w);
+    }
+    for (i = 0; i < n; i++) {
+        w->jobs[(w->tail + i) & (w->size - 1)] = reqs[i];
+    }
+    atomic_set(&w->tail, w->tail + n);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static ThreadPoolElement *worker_pop(ThreadPoolWorker *w)
+{
+    ThreadPoolElement *req = NULL;
+
+    if (!worker_nr_jobs(w)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    if (w->head != w->tail) {
+        req = w->jobs[w->head & (w->size - 1)];
+        atomic_set(&w->head, w->head + 1);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return req;
+}
+
+/* Take the newer half of the jobs of the first other worker that has any.
+ * Returns one of them and keeps the others in @w's own deque.
+ */
+static ThreadPoolElement *worker_steal(ThreadPoolWorker *w)
+{
+    ThreadPool *pool = w->pool;
+    ThreadPoolElement *reqs[THREAD_POOL_MAX_STEAL];
+    int i, j, n = 0;
+
+    for (i = 1; i < pool->nr_workers && !n; i++) {
+        ThreadPoolWorker *victim = &pool->workers[(w->index + i) %
+                                                  pool->nr_workers];
+
+        if (!worker_nr_jobs(victim)) {
+            continue;
+        }
+
+        pthread_mutex_lock(&victim->lock);
+        n = MIN((victim->tail - victim->head + 1) / 2, THREAD_POOL_MAX_STEAL);
+        for (j = 0; j < n; j++) {
+            unsigned k = victim->tail - n + j;
+
+            reqs[j] = victim->jobs[k & (victim->size - 1)];
+        }
+        atomic_set(&victim->tail, victim->tail - n);
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    if (!n) {
+        return NULL;
+    }
+    atomic_set(&w->steals, w->steals + n);
+    if (n > 1) {
+        worker_push(w, reqs + 1, n - 1);
+    }
+    return reqs[0];
+}
+
+static bool thread_pool_has_jobs(ThreadPool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->nr_workers; i++) {
+        if (worker_nr_jobs(&pool->workers[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void thread_pool_complete(ThreadPool *pool, ThreadPoolElement *req)
+{
+    ThreadPoolElement *old;
+
+    /* The cmpxchg also makes req->ret visible to the completion BH */
+    do {
+        old = req->next = atomic_read(&pool->completions);
+    } while (atomic_cmpxchg(&pool->completions, old, req) != old);
+
+    /* Whoever finds the list empty is the one who schedules the BH */
+    if (!old) {
+        qemu_bh_schedule(pool->completion_bh);
+    }
+}
+
+static void *worker_thread(void *opaque)
+{
+    ThreadPoolWorker *w = opaque;
+    ThreadPool *pool = w->pool;
+    ThreadPoolElement *req;
+
+    for (;;) {
+        req = worker_pop(w);
+        if (!req) {
+            req = worker_steal(w);
+        }
+        if (req) {
+            req->ret = req->func(req->arg);
+            thread_pool_complete(pool, req);
+            continue;
+        }
+
+        if (atomic_read(&pool->stopping)) {
+            break;
+        }
+
+        /* Write the state before looking at the deques again.  Pairs with
+         * the smp_mb in thread_pool_submit_aio, so that either the submitter
+         * sees us parked and wakes us up, or we see its job.
+         */
+        atomic_set(&w->state, WORKER_PARKED);
+        smp_mb();
+        if (!thread_pool_has_jobs(pool) && !atomic_read(&pool->stopping)) {
+            qemu_futex_wait(&w->state, WORKER_PARKED);
+        }
+        atomic_set(&w->state, WORKER_RUNNING);
+    }
+    return NULL;
+}
+
+static void worker_wake(ThreadPool *pool, ThreadPoolWorker *w)
+{
+    if (atomic_xchg(&w->state, WORKER_RUNNING) == WORKER_PARKED) {
+        qemu_futex_wake(&w->state, 1);
+        pool->stats.wakeups++;
+    }
+}
+
+static ThreadPoolWorker *thread_pool_find_parked(ThreadPool *pool)
+{
+    int i;
+
+    for (i = 0; i < pool->nr_workers; i++) {
+        ThreadPoolWorker *w = &pool->workers[(pool->next_worker + i) %
+                                             pool->nr_workers];
+
+        if (atomic_read(&w->state) == WORKER_PARKED) {
+            return w;
+        }
+    }
+    return NULL;
+}
+
+static void thread_pool_completion_bh(void *opaque)
+{
+    ThreadPool *pool = opaque;
+    ThreadPoolElement *req, *next, *prev = NULL;
+
+    req = atomic_xchg(&pool->completions, NULL);
+
+    /* Run the callbacks in the order the jobs finished */
+    while (req) {
+        next = req->next;
+        req->next = prev;
+        prev = req;
+        req = next;
+    }
+
+    pool->stats.batches++;
+    while ((req = prev)) {
+        prev = req->next;
+        pool->nr_inflight--;
+        pool->stats.completed++;
+        req->cb(req->arg, req->ret);
+        g_free(req);
+    }
+}
+
+/* Run @func(@arg) in a worker thread of @ctx's pool, then @cb(@arg, ret) in
+ * the thread running @ctx.  Must be called from that thread.
+ */
+void thread_pool_submit_aio(AioContext *ctx, ThreadPoolFunc *func, void *arg,
+                            ThreadPoolCompletionFunc *cb)
+{
+    ThreadPool *pool = aio_get_thread_pool(ctx);
+    ThreadPoolElement *req = g_new(ThreadPoolElement, 1);
+    ThreadPoolWorker *w;
+
+    *req = (ThreadPoolElement) {
+        .func = func,
+        .arg = arg,
+        .cb = cb,
+    };
+    pool->nr_inflight++;
+    pool->stats.submitted++;
+
+    w = thread_pool_find_parked(pool);
+    if (!w) {
+        w = &pool->workers[pool->next_worker];
+    }
+    pool->next_worker = (w->index + 1) % pool->nr_workers;
+    worker_push(w, &req, 1);
+
+    /* Push the job before looking at the workers' state, see worker_thread.
+     * If its owner is busy, a parked worker can steal it.
+     */
+    smp_mb();
+    if (atomic_read(&w->state) != WORKER_PARKED) {
+        w = thread_pool_find_parked(pool);
+    }
+    if (w) {
+        worker_wake(pool, w);
+    }
+}
+
+ThreadPool *thread_pool_new(AioContext *ctx, int nr_workers)
+{
+    ThreadPool *pool = g_new0(ThreadPool, 1);
+    int i;
+
+    if (nr_workers <= 0) {
+        nr_workers = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    }
+
+    pool->ctx = ctx;
+    pool->nr_workers = nr_workers;
+    pool->completion_bh = aio_bh_new_prio(ctx, thread_pool_completion_bh,
+                                          pool, QEMU_BH_PRIO_HIGH);
+    pool->workers = g_new0(ThreadPoolWorker, nr_workers);
+    for (i = 0; i < nr_workers; i++) {
+        ThreadPoolWorker *w = &pool->workers[i];
+
+        w->pool = pool;
+        w->index = i;
+        w->size = 64;
+        w->jobs = g_new(ThreadPoolElement *, w->size);
+        pthread_mutex_init(&w->lock, NULL);
+    }
+    for (i = 0; i < nr_workers; i++) {
+        pthread_create(&pool->workers[i].thread, NULL, worker_thread,
+                       &pool->workers[i]);
+    }
+    return pool;
+}
+
+/* All submitted jobs must have completed */
+void thread_pool_free(ThreadPool *pool)
+{
+    int i;
+
+    assert(pool->nr_inflight == 0);
+
+    atomic_set(&pool->stopping, true);
+    smp_mb();
+    for (i = 0; i < pool->nr_workers; i++) {
+        worker_wake(pool, &pool->workers[i]);
+    }
+    for (i = 0; i < pool->nr_workers; i++) {
+        ThreadPoolWorker *w = &pool->workers[i];
+
+        pthread_join(w->thread, NULL);
+        pthread_mutex_destroy(&w->lock);
+        g_free(w->jobs);
+    }
+
+    qemu_bh_delete(pool->completion_bh);
+    g_free(pool->workers);
+    g_free(pool);
+}
+
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats)
+{
+    int i;
+
+    *stats = pool->stats;
+    for (i = 0; i < pool->nr_workers; i++) {
+        stats->steals += atomic_read(&pool->workers[i].steals);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "async.h"
+
+/* Runs in a worker thread; the return value is passed to the completion */
+typedef int ThreadPoolFunc(void *arg);
+
+/* Runs in the thread of the AioContext the job was submitted to */
+typedef void ThreadPoolCompletionFunc(void *arg, int ret);
+
+typedef struct ThreadPool ThreadPool;
+
+/* Counters of a pool, see thread_pool_get_stats() */
+typedef struct ThreadPoolStats {
+    unsigned long submitted;   /* jobs submitted */
+    unsigned long completed;   /* completion callbacks run */
+    unsigned long batches;     /* runs of the completion BH */
+    unsigned long steals;      /* jobs taken from another worker's deque */
+    unsigned long wakeups;     /* parked workers woken by a submission */
+} ThreadPoolStats;
+
+ThreadPool *thread_pool_new(AioContext *ctx, int nr_workers);
+void thread_pool_free(ThreadPool *pool);
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats);
+
+void thread_pool_submit_aio(AioContext *ctx, ThreadPoolFunc *func, void *arg,
+                            ThreadPoolCompletionFunc *cb);
+
+ThreadPool *aio_get_thread_pool(AioContext *ctx);
+void aio_context_set_thread_pool_size(AioContext *ctx, int nr_workers);
+
+#endif /* THREAD_POOL_H */
@@ -1,12 +1,24 @@
+#ifndef QEMU_UTIL_H
+#define QEMU_UTIL_H
+
+#include <stdint.h>
+#include <time.h>
+
 #define true 1
 #define false 0
 
 typedef int bool;
 
-typedef signed char  int8_t;
-typedef signed short int16_t;
-typedef signed int   int32_t;
-typedef unsigned char  uint8_t;
-typedef unsigned short uint16_t;
-typedef unsigned int   uint32_t;
-typedef unsigned long long uint64_t;
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x)   __builtin_expect(!!(x), 0)
+
+/* Monotonic clock in nanoseconds */
+static inline int64_t get_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#endif /* QEMU_UTIL_H */